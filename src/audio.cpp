@@ -10,7 +10,7 @@ AudioStreamWAV *Audio::get_wav(String a_path) {
 		return nullptr;
 	}
 
-	if (avformat_open_input(&l_format_ctx, a_path.utf8(), NULL, NULL)) {
+	if (AvioFile::open_input(&l_format_ctx, a_path.utf8(), NULL)) {
 		error = GoZenError::ERR_OPENING_AUDIO;
 		return nullptr;
 	}
@@ -32,8 +32,55 @@ AudioStreamWAV *Audio::get_wav(String a_path) {
 		}
 	}
 
-	avformat_close_input(&l_format_ctx);
+	AvioFile::close_input(&l_format_ctx);
 
 	error = OK;
 	return l_audio;
 }
+
+Dictionary Audio::benchmark_file(String a_path, int a_iterations) {
+	Dictionary l_result = Dictionary();
+	a_iterations = std::max(a_iterations, 1);
+
+	double l_length = 0.;
+	uint64_t l_decode_usec = 0;
+
+	// Only the decoding in FFmpeg::get_audio gets timed, not the opening
+	for (int i = 0; i < a_iterations; i++) {
+		AVFormatContext *l_format_ctx = avformat_alloc_context();
+		if (!l_format_ctx || AvioFile::open_input(&l_format_ctx, a_path.utf8(), NULL)) {
+			UtilityFunctions::printerr("Couldn't open file for benchmark!");
+			return l_result;
+		}
+
+		int l_stream_index = -1;
+		if (avformat_find_stream_info(l_format_ctx, NULL) ||
+				(l_stream_index = av_find_best_stream(l_format_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0)) < 0) {
+			UtilityFunctions::printerr("No audio stream found for benchmark!");
+			AvioFile::close_input(&l_format_ctx);
+			return l_result;
+		}
+
+		AVStream *l_stream = l_format_ctx->streams[l_stream_index];
+		uint64_t l_start = Time::get_singleton()->get_ticks_usec();
+		Ref<AudioStreamWAV> l_audio = FFmpeg::get_audio(l_format_ctx, l_stream);
+		l_decode_usec += Time::get_singleton()->get_ticks_usec() - l_start;
+
+		if (l_audio.is_null()) {
+			UtilityFunctions::printerr("Couldn't decode audio for benchmark!");
+			AvioFile::close_input(&l_format_ctx);
+			return l_result;
+		}
+
+		l_length = l_audio->get_length();
+		AvioFile::close_input(&l_format_ctx);
+	}
+
+	double l_seconds = static_cast<double>(l_decode_usec) / a_iterations / 1000000.0;
+	l_result["decode_usec"] = l_seconds * 1000000.0;
+	l_result["length"] = l_length;
+	l_result["realtime_factor"] = l_seconds > 0 ? l_length / l_seconds : 0.0;
+	l_result["iterations"] = a_iterations;
+
+	return l_result;
+}
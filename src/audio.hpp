@@ -5,8 +5,10 @@
 #include <godot_cpp/classes/image_texture.hpp>
 #include <godot_cpp/variant/utility_functions.hpp>
 #include <godot_cpp/classes/rendering_server.hpp>
+#include <godot_cpp/classes/time.hpp>
 
 #include "ffmpeg.hpp"
+#include "avio_file.hpp"
 #include "gozen_error.hpp"
 
 
@@ -24,11 +26,13 @@ public:
 
 	static inline void enable_debug() { av_log_set_level(AV_LOG_VERBOSE); }
 	static AudioStreamWAV *get_wav(String a_path);
+	static Dictionary benchmark_file(String a_path, int a_iterations = 3);
 
 
 protected:
 	static inline void _bind_methods() {
 		ClassDB::bind_static_method("Audio", D_METHOD("get_error"), &Audio::get_error);
 		ClassDB::bind_static_method("Audio", D_METHOD("get_wav", "a_file_path"), &Audio::get_wav);
+		ClassDB::bind_static_method("Audio", D_METHOD("benchmark_file", "a_file_path", "a_iterations"), &Audio::benchmark_file, DEFVAL(3));
 	}
 };
@@ -1,140 +1,308 @@
 #include "audio_stream_ffmpeg.hpp"
 #include "ffmpeg.hpp"
+#include "avio_audio.hpp"
+#include "avio_file.hpp"
 
 Ref<AudioStreamPlayback> AudioStreamFFmpeg::_instantiate_playback() const
 {
-	auto myplayback = memnew(AudioStreamFFmpegPlayback);
-	myplayback->m_stream = this;
+	Ref<AudioStreamFFmpegPlayback> myplayback = memnew(AudioStreamFFmpegPlayback);
+
+	// Resampling to the mix rate here makes the resampler of
+	// AudioStreamPlaybackResampled step 1:1, so audio only gets resampled once
+	int l_rate = m_sample_rate;
+	if (m_resample_to_mix_rate && AudioServer::get_singleton())
+		l_rate = static_cast<int>(AudioServer::get_singleton()->get_mix_rate());
+
+	// Every playback gets a decoder of its own, so overlapping playbacks
+	// don't mess with each others decoding state
+	if (error || _open_decoder(myplayback->m_codec_ctx, myplayback->m_swr_ctx, l_rate))
+	{
+		UtilityFunctions::printerr("Couldn't create decoder for audio playback!");
+		return Ref<AudioStreamPlayback>();
+	}
+
+	myplayback->m_stream = Ref<AudioStreamFFmpeg>(const_cast<AudioStreamFFmpeg *>(this));
+	if (is_streaming() && myplayback->_open_input())
+	{
+		UtilityFunctions::printerr("Couldn't open file for audio playback!");
+		return Ref<AudioStreamPlayback>();
+	}
 	myplayback->l_stereo = l_stereo;
-	myplayback->fill_buffer();
+	myplayback->mix_rate = l_rate;
+
+	// Around a second of audio, rounded up to a power of two for the ring
+	size_t l_ring_size = 1;
+	while (l_ring_size < static_cast<size_t>(l_rate))
+		l_ring_size <<= 1;
+	myplayback->ring.resize(l_ring_size);
+
 	return myplayback;
 }
 
+int AudioStreamFFmpeg::_open_decoder(AVCodecContext *&a_codec_ctx, struct SwrContext *&a_swr_ctx, int a_rate) const
+{
+	const AVCodec *l_codec_audio = avcodec_find_decoder(m_codec_params->codec_id);
+	if (!l_codec_audio)
+	{
+		UtilityFunctions::printerr("Couldn't find any codec decoder for audio!");
+		return GoZenError::ERR_OPENING_AUDIO;
+	}
+
+	a_codec_ctx = avcodec_alloc_context3(l_codec_audio);
+	if (a_codec_ctx == NULL)
+	{
+		UtilityFunctions::printerr("Couldn't allocate codec context for audio!");
+		return GoZenError::ERR_OPENING_AUDIO;
+	}
+	else if (avcodec_parameters_to_context(a_codec_ctx, m_codec_params))
+	{
+		UtilityFunctions::printerr("Couldn't initialize audio codec context!");
+		avcodec_free_context(&a_codec_ctx);
+		return GoZenError::ERR_OPENING_AUDIO;
+	}
+
+	// Packets come from the cache, the decoder needs to know their time base
+	a_codec_ctx->pkt_timebase = m_time_base;
+
+	// Most decoders give float anyway, only asking so s16 doesn't get forced
+	a_codec_ctx->request_sample_fmt = AV_SAMPLE_FMT_FLT;
+
+	// Open codec - Audio
+	if (avcodec_open2(a_codec_ctx, l_codec_audio, NULL))
+	{
+		UtilityFunctions::printerr("Couldn't open audio codec!");
+		avcodec_free_context(&a_codec_ctx);
+		return GoZenError::ERR_OPENING_AUDIO;
+	}
+
+	// The playback buffer holds float stereo frames, so mono gets upmixed.
+	// Common layouts get converted without swr, see fill_buffer().
+	auto response = swr_alloc_set_opts2(
+		&a_swr_ctx, &l_ch_layout, AV_SAMPLE_FMT_FLT,
+		a_rate > 0 ? a_rate : a_codec_ctx->sample_rate, &a_codec_ctx->ch_layout,
+		a_codec_ctx->sample_fmt, a_codec_ctx->sample_rate, 0,
+		nullptr);
+
+	if (response < 0)
+	{
+		FFmpeg::print_av_error("Failed to obtain SWR context!", response);
+		avcodec_free_context(&a_codec_ctx);
+		return GoZenError::ERR_CREATING_SWR;
+	}
+
+	response = swr_init(a_swr_ctx);
+	if (response < 0)
+	{
+		FFmpeg::print_av_error("Couldn't initialize SWR!", response);
+		avcodec_free_context(&a_codec_ctx);
+		swr_free(&a_swr_ctx);
+		return GoZenError::ERR_CREATING_SWR;
+	}
+
+	return OK;
+}
+
 Ref<AudioStreamFFmpeg> AudioStreamFFmpeg::load_from_file(String a_path)
 {
 	UtilityFunctions::print("start reading from file\n");
-	auto mystream = memnew(AudioStreamFFmpeg);
-	mystream->m_format_ctx = avformat_alloc_context();
+	Ref<AudioStreamFFmpeg> mystream = memnew(AudioStreamFFmpeg);
+	AVFormatContext *l_format_ctx = avformat_alloc_context();
 
-	if (!mystream->m_format_ctx)
+	if (!l_format_ctx)
 	{
 		mystream->error = GoZenError::ERR_CREATING_AV_FORMAT_FAILED;
 		return mystream;
 	}
 
-	if (avformat_open_input(&mystream->m_format_ctx, a_path.utf8(), NULL, NULL))
+	if (AvioFile::open_input(&l_format_ctx, a_path.utf8(), NULL))
 	{
 		mystream->error = GoZenError::ERR_OPENING_AUDIO;
 		return mystream;
 	}
 
-	if (avformat_find_stream_info(mystream->m_format_ctx, NULL))
+	if (avformat_find_stream_info(l_format_ctx, NULL))
 	{
+		AvioFile::close_input(&l_format_ctx);
 		mystream->error = GoZenError::ERR_NO_STREAM_INFO_FOUND;
-		return nullptr;
+		return mystream;
 	}
 
-	for (int i = 0; i < mystream->m_format_ctx->nb_streams; i++)
-	{
-		AVCodecParameters *av_codec_params = mystream->m_format_ctx->streams[i]->codecpar;
+	mystream->error = mystream->_load_packets(l_format_ctx);
+	AvioFile::close_input(&l_format_ctx);
+	return mystream;
+}
 
-		if (!avcodec_find_decoder(av_codec_params->codec_id))
-		{
-			mystream->m_format_ctx->streams[i]->discard = AVDISCARD_ALL;
-			continue;
-		}
-		else if (av_codec_params->codec_type == AVMEDIA_TYPE_AUDIO)
-		{
-			// we got the right track with audio
-			mystream->m_stream = mystream->m_format_ctx->streams[i];
-			mystream->m_stream_idx = i;
-			break;
-		}
-	}
-	if (!mystream->m_format_ctx->streams)
-	{
-		// no audio stream found
-		mystream->error = GoZenError::ERR_OPENING_AUDIO;
-	}
+Ref<AudioStreamFFmpeg> AudioStreamFFmpeg::stream_from_file(String a_path)
+{
+	return _stream_from_file(a_path, AVIOInterruptCB{nullptr, nullptr});
+}
 
-	const AVCodec *l_codec_audio = avcodec_find_decoder(mystream->m_stream->codecpar->codec_id);
-	if (!l_codec_audio)
+Ref<AudioStreamFFmpeg> AudioStreamFFmpeg::_stream_from_file(const String &a_path, AVIOInterruptCB a_interrupt)
+{
+	Ref<AudioStreamFFmpeg> mystream = memnew(AudioStreamFFmpeg);
+	AVFormatContext *l_format_ctx = avformat_alloc_context();
+
+	if (!l_format_ctx)
 	{
-		UtilityFunctions::printerr("Couldn't find any codec decoder for audio!");
+		mystream->error = GoZenError::ERR_CREATING_AV_FORMAT_FAILED;
 		return mystream;
 	}
 
-	mystream->l_codec_ctx_audio = avcodec_alloc_context3(l_codec_audio);
-	if (mystream->l_codec_ctx_audio == NULL)
+	// Video passes its own callback, so cancelling also stops the probing
+	l_format_ctx->interrupt_callback = a_interrupt;
+
+	if (AvioFile::open_input(&l_format_ctx, a_path.utf8(), NULL))
 	{
-		UtilityFunctions::printerr("Couldn't allocate codec context for audio!");
+		mystream->error = GoZenError::ERR_OPENING_AUDIO;
 		return mystream;
 	}
-	else if (avcodec_parameters_to_context(mystream->l_codec_ctx_audio, mystream->m_stream->codecpar))
+
+	if (avformat_find_stream_info(l_format_ctx, NULL))
 	{
-		UtilityFunctions::printerr("Couldn't initialize audio codec context!");
+		AvioFile::close_input(&l_format_ctx);
+		mystream->error = GoZenError::ERR_NO_STREAM_INFO_FOUND;
 		return mystream;
 	}
 
-	// FFmpeg::enable_multithreading(mystream->l_codec_ctx_audio, l_codec_audio);
-	mystream->l_codec_ctx_audio->request_sample_fmt = AV_SAMPLE_FMT_S16;
+	// Only probing, the playbacks open the file again to read the packets
+	if (!(mystream->error = mystream->_find_stream(l_format_ctx)))
+		mystream->error = mystream->_probe_decoder();
+	AvioFile::close_input(&l_format_ctx);
 
-	// Open codec - Audio
-	if (avcodec_open2(mystream->l_codec_ctx_audio, l_codec_audio, NULL))
+	if (!mystream->error)
+		mystream->m_path = a_path.utf8().get_data();
+	return mystream;
+}
+
+Ref<AudioStreamFFmpeg> AudioStreamFFmpeg::load_from_buffer(PackedByteArray a_data)
+{
+	Ref<AudioStreamFFmpeg> mystream = memnew(AudioStreamFFmpeg);
+
+	// The buffer only gets demuxed here, the packets which get copied into
+	// the cache are all that stays in memory
+	AvioAudio l_avio(a_data.ptr(), a_data.size());
+	AVFormatContext *l_format_ctx = l_avio.create_avformat_context();
+
+	if (!l_format_ctx)
 	{
-		UtilityFunctions::printerr("Couldn't open audio codec!");
+		mystream->error = GoZenError::ERR_OPENING_AUDIO;
 		return mystream;
 	}
 
-	if (mystream->l_codec_ctx_audio->ch_layout.nb_channels <= 3)
-		mystream->l_ch_layout = mystream->l_codec_ctx_audio->ch_layout;
-	else
-		mystream->l_ch_layout = AV_CHANNEL_LAYOUT_STEREO;
+	mystream->error = mystream->_load_packets(l_format_ctx);
+	avformat_close_input(&l_format_ctx);
+	return mystream;
+}
 
-	auto response = swr_alloc_set_opts2(
-		&mystream->l_swr_ctx, &mystream->l_ch_layout, AV_SAMPLE_FMT_S16,
-		mystream->l_codec_ctx_audio->sample_rate, &mystream->l_codec_ctx_audio->ch_layout,
-		mystream->l_codec_ctx_audio->sample_fmt, mystream->l_codec_ctx_audio->sample_rate, 0,
-		nullptr);
+int AudioStreamFFmpeg::_find_stream(AVFormatContext *a_format_ctx)
+{
+	AVStream *l_stream = nullptr;
 
-	if (response < 0)
+	for (int i = 0; i < a_format_ctx->nb_streams; i++)
 	{
-		FFmpeg::print_av_error("Failed to obtain SWR context!", response);
-		avcodec_flush_buffers(mystream->l_codec_ctx_audio);
-		avcodec_free_context(&mystream->l_codec_ctx_audio);
-		return mystream;
+		AVCodecParameters *av_codec_params = a_format_ctx->streams[i]->codecpar;
+
+		if (av_codec_params->codec_type == AVMEDIA_TYPE_AUDIO && avcodec_find_decoder(av_codec_params->codec_id))
+		{
+			// we got the right track with audio
+			l_stream = a_format_ctx->streams[i];
+			break;
+		}
 	}
+	if (!l_stream)
+		return GoZenError::ERR_OPENING_AUDIO; // no audio stream found
+
+	// Only the audio gets read
+	for (int i = 0; i < a_format_ctx->nb_streams; i++)
+		if (i != l_stream->index)
+			a_format_ctx->streams[i]->discard = AVDISCARD_ALL;
+
+	m_stream_index = l_stream->index;
+	m_time_base = l_stream->time_base;
+	m_start_time = l_stream->start_time != AV_NOPTS_VALUE ? l_stream->start_time : 0;
+	if (l_stream->duration != AV_NOPTS_VALUE)
+		m_length = l_stream->duration * av_q2d(l_stream->time_base);
+	else if (a_format_ctx->duration != AV_NOPTS_VALUE)
+		m_length = static_cast<double>(a_format_ctx->duration) / AV_TIME_BASE;
+
+	if (!(m_codec_params = avcodec_parameters_alloc()) ||
+		avcodec_parameters_copy(m_codec_params, l_stream->codecpar) < 0)
+		return GoZenError::ERR_OPENING_AUDIO;
+
+	return OK;
+}
 
-	response = swr_init(mystream->l_swr_ctx);
-	if (response < 0)
+int AudioStreamFFmpeg::_load_packets(AVFormatContext *a_format_ctx)
+{
+	if (int l_error = _find_stream(a_format_ctx))
+		return l_error;
+
+	// Reading all packets of the stream at once, after this the file isn't
+	// needed anymore. Timestamps which are missing get the previous one so
+	// m_packet_pts stays sorted for seeking.
+	AVPacket *l_packet = av_packet_alloc();
+	int64_t l_last_pts = m_start_time;
+	int response;
+
+	while ((response = av_read_frame(a_format_ctx, l_packet)) >= 0)
 	{
-		FFmpeg::print_av_error("Couldn't initialize SWR!", response);
-		avcodec_flush_buffers(mystream->l_codec_ctx_audio);
-		avcodec_free_context(&mystream->l_codec_ctx_audio);
-		return mystream;
+		if (l_packet->stream_index != m_stream_index)
+		{
+			av_packet_unref(l_packet);
+			continue;
+		}
+
+		int64_t l_pts = l_packet->pts != AV_NOPTS_VALUE ? l_packet->pts : l_packet->dts;
+		l_last_pts = l_pts != AV_NOPTS_VALUE ? std::max(l_pts, l_last_pts) : l_last_pts;
+
+		AVPacket *l_cached = av_packet_alloc();
+		av_packet_move_ref(l_cached, l_packet);
+		m_cache_size += l_cached->size;
+		m_packets.push_back(l_cached);
+		m_packet_pts.push_back(l_last_pts);
 	}
 
-	// if (!l_frame || !l_decoded_frame || !l_packet) {
-	// 	UtilityFunctions::printerr("Couldn't allocate frames or packet for audio!");
-	// 	avcodec_flush_buffers(l_codec_ctx_audio);
-	// 	avcodec_free_context(&l_codec_ctx_audio);
-	// 	swr_free(&l_swr_ctx);
-	// 	return mystream;
-	// }
+	if (response != AVERROR_EOF)
+		FFmpeg::print_av_error("Error reading audio packets!", response);
 
-	mystream->m_bytes_per_samples = av_get_bytes_per_sample(AV_SAMPLE_FMT_S16);
-	mystream->l_stereo = mystream->l_codec_ctx_audio->ch_layout.nb_channels >= 2;
-	return mystream;
+	av_packet_free(&l_packet);
+
+	if (m_packets.empty())
+		return GoZenError::ERR_OPENING_AUDIO;
+
+	return _probe_decoder();
+}
+
+int AudioStreamFFmpeg::_probe_decoder()
+{
+	// Opening a decoder once to check if playbacks will be able to decode,
+	// the sample rate may only be known after opening it
+	AVCodecContext *l_codec_ctx_audio = nullptr;
+	struct SwrContext *l_swr_ctx = nullptr;
+
+	if (int l_error = _open_decoder(l_codec_ctx_audio, l_swr_ctx, 0))
+		return l_error;
+
+	m_sample_rate = l_codec_ctx_audio->sample_rate;
+	m_bytes_per_samples = av_get_bytes_per_sample(AV_SAMPLE_FMT_FLT);
+	l_stereo = l_codec_ctx_audio->ch_layout.nb_channels >= 2;
+
+	avcodec_free_context(&l_codec_ctx_audio);
+	swr_free(&l_swr_ctx);
+	return OK;
 }
 
 void AudioStreamFFmpegPlayback::_start(double p_from_pos)
 {
+	// AudioStreamPlayer::play() also uses this for seeking
+	_seek(p_from_pos);
 	is_playing = true;
 }
 
 void AudioStreamFFmpegPlayback::_stop()
 {
 	is_playing = false;
+	_stop_decoding();
 }
 
 bool AudioStreamFFmpegPlayback::_is_playing() const
@@ -144,119 +312,335 @@ bool AudioStreamFFmpegPlayback::_is_playing() const
 
 double AudioStreamFFmpegPlayback::_get_playback_position() const
 {
-	return mixed / mix_rate;
+	return static_cast<double>(mixed) / mix_rate;
 }
 
 void AudioStreamFFmpegPlayback::_seek(double p_position)
 {
-	buffer_fill = 0;
-	// convert seconds provided by the user to a timestamp in a correct base,
-	// then save it for later.
-	mixed = av_rescale_q(p_position * AV_TIME_BASE, AV_TIME_BASE_Q, m_stream->m_stream->time_base);
+	_stop_decoding();
+
+	p_position = std::max(p_position, 0.0);
+	mixed = static_cast<int64_t>(p_position * mix_rate);
+	skip_to = mixed;
+	decode_eof = false;
+
+	// Everything in the ring is from before the seek, the mix callback skips
+	// it the next time it runs
+	ring_flush = static_cast<int64_t>(ring_write.load());
+
+	// Timestamp in the time base of the stream, going back by the preroll of
+	// codecs like Opus which need some packets before the output is right.
+	// fill_buffer() throws away the samples in front of the position.
+	int64_t l_timestamp = av_rescale_q(p_position * AV_TIME_BASE, AV_TIME_BASE_Q, m_stream->m_time_base) + m_stream->m_start_time;
+	if (m_stream->m_codec_params->seek_preroll > 0 && m_stream->m_codec_params->sample_rate > 0)
+		l_timestamp -= av_rescale_q(m_stream->m_codec_params->seek_preroll,
+									AVRational{1, m_stream->m_codec_params->sample_rate}, m_stream->m_time_base);
+
+	if (m_format_ctx)
+	{
+		// Streaming, AVSEEK_FLAG_BACKWARD lands at or before the timestamp
+		int l_response = av_seek_frame(m_format_ctx, m_stream->m_stream_index, l_timestamp, AVSEEK_FLAG_BACKWARD);
+		if (l_response < 0)
+			FFmpeg::print_av_error("Seeking audio failed!", l_response);
+	}
+	else
+	{
+		// Last packet starting at or before the timestamp
+		const std::vector<int64_t> &l_pts = m_stream->m_packet_pts;
+		m_next_packet = std::max<int64_t>((std::upper_bound(l_pts.begin(), l_pts.end(), l_timestamp) - l_pts.begin()) - 1, 0);
+	}
+	m_draining = false;
+	avcodec_flush_buffers(m_codec_ctx);
+	swr_init(m_swr_ctx); // Drops the samples the resampler still holds
+
+	// Some samples are ready before the first mix, so starting doesn't
+	// count as an underrun
+	while (ring.size() - _get_free_frames() < PRIME_FRAMES)
+		if (!fill_buffer())
+			break;
 
-	avcodec_flush_buffers(m_stream->l_codec_ctx_audio);
+	_start_decoding();
+}
 
-	// Here we seek within given stream index and the correct timestamp
-	// for that stream. Using AVSEEK_FLAG_BACKWARD to make sure we're
-	// always *before* requested timestamp.
-	if (int err = av_seek_frame(m_stream->m_format_ctx, l_packet->stream_index, mixed, AVSEEK_FLAG_BACKWARD))
+int32_t AudioStreamFFmpegPlayback::_mix_resampled(AudioFrame *p_buffer, int32_t p_frames)
+{
+	// Only copying out of the ring here, decoding happens on the decode thread
+	int64_t l_flush = ring_flush.load(std::memory_order_acquire);
+	uint64_t l_read = l_flush >= 0 ? static_cast<uint64_t>(l_flush) : ring_read.load(std::memory_order_relaxed);
+	uint64_t l_write = ring_write.load(std::memory_order_acquire);
+	int32_t l_frames = static_cast<int32_t>(std::min<uint64_t>(p_frames, l_write - l_read));
+	size_t l_mask = ring.size() - 1;
+
+	size_t l_pos = l_read & l_mask;
+	size_t l_first = std::min<size_t>(l_frames, ring.size() - l_pos);
+
+	std::memcpy(p_buffer, &ring[l_pos], l_first * sizeof(AudioFrame));
+	std::memcpy(p_buffer + l_first, &ring[0], (l_frames - l_first) * sizeof(AudioFrame));
+
+	// The new read position has to be visible before the flush gets cleared,
+	// else the decode thread could see neither and use the old read position.
+	// A seek which happened in the meantime keeps its own flush.
+	ring_read.store(l_read + l_frames, std::memory_order_release);
+	if (l_flush >= 0)
+		ring_flush.compare_exchange_strong(l_flush, -1, std::memory_order_acq_rel);
+	mixed += l_frames;
+
+	if (l_frames == p_frames)
+		return p_frames;
+
+	// The last samples get written before the eof flag gets set
+	if (decode_eof.load(std::memory_order_acquire) && ring_write.load(std::memory_order_acquire) == l_read + l_frames)
 	{
-		FFmpeg::print_av_error("audio_decoder: Error while seeking \n", err);
+		if (l_frames == 0)
+			is_playing = false;
+		return l_frames;
 	}
-	if (FFmpeg::get_frame(m_stream->m_format_ctx, m_stream->l_codec_ctx_audio, m_stream->m_stream->index, l_frame, l_packet))
+
+	underruns++;
+	underrun_frames += p_frames - l_frames;
+	for (int i = l_frames; i < p_frames; ++i)
+		p_buffer[i] = AudioFrame{0.0f, 0.0f};
+
+	return p_frames;
+}
+
+uint64_t AudioStreamFFmpegPlayback::_get_free_frames() const
+{
+	// A pending flush means the mix callback will jump ahead to that point
+	int64_t l_flush = ring_flush.load(std::memory_order_acquire);
+	uint64_t l_read = l_flush >= 0 ? static_cast<uint64_t>(l_flush) : ring_read.load(std::memory_order_acquire);
+	uint64_t l_used = ring_write.load(std::memory_order_relaxed) - l_read;
+	return l_used < ring.size() ? ring.size() - l_used : 0;
+}
+
+bool AudioStreamFFmpegPlayback::_push_samples(const AudioFrame *a_samples, size_t a_count)
+{
+	size_t l_mask = ring.size() - 1;
+
+	while (a_count > 0)
 	{
-		// end of file
+		uint64_t l_free = _get_free_frames();
+		if (l_free == 0)
+		{
+			if (decode_stop)
+				return false;
+			std::this_thread::sleep_for(std::chrono::microseconds(500));
+			continue;
+		}
+
+		uint64_t l_write = ring_write.load(std::memory_order_relaxed);
+		size_t l_count = std::min<uint64_t>(a_count, l_free);
+		size_t l_pos = l_write & l_mask;
+		size_t l_first = std::min(l_count, ring.size() - l_pos);
+
+		std::memcpy(&ring[l_pos], a_samples, l_first * sizeof(AudioFrame));
+		std::memcpy(&ring[0], a_samples + l_first, (l_count - l_first) * sizeof(AudioFrame));
+		ring_write.store(l_write + l_count, std::memory_order_release);
+
+		a_samples += l_count;
+		a_count -= l_count;
 	}
-	l_decoded_frame->format = AV_SAMPLE_FMT_S16;
-	l_decoded_frame->ch_layout = m_stream->l_ch_layout;
-	l_decoded_frame->sample_rate = l_frame->sample_rate;
-	l_decoded_frame->nb_samples = swr_get_out_samples(m_stream->l_swr_ctx, l_frame->nb_samples);
 
-	if (auto resp = (av_frame_get_buffer(l_decoded_frame, 0)) < 0)
+	return true;
+}
+
+void AudioStreamFFmpegPlayback::_start_decoding()
+{
+	if (decoding)
+		return;
+
+	decode_stop = false;
+	decode_thread = std::thread(&AudioStreamFFmpegPlayback::_decode_loop, this);
+	decoding = true;
+}
+
+void AudioStreamFFmpegPlayback::_stop_decoding()
+{
+	if (!decoding)
+		return;
+
+	decode_stop = true;
+	decode_thread.join();
+	decoding = false;
+}
+
+void AudioStreamFFmpegPlayback::_decode_loop()
+{
+	while (!decode_stop.load(std::memory_order_relaxed) && !decode_eof.load(std::memory_order_relaxed))
 	{
-		FFmpeg::print_av_error("Couldn't create new frame for swr!", resp);
-		av_frame_unref(l_frame);
-		av_frame_unref(l_decoded_frame);
+		if (_get_free_frames() < DECODE_CHUNK)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			continue;
+		}
+
+		if (!fill_buffer())
+			break;
 	}
+}
 
-	if (auto resp = swr_config_frame(m_stream->l_swr_ctx, l_decoded_frame, l_frame) < 0)
+bool AudioStreamFFmpegPlayback::fill_buffer()
+{
+	if (!_get_frame())
 	{
-		FFmpeg::print_av_error("Couldn't config the audio frame!", resp);
-		av_frame_unref(l_frame);
-		av_frame_unref(l_decoded_frame);
+		// end of file, the resampler can still have some samples
+		_flush_resampler();
+		decode_eof.store(true, std::memory_order_release);
+		return false;
 	}
 
-	if (auto resp = swr_convert_frame(m_stream->l_swr_ctx, l_decoded_frame, l_frame) < 0)
+	const AudioFrame *l_samples = nullptr;
+	int l_frames = l_frame->nb_samples;
+	int l_channels = l_frame->ch_layout.nb_channels;
+
+	// Stereo float can go in as is, planar float (AAC, Opus, Vorbis, ...) and
+	// s16 stereo only need a conversion. Everything else, including audio
+	// which needs to be resampled, goes through swr.
+	if (l_frame->sample_rate != static_cast<int>(mix_rate))
 	{
-		FFmpeg::print_av_error("Couldn't convert the audio frame!", resp);
-		av_frame_unref(l_frame);
-		av_frame_unref(l_decoded_frame);
+		if (!_convert_frame())
+			return false;
+		l_samples = reinterpret_cast<const AudioFrame *>(l_decoded_frame->extended_data[0]);
+		l_frames = l_decoded_frame->nb_samples;
+	}
+	else if (l_frame->format == AV_SAMPLE_FMT_FLT && l_channels == 2)
+		l_samples = reinterpret_cast<const AudioFrame *>(l_frame->extended_data[0]);
+	else if (l_frame->format == AV_SAMPLE_FMT_FLTP && (l_channels == 1 || l_channels == 2))
+	{
+		if (convert_buffer.size() < static_cast<size_t>(l_frames))
+			convert_buffer.resize(l_frames);
+		const float *l_left = reinterpret_cast<const float *>(l_frame->extended_data[0]);
+		const float *l_right = reinterpret_cast<const float *>(l_frame->extended_data[l_channels - 1]);
+		SampleConverter::interleave_stereo(l_left, l_right, reinterpret_cast<float *>(convert_buffer.data()), l_frames);
+		l_samples = convert_buffer.data();
+	}
+	else if (l_frame->format == AV_SAMPLE_FMT_S16 && l_channels == 2)
+	{
+		if (convert_buffer.size() < static_cast<size_t>(l_frames))
+			convert_buffer.resize(l_frames);
+		SampleConverter::s16_to_float(reinterpret_cast<const int16_t *>(l_frame->extended_data[0]),
+									  reinterpret_cast<float *>(convert_buffer.data()), l_frames * 2);
+		l_samples = convert_buffer.data();
 	}
+	else if (!_convert_frame())
+		return false;
+	else
+	{
+		l_samples = reinterpret_cast<const AudioFrame *>(l_decoded_frame->extended_data[0]);
+		l_frames = l_decoded_frame->nb_samples;
+	}
+
+	// After seeking, everything before the requested position gets dropped
+	int64_t l_skip = 0;
+	if (skip_to > 0 && l_frame->best_effort_timestamp != AV_NOPTS_VALUE)
+	{
+		int64_t l_frame_start = av_rescale_q(l_frame->best_effort_timestamp - m_stream->m_start_time,
+											 m_stream->m_time_base, AVRational{1, static_cast<int>(mix_rate)});
+		l_skip = std::clamp<int64_t>(skip_to - l_frame_start, 0, l_frames);
+	}
+	if (l_skip < l_frames)
+		skip_to = 0;
+
+	bool l_pushed = _push_samples(l_samples + l_skip, l_frames - l_skip);
 
-	size_t l_byte_size = l_decoded_frame->nb_samples * m_stream->m_bytes_per_samples;
-	if (m_stream->l_codec_ctx_audio->ch_layout.nb_channels >= 2)
-		l_byte_size *= 2;
-	
-
-	std::memcpy(buffer, l_decoded_frame->extended_data[0], l_byte_size);
-	buffer_fill += l_decoded_frame->nb_samples;
-	mix_rate = l_frame->sample_rate;
-	//check if we seek perfectly or not
-	if(l_packet->pts<mixed){
-		//we need to throw away data
-		auto skip_len = mixed-l_packet->pts;
-		buffer_fill-=skip_len;
-		std::memmove(buffer,buffer+skip_len,buffer_fill*4);
-	}	
 	av_frame_unref(l_frame);
 	av_frame_unref(l_decoded_frame);
+	return l_pushed;
+}
 
+int AudioStreamFFmpegPlayback::_open_input()
+{
+	// Streaming playbacks read the file through a format context of their
+	// own, so they can seek without getting in each others way
+	if (!(m_packet = av_packet_alloc()) || !(m_format_ctx = avformat_alloc_context()) ||
+		AvioFile::open_input(&m_format_ctx, m_stream->m_path.c_str(), NULL))
+		return GoZenError::ERR_OPENING_AUDIO;
+
+	// Formats without a header only know their streams after probing
+	if (((m_format_ctx->ctx_flags & AVFMTCTX_NOHEADER) || m_stream->m_stream_index >= static_cast<int>(m_format_ctx->nb_streams)) &&
+		avformat_find_stream_info(m_format_ctx, NULL) < 0)
+		return GoZenError::ERR_NO_STREAM_INFO_FOUND;
+	if (m_stream->m_stream_index >= static_cast<int>(m_format_ctx->nb_streams))
+		return GoZenError::ERR_OPENING_AUDIO;
+
+	for (int i = 0; i < static_cast<int>(m_format_ctx->nb_streams); i++)
+		if (i != m_stream->m_stream_index)
+			m_format_ctx->streams[i]->discard = AVDISCARD_ALL;
+
+	return OK;
 }
 
-int32_t AudioStreamFFmpegPlayback::_mix_resampled(AudioFrame *p_buffer, int32_t p_frames)
+int AudioStreamFFmpegPlayback::_send_packet()
 {
-	// UtilityFunctions::print("start mix\n");
-	while (buffer_fill < p_frames)
-		if (!fill_buffer())
-			break;
-	// we have a buffer with buffer_fill values and need to provide p_frames
-	if (p_frames <= buffer_fill)
+	if (!m_format_ctx)
 	{
-		for (int i = 0; i < p_frames; ++i)
-			p_buffer[i] = AudioFrame{static_cast<float>(buffer[i].l) / 32767.0f, static_cast<float>(buffer[i].r) / 32767.0f};
-		buffer_fill -= p_frames;
-		std::memmove(buffer, buffer + p_frames, buffer_fill * 4); // move memory back to beginning of buffer 4 bytes per sample
-
-		mixed += p_frames;
-		return p_frames;
+		if (m_next_packet >= m_stream->m_packets.size())
+			return AVERROR_EOF;
+		return avcodec_send_packet(m_codec_ctx, m_stream->m_packets[m_next_packet++]);
 	}
-	// we still have some data to be sent over
-	else if (buffer_fill > 0)
+
+	// Streaming, packets of other streams can still show up
+	int l_response;
+	while ((l_response = av_read_frame(m_format_ctx, m_packet)) >= 0 && m_packet->stream_index != m_stream->m_stream_index)
+		av_packet_unref(m_packet);
+	if (l_response < 0)
+		return l_response;
+
+	l_response = avcodec_send_packet(m_codec_ctx, m_packet);
+	av_packet_unref(m_packet);
+	return l_response;
+}
+
+bool AudioStreamFFmpegPlayback::_get_frame()
+{
+	// Same as FFmpeg::get_frame(), only with the packets coming from the
+	// cache or from the format context of this playback
+	int l_response;
+
+	while ((l_response = avcodec_receive_frame(m_codec_ctx, l_frame)) == AVERROR(EAGAIN))
 	{
-		for (int i = 0; i < buffer_fill; ++i)
-			p_buffer[i] = AudioFrame{static_cast<float>(buffer[i].l) / 32767.0f, static_cast<float>(buffer[i].r) / 32767.0f};
-		int32_t copied_frames = buffer_fill;
-		mixed += copied_frames;
-		buffer_fill = 0;
-		return copied_frames;
+		if (m_draining)
+			return false;
+		else if ((l_response = _send_packet()) == AVERROR_EOF)
+		{
+			m_draining = true;
+			avcodec_send_packet(m_codec_ctx, nullptr); // Send null packet to signal end
+		}
+		else if (l_response < 0 && l_response != AVERROR_INVALIDDATA)
+		{
+			FFmpeg::print_av_error("Problem reading or sending package!", l_response);
+			return false;
+		}
 	}
-	return 0;
+
+	return l_response >= 0;
 }
 
-bool AudioStreamFFmpegPlayback::fill_buffer()
+bool AudioStreamFFmpegPlayback::_flush_resampler()
 {
-	// UtilityFunctions::print("fill buffer\n");
-	if (FFmpeg::get_frame(m_stream->m_format_ctx, m_stream->l_codec_ctx_audio, m_stream->m_stream->index, l_frame, l_packet))
-	{
-		// end of file
+	int l_frames = swr_get_out_samples(m_swr_ctx, 0);
+	if (l_frames <= 0)
 		return false;
-	}
 
-	// Copy decoded data to new frame
-	l_decoded_frame->format = AV_SAMPLE_FMT_S16;
+	l_decoded_frame->format = AV_SAMPLE_FMT_FLT;
 	l_decoded_frame->ch_layout = m_stream->l_ch_layout;
-	l_decoded_frame->sample_rate = l_frame->sample_rate;
-	l_decoded_frame->nb_samples = swr_get_out_samples(m_stream->l_swr_ctx, l_frame->nb_samples);
+	l_decoded_frame->sample_rate = mix_rate;
+	l_decoded_frame->nb_samples = l_frames;
+
+	bool l_pushed = av_frame_get_buffer(l_decoded_frame, 0) >= 0 &&
+					swr_convert_frame(m_swr_ctx, l_decoded_frame, nullptr) >= 0 &&
+					_push_samples(reinterpret_cast<const AudioFrame *>(l_decoded_frame->extended_data[0]), l_decoded_frame->nb_samples);
+
+	av_frame_unref(l_decoded_frame);
+	return l_pushed;
+}
+
+bool AudioStreamFFmpegPlayback::_convert_frame()
+{
+	l_decoded_frame->format = AV_SAMPLE_FMT_FLT;
+	l_decoded_frame->ch_layout = m_stream->l_ch_layout;
+	l_decoded_frame->sample_rate = mix_rate;
+	l_decoded_frame->nb_samples = swr_get_out_samples(m_swr_ctx, l_frame->nb_samples);
 
 	if (auto resp = (av_frame_get_buffer(l_decoded_frame, 0)) < 0)
 	{
@@ -266,7 +650,7 @@ bool AudioStreamFFmpegPlayback::fill_buffer()
 		return false;
 	}
 
-	if (auto resp = swr_config_frame(m_stream->l_swr_ctx, l_decoded_frame, l_frame) < 0)
+	if (auto resp = swr_config_frame(m_swr_ctx, l_decoded_frame, l_frame) < 0)
 	{
 		FFmpeg::print_av_error("Couldn't config the audio frame!", resp);
 		av_frame_unref(l_frame);
@@ -274,7 +658,7 @@ bool AudioStreamFFmpegPlayback::fill_buffer()
 		return false;
 	}
 
-	if (auto resp = swr_convert_frame(m_stream->l_swr_ctx, l_decoded_frame, l_frame) < 0)
+	if (auto resp = swr_convert_frame(m_swr_ctx, l_decoded_frame, l_frame) < 0)
 	{
 		FFmpeg::print_av_error("Couldn't convert the audio frame!", resp);
 		av_frame_unref(l_frame);
@@ -282,15 +666,68 @@ bool AudioStreamFFmpegPlayback::fill_buffer()
 		return false;
 	}
 
-	size_t l_byte_size = l_decoded_frame->nb_samples * m_stream->m_bytes_per_samples;
-	if (m_stream->l_codec_ctx_audio->ch_layout.nb_channels >= 2)
-		l_byte_size *= 2;
+	return true;
+}
 
-	std::memcpy(buffer + buffer_fill, l_decoded_frame->extended_data[0], l_byte_size);
+Dictionary AudioStreamFFmpeg::benchmark_mix(int a_frames, int a_iterations)
+{
+	Dictionary l_result = Dictionary();
+	a_frames = std::clamp(a_frames, 1, 16384);
+	a_iterations = std::max(a_iterations, 1);
+
+	// Full ring, so every mix copies a_frames without hitting an underrun
+	Ref<AudioStreamFFmpegPlayback> l_playback = memnew(AudioStreamFFmpegPlayback);
+	l_playback->ring.resize(32768);
+	for (size_t i = 0; i < l_playback->ring.size(); i++)
+		l_playback->ring[i] = AudioFrame{static_cast<float>(i & 0xFF) / 256.0f, -static_cast<float>(i & 0xFF) / 256.0f};
+
+	std::vector<AudioFrame> l_output(a_frames);
+	std::vector<int16_t> l_s16(a_frames * 2);
+	std::vector<float> l_left(a_frames), l_right(a_frames);
+	for (int i = 0; i < a_frames * 2; i++)
+		l_s16[i] = static_cast<int16_t>(i * 1777);
+	for (int i = 0; i < a_frames; i++)
+	{
+		l_left[i] = static_cast<float>(i) / a_frames;
+		l_right[i] = -l_left[i];
+	}
 
-	buffer_fill += l_decoded_frame->nb_samples;
-	mix_rate = l_frame->sample_rate;
-	av_frame_unref(l_frame);
-	av_frame_unref(l_decoded_frame);
-	return true;
+	uint64_t l_start = Time::get_singleton()->get_ticks_usec();
+	for (int j = 0; j < a_iterations; j++)
+	{
+		l_playback->ring_write = l_playback->ring_read + a_frames;
+		l_playback->_mix_resampled(l_output.data(), a_frames);
+	}
+	l_result["mix_usec"] = static_cast<double>(Time::get_singleton()->get_ticks_usec() - l_start) / a_iterations;
+
+	// How the mix callback converted the s16 ring before, for comparison
+	l_start = Time::get_singleton()->get_ticks_usec();
+	for (int j = 0; j < a_iterations; j++)
+		for (int i = 0; i < a_frames; i++)
+			l_output[i] = AudioFrame{static_cast<float>(l_s16[i * 2]) / 32767.0f, static_cast<float>(l_s16[i * 2 + 1]) / 32767.0f};
+	l_result["mix_s16_divide_usec"] = static_cast<double>(Time::get_singleton()->get_ticks_usec() - l_start) / a_iterations;
+
+	SampleConverter::Path l_paths[2] = {ColorConverter::PATH_AUTO, ColorConverter::PATH_SCALAR};
+	const char *l_s16_names[2] = {"s16_simd_usec", "s16_scalar_usec"};
+	const char *l_interleave_names[2] = {"interleave_simd_usec", "interleave_scalar_usec"};
+
+	for (int k = 0; k < 2; k++)
+	{
+		l_start = Time::get_singleton()->get_ticks_usec();
+		for (int j = 0; j < a_iterations; j++)
+			SampleConverter::s16_to_float(l_s16.data(), reinterpret_cast<float *>(l_output.data()), a_frames * 2, l_paths[k]);
+		l_result[l_s16_names[k]] = static_cast<double>(Time::get_singleton()->get_ticks_usec() - l_start) / a_iterations;
+
+		l_start = Time::get_singleton()->get_ticks_usec();
+		for (int j = 0; j < a_iterations; j++)
+			SampleConverter::interleave_stereo(l_left.data(), l_right.data(), reinterpret_cast<float *>(l_output.data()), a_frames, l_paths[k]);
+		l_result[l_interleave_names[k]] = static_cast<double>(Time::get_singleton()->get_ticks_usec() - l_start) / a_iterations;
+	}
+
+	l_result["underruns"] = l_playback->get_underruns();
+	l_result["path"] = ColorConverter::get_path_name(ColorConverter::get_best_path());
+	l_result["frames"] = a_frames;
+	l_result["iterations"] = a_iterations;
+
+	return l_result;
 }
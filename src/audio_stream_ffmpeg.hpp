@@ -1,8 +1,17 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <godot_cpp/classes/audio_server.hpp>
 #include <godot_cpp/classes/audio_stream.hpp>
 #include <godot_cpp/classes/audio_stream_playback_resampled.hpp>
 #include <godot_cpp/classes/audio_stream_playback.hpp>
+#include <godot_cpp/classes/time.hpp>
 
 extern "C"
 {
@@ -34,7 +43,9 @@ extern "C"
 #include <libswscale/swscale.h>
 }
 
+#include "avio_file.hpp"
 #include "gozen_error.hpp"
+#include "sample_converter.hpp"
 
 using namespace godot;
 
@@ -43,29 +54,80 @@ class AudioStreamFFmpeg : public AudioStream
     GDCLASS(AudioStreamFFmpeg, AudioStream);
 
 public:
-    double _get_length() const override { return 0; }
-    bool _is_monophonic() const override { return true; }
+    double _get_length() const override { return m_length; }
+    bool _is_monophonic() const override { return false; }
     Ref<AudioStreamPlayback> _instantiate_playback() const override;
     static Ref<AudioStreamFFmpeg> load_from_file(String path);
-    virtual ~AudioStreamFFmpeg() {} // todo free ffmpeg stuff
+    // From the bytes of a complete audio file, only the compressed packets
+    // stay in memory and get decoded while playing
+    static Ref<AudioStreamFFmpeg> load_from_buffer(PackedByteArray a_data);
+    // Packets get read from the file while playing instead of all at once,
+    // so opening doesn't take longer for longer files. Every playback reads
+    // through a format context of its own.
+    static Ref<AudioStreamFFmpeg> stream_from_file(String a_path);
+    static Dictionary benchmark_mix(int a_frames = 512, int a_iterations = 10000);
+    virtual ~AudioStreamFFmpeg()
+    {
+        for (AVPacket *l_packet : m_packets)
+            av_packet_free(&l_packet);
+        if (m_codec_params)
+            avcodec_parameters_free(&m_codec_params);
+    }
     int error = 0;
+    int get_error() const { return error; }
+    int64_t get_packet_count() const { return m_packets.size(); }
+    int64_t get_cache_size() const { return m_cache_size; }
+    bool is_streaming() const { return !m_path.empty(); }
+
+    // Playbacks created after changing this resample to the mix rate of the
+    // AudioServer, so Godot doesn't resample a second time
+    void set_resample_to_mix_rate(bool a_value) { m_resample_to_mix_rate = a_value; }
+    bool get_resample_to_mix_rate() const { return m_resample_to_mix_rate; }
     friend class AudioStreamFFmpegPlayback;
+    friend class Video;
 
 protected:
     static inline void _bind_methods()
     {
         ClassDB::bind_static_method("AudioStreamFFmpeg", D_METHOD("load_from_file", "a_file_path"), &AudioStreamFFmpeg::load_from_file);
+        ClassDB::bind_static_method("AudioStreamFFmpeg", D_METHOD("load_from_buffer", "a_data"), &AudioStreamFFmpeg::load_from_buffer);
+        ClassDB::bind_static_method("AudioStreamFFmpeg", D_METHOD("stream_from_file", "a_file_path"), &AudioStreamFFmpeg::stream_from_file);
+        ClassDB::bind_method(D_METHOD("get_error"), &AudioStreamFFmpeg::get_error);
+        ClassDB::bind_method(D_METHOD("get_packet_count"), &AudioStreamFFmpeg::get_packet_count);
+        ClassDB::bind_method(D_METHOD("get_cache_size"), &AudioStreamFFmpeg::get_cache_size);
+        ClassDB::bind_method(D_METHOD("is_streaming"), &AudioStreamFFmpeg::is_streaming);
+        ClassDB::bind_method(D_METHOD("set_resample_to_mix_rate", "a_value"), &AudioStreamFFmpeg::set_resample_to_mix_rate);
+        ClassDB::bind_method(D_METHOD("get_resample_to_mix_rate"), &AudioStreamFFmpeg::get_resample_to_mix_rate);
+        ClassDB::bind_static_method("AudioStreamFFmpeg", D_METHOD("benchmark_mix", "a_frames", "a_iterations"), &AudioStreamFFmpeg::benchmark_mix, DEFVAL(512), DEFVAL(10000));
     }
 
 private:
-    AVFormatContext *m_format_ctx = nullptr;
-    AVStream *m_stream = nullptr;
-    AVCodecContext *l_codec_ctx_audio = nullptr;
+    // All compressed packets of the audio stream, read once when loading.
+    // Playbacks only read from this, each with a decoder of their own.
+    // Empty when streaming.
+    std::vector<AVPacket *> m_packets;
+    std::vector<int64_t> m_packet_pts; // For seeking, in stream time base
+    int64_t m_cache_size = 0;          // Bytes of packet data
+
+    std::string m_path = ""; // Only set when streaming
+    int m_stream_index = -1;
+
+    AVCodecParameters *m_codec_params = nullptr;
+    AVRational m_time_base = {0, 1};
     int m_bytes_per_samples = 0;
-    int m_stream_idx = 0;
+    int m_sample_rate = 44100;
+    int64_t m_start_time = 0; // In stream time base
+    double m_length = 0;      // In seconds
     bool l_stereo = true;
-    AVChannelLayout l_ch_layout;
-    struct SwrContext *l_swr_ctx = nullptr;
+    bool m_resample_to_mix_rate = false;
+    AVChannelLayout l_ch_layout = AV_CHANNEL_LAYOUT_STEREO;
+
+    static Ref<AudioStreamFFmpeg> _stream_from_file(const String &a_path, AVIOInterruptCB a_interrupt);
+    int _find_stream(AVFormatContext *a_format_ctx);
+    int _load_packets(AVFormatContext *a_format_ctx);
+    int _probe_decoder();
+    // a_rate is the output rate of swr, 0 keeps the rate of the decoder
+    int _open_decoder(AVCodecContext *&a_codec_ctx, struct SwrContext *&a_swr_ctx, int a_rate) const;
 };
 
 class AudioStreamFFmpegPlayback : public AudioStreamPlaybackResampled
@@ -81,38 +143,91 @@ public:
     void _seek(double p_position) override;
     int32_t _mix_resampled(AudioFrame *p_buffer, int32_t p_frames) override;
     float _get_stream_sampling_rate() const override { return mix_rate; }
-    AudioStreamFFmpegPlayback()
-    {
-        buffer = new sint16_stereo[buffer_len];
-    }
+    AudioStreamFFmpegPlayback() {}
     virtual ~AudioStreamFFmpegPlayback()
     {
-        delete[] buffer;
-    } // todo free ffmpeg stuff
+        _stop_decoding();
+        av_frame_free(&l_frame);
+        av_frame_free(&l_decoded_frame);
+        if (m_codec_ctx)
+            avcodec_free_context(&m_codec_ctx);
+        if (m_swr_ctx)
+            swr_free(&m_swr_ctx);
+        if (m_format_ctx)
+            AvioFile::close_input(&m_format_ctx);
+        av_packet_free(&m_packet);
+    }
     friend class AudioStreamFFmpeg;
 
+    // Underruns are mixes which needed more samples than the decode thread
+    // had ready, the missing frames got filled with silence
+    int64_t get_underruns() const { return underruns; }
+    int64_t get_underrun_frames() const { return underrun_frames; }
+    int get_buffered_frames() const { return static_cast<int>(ring_write - ring_read); }
+    int get_buffer_size() const { return static_cast<int>(ring.size()); }
+
 protected:
     static inline void _bind_methods()
     {
+        ClassDB::bind_method(D_METHOD("get_underruns"), &AudioStreamFFmpegPlayback::get_underruns);
+        ClassDB::bind_method(D_METHOD("get_underrun_frames"), &AudioStreamFFmpegPlayback::get_underrun_frames);
+        ClassDB::bind_method(D_METHOD("get_buffered_frames"), &AudioStreamFFmpegPlayback::get_buffered_frames);
+        ClassDB::bind_method(D_METHOD("get_buffer_size"), &AudioStreamFFmpegPlayback::get_buffer_size);
     }
 
 private:
-    const AudioStreamFFmpeg *m_stream;
-    struct sint16_stereo
-    {
-        int16_t l;
-        int16_t r;
-    };
-    sint16_stereo *buffer;
-    size_t buffer_len = 4410000; // 10s
-    size_t buffer_fill = 0;      // number of samples current in buffer
-    bool is_playing = false;
+    // Samples decoded ahead are kept in the ring, the decode thread starts
+    // again as soon as this many frames fit in
+    static constexpr size_t DECODE_CHUNK = 4096;
+    static constexpr size_t PRIME_FRAMES = 4096; // Decoded before playback starts
+
+    Ref<AudioStreamFFmpeg> m_stream; // Keeps the packet cache alive while playing
+
+    // Decoding state of this playback only
+    AVCodecContext *m_codec_ctx = nullptr;
+    struct SwrContext *m_swr_ctx = nullptr;
+    size_t m_next_packet = 0; // Next packet of the cache to send
+    bool m_draining = false;  // All packets got sent
+
+    // Only for streaming, the packets get read from the file
+    AVFormatContext *m_format_ctx = nullptr;
+    AVPacket *m_packet = nullptr;
+
+    // Single producer (decode thread) single consumer (mix callback) ring,
+    // size is a power of two. Frames are stored the way Godot mixes them, so
+    // the mix callback only has to copy.
+    std::vector<AudioFrame> ring;
+    std::atomic<uint64_t> ring_read = 0;  // Only written by the mix callback
+    std::atomic<uint64_t> ring_write = 0; // Only written by the decoding side
+    std::atomic<int64_t> ring_flush = -1; // Read position the mix callback jumps to after seeking
+
+    std::vector<AudioFrame> convert_buffer; // Frames converted without swr
+
+    std::thread decode_thread;
+    std::atomic<bool> decode_stop = false;
+    std::atomic<bool> decode_eof = false;
+    bool decoding = false;
+
+    std::atomic<int64_t> underruns = 0;
+    std::atomic<int64_t> underrun_frames = 0;
+
+    std::atomic<bool> is_playing = false;
     AVFrame *l_frame = av_frame_alloc();
     AVFrame *l_decoded_frame = av_frame_alloc();
-    AVPacket *l_packet = av_packet_alloc();
     bool l_stereo = true;
-    uint32_t mixed = 0;
+    std::atomic<int64_t> mixed = 0; // Position in samples
+    int64_t skip_to = 0;            // Decoded samples before this position get dropped after seeking
     uint32_t mix_rate = 44100;
 
     bool fill_buffer();
+    int _open_input();
+    int _send_packet();
+    bool _get_frame();
+    bool _convert_frame();
+    bool _flush_resampler();
+    bool _push_samples(const AudioFrame *a_samples, size_t a_count);
+    uint64_t _get_free_frames() const;
+    void _decode_loop();
+    void _start_decoding();
+    void _stop_decoding();
 };
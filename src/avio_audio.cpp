@@ -4,17 +4,20 @@
 AvioAudio::AvioAudio(const uint8_t *a_data, size_t a_size):
 			wav_data(a_data), wav_size(a_size), position(0) {}
 
-AvioAudio::~AvioAudio() {}
+AvioAudio::~AvioAudio() {
+	if (avio_ctx) {
+		av_freep(&avio_ctx->buffer);
+		avio_context_free(&avio_ctx);
+	}
+}
 
 
 int AvioAudio::read_packet(void *a_opaque, uint8_t *a_buf, int a_buf_size) {
 	AvioAudio *l_self = static_cast<AvioAudio*>(a_opaque);
 	size_t l_remaining = l_self->wav_size - l_self->position;
 
-	if (l_remaining == 0) {
-		UtilityFunctions::print("AvioAudio: EOF reached in read_packet!");
+	if (l_remaining == 0)
 		return AVERROR_EOF;
-	}
 
 	size_t l_to_copy = a_buf_size > l_remaining ? l_remaining : a_buf_size;
 	memcpy(a_buf, l_self->wav_data + l_self->position, l_to_copy);
@@ -27,6 +30,7 @@ int64_t AvioAudio::seek_packet(void *a_opaque, int64_t a_offset, int a_whence) {
 	AvioAudio *l_self = static_cast<AvioAudio*>(a_opaque);
 	size_t l_new_position;
 
+	a_whence &= ~AVSEEK_FORCE;
 	if (a_whence == AVSEEK_SIZE) return l_self->wav_size;
 	else if (a_whence == SEEK_SET) l_new_position = a_offset;
 	else if (a_whence == SEEK_CUR) l_new_position = l_self->position + a_offset;
@@ -49,8 +53,8 @@ AVFormatContext *AvioAudio::create_avformat_context() {
 		return nullptr;
 	}
 
-	// Allocate buffer for AVIO
-	const int l_buffer_size = 4096; // 4KB buffer
+	// Allocate buffer for AVIO, same size as for reading through FileAccess
+	const int l_buffer_size = AvioFile::buffer_size;
 	uint8_t	*l_avio_buffer = static_cast<uint8_t*>(av_malloc(l_buffer_size));
 	if (!l_avio_buffer) {
 		UtilityFunctions::printerr("Couldn't allocate AVIO buffer!");
@@ -58,31 +62,28 @@ AVFormatContext *AvioAudio::create_avformat_context() {
 		return nullptr;
 	}
 
-	// Create custom AVIO context
-	AVIOContext *l_avio_ctx = avio_alloc_context(
+	// Create custom AVIO context, freed by the destructor
+	avio_ctx = avio_alloc_context(
 			l_avio_buffer, l_buffer_size, 0, this, read_packet, nullptr, seek_packet);
-	if (!l_avio_ctx) {
+	if (!avio_ctx) {
 		UtilityFunctions::printerr("Couldn't allocate AVIOContext!");
 		av_free(l_avio_buffer);
 		avformat_free_context(l_fmt_ctx);
 		return nullptr;
 	}
 
-	l_fmt_ctx->pb = l_avio_ctx;
+	l_fmt_ctx->pb = avio_ctx;
 
-	// Open the avformat context
+	// Open the avformat context, frees the context on failure
 	if ((response = avformat_open_input(&l_fmt_ctx, NULL, NULL, NULL)) < 0) {
 		FFmpeg::print_av_error("Couldn't open AVFormatContext", response);
-		av_free(l_avio_buffer);
-		avio_context_free(&l_avio_ctx);
-		avformat_free_context(l_fmt_ctx);
 		return nullptr;
 	}
 
 	// Read stream info
 	if ((response = avformat_find_stream_info(l_fmt_ctx, NULL)) < 0) {
 		FFmpeg::print_av_error("Couldn't find stream info", response);
-		avformat_free_context(l_fmt_ctx);
+		avformat_close_input(&l_fmt_ctx);
 		return nullptr;
 	}
 	
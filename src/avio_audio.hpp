@@ -4,16 +4,21 @@
 #include <godot_cpp/variant/utility_functions.hpp>
 
 #include "ffmpeg.hpp"
+#include "avio_file.hpp"
 
 
 using namespace godot;
 
 
+// Reads a complete media file from memory. The data and this object need to
+// stay alive until the format context is closed, the AVIOContext gets freed
+// together with this object.
 class AvioAudio {
 private:
 	const uint8_t *wav_data;
 	size_t wav_size;
 	size_t position;
+	AVIOContext *avio_ctx = nullptr;
 
 	int response = 0;
 
@@ -0,0 +1,110 @@
+#include "avio_file.hpp"
+
+
+bool AvioFile::uses_file_access(const String &a_path) {
+	return a_path.begins_with("res://") || a_path.begins_with("user://");
+}
+
+int AvioFile::open_input(AVFormatContext **a_format_ctx, const char *a_path, AVDictionary **a_options) {
+	String l_path = String::utf8(a_path);
+	if (!uses_file_access(l_path))
+		return avformat_open_input(a_format_ctx, a_path, NULL, a_options);
+
+	Ref<FileAccess> l_file = FileAccess::open(l_path, FileAccess::READ);
+	if (l_file.is_null()) {
+		avformat_free_context(*a_format_ctx); // Same as avformat_open_input on failure
+		*a_format_ctx = nullptr;
+		return AVERROR(ENOENT);
+	}
+
+	if (!*a_format_ctx && !(*a_format_ctx = avformat_alloc_context()))
+		return AVERROR(ENOMEM);
+
+	AvioFile *l_avio = new AvioFile(l_file);
+	uint8_t *l_buffer = static_cast<uint8_t *>(av_malloc(buffer_size));
+	AVIOContext *l_avio_ctx = l_buffer ? avio_alloc_context(
+			l_buffer, buffer_size, 0, l_avio, _read_packet, nullptr, _seek_packet) : nullptr;
+
+	if (!l_avio_ctx) {
+		UtilityFunctions::printerr("Couldn't allocate AVIOContext!");
+		av_free(l_buffer);
+		delete l_avio;
+		avformat_free_context(*a_format_ctx);
+		*a_format_ctx = nullptr;
+		return AVERROR(ENOMEM);
+	}
+
+	// The url is only used for guessing the format and for logging
+	(*a_format_ctx)->pb = l_avio_ctx;
+	int l_response = avformat_open_input(a_format_ctx, a_path, NULL, a_options);
+
+	// The format context is already freed on failure, our IO isn't
+	if (l_response < 0) {
+		av_freep(&l_avio_ctx->buffer);
+		avio_context_free(&l_avio_ctx);
+		delete l_avio;
+	}
+
+	return l_response;
+}
+
+void AvioFile::close_input(AVFormatContext **a_format_ctx) {
+	if (!*a_format_ctx)
+		return;
+
+	// avformat_close_input leaves custom IO alone
+	AVIOContext *l_avio_ctx = (*a_format_ctx)->pb;
+	bool l_ours = l_avio_ctx && ((*a_format_ctx)->flags & AVFMT_FLAG_CUSTOM_IO) && l_avio_ctx->read_packet == _read_packet;
+
+	avformat_close_input(a_format_ctx);
+
+	if (l_ours) {
+		delete static_cast<AvioFile *>(l_avio_ctx->opaque);
+		av_freep(&l_avio_ctx->buffer);
+		avio_context_free(&l_avio_ctx);
+	}
+}
+
+int AvioFile::_read_packet(void *a_opaque, uint8_t *a_buf, int a_buf_size) {
+	AvioFile *l_self = static_cast<AvioFile *>(a_opaque);
+
+	if (l_self->position >= l_self->length)
+		return AVERROR_EOF;
+
+	// Reading a new chunk when the position isn't inside of the current one,
+	// every get_buffer call allocates so small reads would add up
+	if (l_self->position < l_self->chunk_position || l_self->position >= l_self->chunk_position + l_self->chunk.size()) {
+		l_self->file->seek(l_self->position);
+		l_self->chunk = l_self->file->get_buffer(std::max(read_ahead, a_buf_size));
+		l_self->chunk_position = l_self->position;
+
+		if (l_self->chunk.is_empty())
+			return l_self->file->get_error() == ERR_FILE_EOF ? AVERROR_EOF : AVERROR(EIO);
+	}
+
+	uint64_t l_offset = l_self->position - l_self->chunk_position;
+	int l_size = static_cast<int>(std::min<uint64_t>(a_buf_size, l_self->chunk.size() - l_offset));
+
+	memcpy(a_buf, l_self->chunk.ptr() + l_offset, l_size);
+	l_self->position += l_size;
+	return l_size;
+}
+
+int64_t AvioFile::_seek_packet(void *a_opaque, int64_t a_offset, int a_whence) {
+	AvioFile *l_self = static_cast<AvioFile *>(a_opaque);
+	int64_t l_new_position;
+
+	// Seeking only moves the position, the next read takes care of the file
+	a_whence &= ~AVSEEK_FORCE;
+	if (a_whence == AVSEEK_SIZE) return l_self->length;
+	else if (a_whence == SEEK_SET) l_new_position = a_offset;
+	else if (a_whence == SEEK_CUR) l_new_position = l_self->position + a_offset;
+	else if (a_whence == SEEK_END) l_new_position = l_self->length + a_offset;
+	else return AVERROR(EINVAL);
+
+	if (l_new_position < 0)
+		return AVERROR(EINVAL);
+
+	l_self->position = l_new_position;
+	return l_new_position;
+}
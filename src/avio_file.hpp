@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+
+#include <godot_cpp/classes/file_access.hpp>
+#include <godot_cpp/variant/utility_functions.hpp>
+
+#include "ffmpeg.hpp"
+
+
+using namespace godot;
+
+
+// Lets FFmpeg read through Godot's FileAccess, so res:// files inside of a
+// PCK and user:// files can be opened without extracting them first. Reads
+// are done in chunks of read_ahead bytes, FFmpeg's own buffer is buffer_size.
+// Other paths still get opened by FFmpeg itself. Format contexts from
+// open_input() always need to be closed with close_input().
+class AvioFile {
+private:
+	Ref<FileAccess> file;
+	uint64_t length = 0;
+	uint64_t position = 0; // Where FFmpeg wants to read next
+
+	PackedByteArray chunk;
+	uint64_t chunk_position = 0; // File position of the first byte of chunk
+
+
+	AvioFile(Ref<FileAccess> a_file) : file(a_file), length(a_file->get_length()) {}
+
+	static int _read_packet(void *a_opaque, uint8_t *a_buf, int a_buf_size);
+	static int64_t _seek_packet(void *a_opaque, int64_t a_offset, int a_whence);
+
+
+public:
+	static inline int buffer_size = 64 * 1024;
+	static inline int read_ahead = 1024 * 1024;
+
+
+	static bool uses_file_access(const String &a_path);
+
+	// Same as avformat_open_input, *a_format_ctx can be allocated already
+	static int open_input(AVFormatContext **a_format_ctx, const char *a_path, AVDictionary **a_options = nullptr);
+	static void close_input(AVFormatContext **a_format_ctx);
+};
@@ -0,0 +1,303 @@
+#include "color_converter.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include "simd.hpp"
+
+
+void ColorConverter::set_matrix(Matrix a_matrix, bool a_full_range) {
+	// Same values as the color_profile which the addon gives to the shaders
+	double l_v_to_r, l_u_to_g, l_v_to_g, l_u_to_b;
+	switch (a_matrix) {
+		case MATRIX_BT601:
+			l_v_to_r = 1.402; l_u_to_g = 0.344136; l_v_to_g = 0.714136; l_u_to_b = 1.772;
+			break;
+		case MATRIX_BT2020:
+			l_v_to_r = 1.4746; l_u_to_g = 0.16455; l_v_to_g = 0.57135; l_u_to_b = 1.8814;
+			break;
+		default:
+			l_v_to_r = 1.5748; l_u_to_g = 0.1873; l_v_to_g = 0.4681; l_u_to_b = 1.8556;
+	}
+
+	// Limited range stretches 16-235 luma and 16-240 chroma to 0-255
+	double l_y_scale = a_full_range ? 1. : 255. / 219.;
+	double l_uv_scale = a_full_range ? 1. : 255. / 224.;
+
+	coefficients.y_offset = a_full_range ? 0 : 16;
+	coefficients.y_gain = static_cast<int16_t>(std::lround(64 * l_y_scale));
+	coefficients.v_to_r = static_cast<int16_t>(std::lround(64 * l_uv_scale * l_v_to_r));
+	coefficients.u_to_g = static_cast<int16_t>(std::lround(64 * l_uv_scale * l_u_to_g));
+	coefficients.v_to_g = static_cast<int16_t>(std::lround(64 * l_uv_scale * l_v_to_g));
+	coefficients.u_to_b = static_cast<int16_t>(std::lround(64 * l_uv_scale * l_u_to_b));
+}
+
+ColorConverter::Path ColorConverter::get_path() const {
+	Path l_best = get_best_path();
+
+	if (path == PATH_AUTO)
+		return l_best;
+	else if (path == PATH_SCALAR || path == l_best)
+		return path;
+	else if (path == PATH_SSE2 && l_best == PATH_AVX2)
+		return path;
+	return PATH_SCALAR;
+}
+
+ColorConverter::Path ColorConverter::get_best_path() {
+#if defined(GOZEN_X86)
+	#if defined(_MSC_VER) && !defined(__clang__)
+	static const bool l_avx2 = [] {
+		int l_info[4];
+		__cpuid(l_info, 1);
+		bool l_os_avx = (l_info[2] & (1 << 27)) && (l_info[2] & (1 << 28)) && ((_xgetbv(0) & 6) == 6);
+		__cpuidex(l_info, 7, 0);
+		return l_os_avx && (l_info[1] & (1 << 5));
+	}();
+	#else
+	static const bool l_avx2 = __builtin_cpu_supports("avx2");
+	#endif
+	return l_avx2 ? PATH_AVX2 : PATH_SSE2;
+#elif defined(GOZEN_NEON)
+	return PATH_NEON;
+#else
+	return PATH_SCALAR;
+#endif
+}
+
+const char *ColorConverter::get_path_name(Path a_path) {
+	switch (a_path) {
+		case PATH_SCALAR: return "scalar";
+		case PATH_SSE2: return "sse2";
+		case PATH_AVX2: return "avx2";
+		case PATH_NEON: return "neon";
+		default: return "auto";
+	}
+}
+
+void ColorConverter::convert(const uint8_t *a_y, int a_y_stride, const uint8_t *a_u, const uint8_t *a_v, int a_uv_stride,
+		uint8_t *a_dst, int a_dst_stride, int a_width, int a_height) const {
+	Path l_path = get_path();
+
+	for (int i = 0; i < a_height; i++) {
+		const uint8_t *l_y = a_y + static_cast<int64_t>(i) * a_y_stride;
+		const uint8_t *l_u = a_u + static_cast<int64_t>(i / 2) * a_uv_stride;
+		const uint8_t *l_v = a_v ? a_v + static_cast<int64_t>(i / 2) * a_uv_stride : nullptr;
+		uint8_t *l_dst = a_dst + static_cast<int64_t>(i) * a_dst_stride;
+		int l_done = 0;
+
+		switch (l_path) {
+			case PATH_SSE2: l_done = _row_sse2(l_y, l_u, l_v, l_dst, a_width, coefficients); break;
+			case PATH_AVX2: l_done = _row_avx2(l_y, l_u, l_v, l_dst, a_width, coefficients); break;
+			case PATH_NEON: l_done = _row_neon(l_y, l_u, l_v, l_dst, a_width, coefficients); break;
+			default: break;
+		}
+
+		// Pixels which don't fill a full vector are left for the scalar code
+		_row_scalar(l_y, l_u, l_v, l_dst, l_done, a_width, coefficients);
+	}
+}
+
+void ColorConverter::_row_scalar(const uint8_t *a_y, const uint8_t *a_u, const uint8_t *a_v, uint8_t *a_dst, int a_start, int a_width, const Coefficients &a_coef) {
+	for (int x = a_start; x < a_width; x++) {
+		int l_u, l_v;
+		if (a_v) {
+			l_u = a_u[x / 2] - 128;
+			l_v = a_v[x / 2] - 128;
+		} else {
+			l_u = a_u[(x / 2) * 2] - 128;
+			l_v = a_u[(x / 2) * 2 + 1] - 128;
+		}
+
+		int l_y = (a_y[x] - a_coef.y_offset) * a_coef.y_gain + 32;
+		uint8_t *l_pixel = a_dst + x * 4;
+
+		l_pixel[0] = std::clamp((l_y + l_v * a_coef.v_to_r) >> 6, 0, 255);
+		l_pixel[1] = std::clamp((l_y - l_u * a_coef.u_to_g - l_v * a_coef.v_to_g) >> 6, 0, 255);
+		l_pixel[2] = std::clamp((l_y + l_u * a_coef.u_to_b) >> 6, 0, 255);
+		l_pixel[3] = 255;
+	}
+}
+
+
+#if defined(GOZEN_X86)
+static inline void _rgb_sse2(__m128i a_y, __m128i a_u, __m128i a_v, const ColorConverter::Coefficients &a_coef, __m128i &r_r, __m128i &r_g, __m128i &r_b) {
+	a_y = _mm_add_epi16(_mm_mullo_epi16(_mm_sub_epi16(a_y, _mm_set1_epi16(a_coef.y_offset)), _mm_set1_epi16(a_coef.y_gain)), _mm_set1_epi16(32));
+
+	r_r = _mm_srai_epi16(_mm_adds_epi16(a_y, _mm_mullo_epi16(a_v, _mm_set1_epi16(a_coef.v_to_r))), 6);
+	r_g = _mm_srai_epi16(_mm_subs_epi16(_mm_subs_epi16(a_y,
+			_mm_mullo_epi16(a_u, _mm_set1_epi16(a_coef.u_to_g))),
+			_mm_mullo_epi16(a_v, _mm_set1_epi16(a_coef.v_to_g))), 6);
+	r_b = _mm_srai_epi16(_mm_adds_epi16(a_y, _mm_mullo_epi16(a_u, _mm_set1_epi16(a_coef.u_to_b))), 6);
+}
+
+int ColorConverter::_row_sse2(const uint8_t *a_y, const uint8_t *a_u, const uint8_t *a_v, uint8_t *a_dst, int a_width, const Coefficients &a_coef) {
+	const __m128i l_zero = _mm_setzero_si128();
+	const __m128i l_128 = _mm_set1_epi16(128);
+	const __m128i l_alpha = _mm_set1_epi8(-1);
+	int x = 0;
+
+	for (; x + 16 <= a_width; x += 16) {
+		__m128i l_y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a_y + x));
+		__m128i l_u, l_v;
+
+		if (a_v) {
+			l_u = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(a_u + x / 2)), l_zero);
+			l_v = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(a_v + x / 2)), l_zero);
+		} else {
+			__m128i l_uv = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a_u + x));
+			l_u = _mm_and_si128(l_uv, _mm_set1_epi16(0xFF));
+			l_v = _mm_srli_epi16(l_uv, 8);
+		}
+		l_u = _mm_sub_epi16(l_u, l_128);
+		l_v = _mm_sub_epi16(l_v, l_128);
+
+		// Every chroma sample is used by two neighbouring pixels
+		__m128i l_r_lo, l_g_lo, l_b_lo, l_r_hi, l_g_hi, l_b_hi;
+		_rgb_sse2(_mm_unpacklo_epi8(l_y, l_zero), _mm_unpacklo_epi16(l_u, l_u), _mm_unpacklo_epi16(l_v, l_v), a_coef, l_r_lo, l_g_lo, l_b_lo);
+		_rgb_sse2(_mm_unpackhi_epi8(l_y, l_zero), _mm_unpackhi_epi16(l_u, l_u), _mm_unpackhi_epi16(l_v, l_v), a_coef, l_r_hi, l_g_hi, l_b_hi);
+
+		__m128i l_r = _mm_packus_epi16(l_r_lo, l_r_hi);
+		__m128i l_g = _mm_packus_epi16(l_g_lo, l_g_hi);
+		__m128i l_b = _mm_packus_epi16(l_b_lo, l_b_hi);
+
+		__m128i l_rg_lo = _mm_unpacklo_epi8(l_r, l_g);
+		__m128i l_rg_hi = _mm_unpackhi_epi8(l_r, l_g);
+		__m128i l_ba_lo = _mm_unpacklo_epi8(l_b, l_alpha);
+		__m128i l_ba_hi = _mm_unpackhi_epi8(l_b, l_alpha);
+
+		__m128i *l_dst = reinterpret_cast<__m128i *>(a_dst + x * 4);
+		_mm_storeu_si128(l_dst, _mm_unpacklo_epi16(l_rg_lo, l_ba_lo));
+		_mm_storeu_si128(l_dst + 1, _mm_unpackhi_epi16(l_rg_lo, l_ba_lo));
+		_mm_storeu_si128(l_dst + 2, _mm_unpacklo_epi16(l_rg_hi, l_ba_hi));
+		_mm_storeu_si128(l_dst + 3, _mm_unpackhi_epi16(l_rg_hi, l_ba_hi));
+	}
+
+	return x;
+}
+
+GOZEN_TARGET_AVX2 static inline void _rgb_avx2(__m256i a_y, __m256i a_u, __m256i a_v, const ColorConverter::Coefficients &a_coef, __m256i &r_r, __m256i &r_g, __m256i &r_b) {
+	a_y = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_sub_epi16(a_y, _mm256_set1_epi16(a_coef.y_offset)), _mm256_set1_epi16(a_coef.y_gain)), _mm256_set1_epi16(32));
+
+	r_r = _mm256_srai_epi16(_mm256_adds_epi16(a_y, _mm256_mullo_epi16(a_v, _mm256_set1_epi16(a_coef.v_to_r))), 6);
+	r_g = _mm256_srai_epi16(_mm256_subs_epi16(_mm256_subs_epi16(a_y,
+			_mm256_mullo_epi16(a_u, _mm256_set1_epi16(a_coef.u_to_g))),
+			_mm256_mullo_epi16(a_v, _mm256_set1_epi16(a_coef.v_to_g))), 6);
+	r_b = _mm256_srai_epi16(_mm256_adds_epi16(a_y, _mm256_mullo_epi16(a_u, _mm256_set1_epi16(a_coef.u_to_b))), 6);
+}
+
+GOZEN_TARGET_AVX2 static inline void _chroma_avx2(const uint8_t *a_u, const uint8_t *a_v, int a_x, __m256i &r_u, __m256i &r_v) {
+	// Loads the chroma for 16 pixels, with every sample doubled
+	if (a_v) {
+		__m128i l_u = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(a_u + a_x / 2));
+		__m128i l_v = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(a_v + a_x / 2));
+		r_u = _mm256_cvtepu8_epi16(_mm_unpacklo_epi8(l_u, l_u));
+		r_v = _mm256_cvtepu8_epi16(_mm_unpacklo_epi8(l_v, l_v));
+	} else {
+		__m128i l_uv = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a_u + a_x));
+		r_u = _mm256_cvtepu8_epi16(_mm_shuffle_epi8(l_uv, _mm_setr_epi8(0, 0, 2, 2, 4, 4, 6, 6, 8, 8, 10, 10, 12, 12, 14, 14)));
+		r_v = _mm256_cvtepu8_epi16(_mm_shuffle_epi8(l_uv, _mm_setr_epi8(1, 1, 3, 3, 5, 5, 7, 7, 9, 9, 11, 11, 13, 13, 15, 15)));
+	}
+
+	r_u = _mm256_sub_epi16(r_u, _mm256_set1_epi16(128));
+	r_v = _mm256_sub_epi16(r_v, _mm256_set1_epi16(128));
+}
+
+GOZEN_TARGET_AVX2 int ColorConverter::_row_avx2(const uint8_t *a_y, const uint8_t *a_u, const uint8_t *a_v, uint8_t *a_dst, int a_width, const Coefficients &a_coef) {
+	const __m256i l_alpha = _mm256_set1_epi8(-1);
+	int x = 0;
+
+	for (; x + 32 <= a_width; x += 32) {
+		__m256i l_u_lo, l_v_lo, l_u_hi, l_v_hi;
+		_chroma_avx2(a_u, a_v, x, l_u_lo, l_v_lo);
+		_chroma_avx2(a_u, a_v, x + 16, l_u_hi, l_v_hi);
+
+		__m256i l_r_lo, l_g_lo, l_b_lo, l_r_hi, l_g_hi, l_b_hi;
+		_rgb_avx2(_mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a_y + x))), l_u_lo, l_v_lo, a_coef, l_r_lo, l_g_lo, l_b_lo);
+		_rgb_avx2(_mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a_y + x + 16))), l_u_hi, l_v_hi, a_coef, l_r_hi, l_g_hi, l_b_hi);
+
+		// Packing works per 128 bit lane, giving pixels 0-7, 16-23 | 8-15, 24-31.
+		// The unpacks below are per lane as well, which puts them back in order.
+		__m256i l_r = _mm256_packus_epi16(l_r_lo, l_r_hi);
+		__m256i l_g = _mm256_packus_epi16(l_g_lo, l_g_hi);
+		__m256i l_b = _mm256_packus_epi16(l_b_lo, l_b_hi);
+
+		__m256i l_rg_lo = _mm256_unpacklo_epi8(l_r, l_g); // 0-7 | 8-15
+		__m256i l_rg_hi = _mm256_unpackhi_epi8(l_r, l_g); // 16-23 | 24-31
+		__m256i l_ba_lo = _mm256_unpacklo_epi8(l_b, l_alpha);
+		__m256i l_ba_hi = _mm256_unpackhi_epi8(l_b, l_alpha);
+
+		__m256i l_0 = _mm256_unpacklo_epi16(l_rg_lo, l_ba_lo); // 0-3 | 8-11
+		__m256i l_1 = _mm256_unpackhi_epi16(l_rg_lo, l_ba_lo); // 4-7 | 12-15
+		__m256i l_2 = _mm256_unpacklo_epi16(l_rg_hi, l_ba_hi); // 16-19 | 24-27
+		__m256i l_3 = _mm256_unpackhi_epi16(l_rg_hi, l_ba_hi); // 20-23 | 28-31
+
+		__m256i *l_dst = reinterpret_cast<__m256i *>(a_dst + x * 4);
+		_mm256_storeu_si256(l_dst, _mm256_permute2x128_si256(l_0, l_1, 0x20));
+		_mm256_storeu_si256(l_dst + 1, _mm256_permute2x128_si256(l_0, l_1, 0x31));
+		_mm256_storeu_si256(l_dst + 2, _mm256_permute2x128_si256(l_2, l_3, 0x20));
+		_mm256_storeu_si256(l_dst + 3, _mm256_permute2x128_si256(l_2, l_3, 0x31));
+	}
+
+	return x;
+}
+#else
+int ColorConverter::_row_sse2(const uint8_t *, const uint8_t *, const uint8_t *, uint8_t *, int, const Coefficients &) { return 0; }
+int ColorConverter::_row_avx2(const uint8_t *, const uint8_t *, const uint8_t *, uint8_t *, int, const Coefficients &) { return 0; }
+#endif
+
+
+#if defined(GOZEN_NEON)
+static inline uint8x8x3_t _rgb_neon(int16x8_t a_y, int16x8_t a_u, int16x8_t a_v, const ColorConverter::Coefficients &a_coef) {
+	a_y = vaddq_s16(vmulq_n_s16(vsubq_s16(a_y, vdupq_n_s16(a_coef.y_offset)), a_coef.y_gain), vdupq_n_s16(32));
+
+	uint8x8x3_t l_rgb;
+	l_rgb.val[0] = vqshrun_n_s16(vqaddq_s16(a_y, vmulq_n_s16(a_v, a_coef.v_to_r)), 6);
+	l_rgb.val[1] = vqshrun_n_s16(vqsubq_s16(vqsubq_s16(a_y, vmulq_n_s16(a_u, a_coef.u_to_g)), vmulq_n_s16(a_v, a_coef.v_to_g)), 6);
+	l_rgb.val[2] = vqshrun_n_s16(vqaddq_s16(a_y, vmulq_n_s16(a_u, a_coef.u_to_b)), 6);
+	return l_rgb;
+}
+
+int ColorConverter::_row_neon(const uint8_t *a_y, const uint8_t *a_u, const uint8_t *a_v, uint8_t *a_dst, int a_width, const Coefficients &a_coef) {
+	const int16x8_t l_128 = vdupq_n_s16(128);
+	int x = 0;
+
+	for (; x + 16 <= a_width; x += 16) {
+		uint8x16_t l_y = vld1q_u8(a_y + x);
+		uint8x8_t l_u, l_v;
+
+		if (a_v) {
+			l_u = vld1_u8(a_u + x / 2);
+			l_v = vld1_u8(a_v + x / 2);
+		} else {
+			uint8x8x2_t l_uv = vld2_u8(a_u + x);
+			l_u = l_uv.val[0];
+			l_v = l_uv.val[1];
+		}
+
+		// Every chroma sample is used by two neighbouring pixels
+		uint8x8x2_t l_u2 = vzip_u8(l_u, l_u);
+		uint8x8x2_t l_v2 = vzip_u8(l_v, l_v);
+
+		uint8x8x3_t l_lo = _rgb_neon(
+				vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(l_y))),
+				vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(l_u2.val[0])), l_128),
+				vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(l_v2.val[0])), l_128), a_coef);
+		uint8x8x3_t l_hi = _rgb_neon(
+				vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(l_y))),
+				vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(l_u2.val[1])), l_128),
+				vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(l_v2.val[1])), l_128), a_coef);
+
+		uint8x16x4_t l_rgba;
+		l_rgba.val[0] = vcombine_u8(l_lo.val[0], l_hi.val[0]);
+		l_rgba.val[1] = vcombine_u8(l_lo.val[1], l_hi.val[1]);
+		l_rgba.val[2] = vcombine_u8(l_lo.val[2], l_hi.val[2]);
+		l_rgba.val[3] = vdupq_n_u8(255);
+		vst4q_u8(a_dst + x * 4, l_rgba);
+	}
+
+	return x;
+}
+#else
+int ColorConverter::_row_neon(const uint8_t *, const uint8_t *, const uint8_t *, uint8_t *, int, const Coefficients &) { return 0; }
+#endif
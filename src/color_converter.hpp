@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+
+
+// Converts the 8 bit yuv420p and nv12 planes which Video shows into RGBA8.
+// Math is done in 16 bit fixed point so the SIMD kernels and the scalar
+// fallback give the same result. For nv12 the interleaved plane is given as
+// a_u and a_v stays nullptr.
+class ColorConverter {
+public:
+	enum Matrix {
+		MATRIX_BT601,
+		MATRIX_BT709,
+		MATRIX_BT2020,
+	};
+
+	enum Path {
+		PATH_AUTO,
+		PATH_SCALAR,
+		PATH_SSE2,
+		PATH_AVX2,
+		PATH_NEON,
+	};
+
+	struct Coefficients {
+		int16_t y_offset = 0;
+		int16_t y_gain = 64; // All gains are scaled by 64
+		int16_t v_to_r = 0;
+		int16_t u_to_g = 0;
+		int16_t v_to_g = 0;
+		int16_t u_to_b = 0;
+	};
+
+
+private:
+	Coefficients coefficients;
+	Path path = PATH_AUTO;
+
+
+	static void _row_scalar(const uint8_t *a_y, const uint8_t *a_u, const uint8_t *a_v, uint8_t *a_dst, int a_start, int a_width, const Coefficients &a_coef);
+	static int _row_sse2(const uint8_t *a_y, const uint8_t *a_u, const uint8_t *a_v, uint8_t *a_dst, int a_width, const Coefficients &a_coef);
+	static int _row_avx2(const uint8_t *a_y, const uint8_t *a_u, const uint8_t *a_v, uint8_t *a_dst, int a_width, const Coefficients &a_coef);
+	static int _row_neon(const uint8_t *a_y, const uint8_t *a_u, const uint8_t *a_v, uint8_t *a_dst, int a_width, const Coefficients &a_coef);
+
+
+public:
+	ColorConverter() { set_matrix(MATRIX_BT709, false); }
+
+	void set_matrix(Matrix a_matrix, bool a_full_range);
+	inline const Coefficients &get_coefficients() const { return coefficients; }
+
+	// PATH_AUTO picks the fastest path the CPU supports, unsupported paths
+	// fall back to the scalar code
+	inline void set_path(Path a_path) { path = a_path; }
+	Path get_path() const;
+	static Path get_best_path();
+	static const char *get_path_name(Path a_path);
+
+	void convert(const uint8_t *a_y, int a_y_stride, const uint8_t *a_u, const uint8_t *a_v, int a_uv_stride,
+			uint8_t *a_dst, int a_dst_stride, int a_width, int a_height) const;
+};
@@ -9,9 +9,12 @@ void FFmpeg::print_av_error(const char *a_message, int a_error) {
 	UtilityFunctions::printerr((std::string(a_message) + " " + l_error_buffer).c_str());
 }
 
-void FFmpeg::enable_multithreading(AVCodecContext *&a_codec_ctx, const AVCodec *&a_codec) {
-	a_codec_ctx->thread_count = OS::get_singleton()->get_processor_count() - 1;
-	if (a_codec->capabilities & AV_CODEC_CAP_FRAME_THREADS) {
+void FFmpeg::enable_multithreading(AVCodecContext *&a_codec_ctx, const AVCodec *&a_codec, int a_thread_count) {
+	// Thread count of 0 means using all cores except one
+	a_codec_ctx->thread_count = a_thread_count > 0 ? a_thread_count : OS::get_singleton()->get_processor_count() - 1;
+	if (a_codec_ctx->thread_count <= 1) {
+		a_codec_ctx->thread_count = 1;
+	} else if (a_codec->capabilities & AV_CODEC_CAP_FRAME_THREADS) {
 		a_codec_ctx->thread_type = FF_THREAD_FRAME;
 	} else if (a_codec->capabilities & AV_CODEC_CAP_SLICE_THREADS) {
 		a_codec_ctx->thread_type = FF_THREAD_SLICE;
@@ -45,6 +48,29 @@ int FFmpeg::get_frame(AVFormatContext *a_format_ctx, AVCodecContext *a_codec_ctx
 	return response;
 }
 
+int FFmpeg::encode_frame(AVCodecContext *a_codec_ctx, AVFormatContext *a_format_ctx, AVStream *a_stream, const AVFrame *a_frame, AVPacket *a_packet) {
+	// Sending a null frame flushes the encoder
+	if ((response = avcodec_send_frame(a_codec_ctx, a_frame)) < 0) {
+		print_av_error("Error sending frame to encoder!", response);
+		return response;
+	}
+
+	while ((response = avcodec_receive_packet(a_codec_ctx, a_packet)) >= 0) {
+		av_packet_rescale_ts(a_packet, a_codec_ctx->time_base, a_stream->time_base);
+		a_packet->stream_index = a_stream->index;
+
+		if ((response = av_interleaved_write_frame(a_format_ctx, a_packet)) < 0) {
+			print_av_error("Error writing packet!", response);
+			return response;
+		}
+	}
+
+	// Encoder needs more frames, or is empty after flushing
+	if (response == AVERROR(EAGAIN) || response == AVERROR_EOF)
+		response = 0;
+	return response;
+}
+
 enum AVPixelFormat FFmpeg::get_hw_format(const enum AVPixelFormat *a_pix_fmt, enum AVPixelFormat *a_hw_pix_fmt) {
 	const enum AVPixelFormat *p;
 
@@ -57,7 +83,7 @@ enum AVPixelFormat FFmpeg::get_hw_format(const enum AVPixelFormat *a_pix_fmt, en
 }
 
 
-AudioStreamWAV *FFmpeg::get_audio(AVFormatContext *&a_format_ctx, AVStream *&a_stream) {
+AudioStreamWAV *FFmpeg::get_audio(AVFormatContext *&a_format_ctx, AVStream *&a_stream, std::function<void(float)> a_progress) {
 	AudioStreamWAV *l_audio = memnew(AudioStreamWAV);
 
 	const AVCodec *l_codec_audio = avcodec_find_decoder(a_stream->codecpar->codec_id);
@@ -128,6 +154,19 @@ AudioStreamWAV *FFmpeg::get_audio(AVFormatContext *&a_format_ctx, AVStream *&a_s
 	bool l_stereo = l_codec_ctx_audio->ch_layout.nb_channels >= 2;
 	size_t l_audio_size = 0;
 
+	// Allocating the full track at once, growing the data for every frame
+	// meant a reallocation and copy of everything decoded so far each time.
+	double l_duration = 0;
+	if (a_stream->duration != AV_NOPTS_VALUE)
+		l_duration = a_stream->duration * av_q2d(a_stream->time_base);
+	else if (a_format_ctx->duration != AV_NOPTS_VALUE)
+		l_duration = static_cast<double>(a_format_ctx->duration) / AV_TIME_BASE;
+
+	size_t l_audio_capacity = static_cast<size_t>(std::ceil(std::max(l_duration, 0.0) * l_codec_ctx_audio->sample_rate)) * l_bytes_per_samples * (l_stereo ? 2 : 1);
+	l_audio_capacity += l_audio_capacity / 100 + 65536; // Margin for inaccurate durations
+	l_audio_data.resize(l_audio_capacity);
+	uint8_t *l_audio_ptr = l_audio_data.ptrw();
+
 	while (true) {
 		if (get_frame(a_format_ctx, l_codec_ctx_audio, a_stream->index, l_frame, l_packet))
 			break;
@@ -163,14 +202,24 @@ AudioStreamWAV *FFmpeg::get_audio(AVFormatContext *&a_format_ctx, AVStream *&a_s
 		if (l_codec_ctx_audio->ch_layout.nb_channels >= 2)
 			l_byte_size *= 2;
 
-		l_audio_data.resize(l_audio_size + l_byte_size);
-		memcpy(&(l_audio_data.ptrw()[l_audio_size]), l_decoded_frame->extended_data[0], l_byte_size);
+		if (l_audio_size + l_byte_size > l_audio_capacity) { // Estimate was off
+			l_audio_capacity = std::max(l_audio_capacity * 2, l_audio_size + l_byte_size);
+			l_audio_data.resize(l_audio_capacity);
+			l_audio_ptr = l_audio_data.ptrw();
+		}
+
+		memcpy(l_audio_ptr + l_audio_size, l_decoded_frame->extended_data[0], l_byte_size);
 		l_audio_size += l_byte_size;
 
+		if (a_progress && l_duration > 0 && l_frame->best_effort_timestamp != AV_NOPTS_VALUE)
+			a_progress(std::clamp(static_cast<float>(l_frame->best_effort_timestamp * av_q2d(a_stream->time_base) / l_duration), 0.0f, 1.0f));
+
 		av_frame_unref(l_frame);
 		av_frame_unref(l_decoded_frame);
 	}
 
+	l_audio_data.resize(l_audio_size);
+
 	// Audio creation
 	l_audio->set_format(l_audio->FORMAT_16_BITS);
 	l_audio->set_mix_rate(l_codec_ctx_audio->sample_rate);
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+#include <functional>
+
 extern "C" {
 	#include <libavcodec/avcodec.h>
 	#include <libavcodec/codec.h>
@@ -39,14 +43,17 @@ using namespace godot;
 
 class FFmpeg {
 public:
-	static inline int response = 0;
-	static inline bool eof = false;
+	// Thread local as Video can decode on its own prefetch thread
+	static inline thread_local int response = 0;
+	static inline thread_local bool eof = false;
 
 	static void print_av_error(const char *a_message, int a_error);
 
-	static void enable_multithreading(AVCodecContext *&a_codec_ctx, const AVCodec *&a_codec);
+	static void enable_multithreading(AVCodecContext *&a_codec_ctx, const AVCodec *&a_codec, int a_thread_count = 0);
 	static int get_frame(AVFormatContext *a_format_ctx, AVCodecContext *a_codec_ctx, int a_stream_id, AVFrame *a_frame, AVPacket *a_packet);
+	static int encode_frame(AVCodecContext *a_codec_ctx, AVFormatContext *a_format_ctx, AVStream *a_stream, const AVFrame *a_frame, AVPacket *a_packet);
 	static enum AVPixelFormat get_hw_format(const enum AVPixelFormat *a_pix_fmt, enum AVPixelFormat *a_hw_pix_fmt);
 
-	static AudioStreamWAV *get_audio(AVFormatContext *&a_format_ctx, AVStream *&a_stream);
+	// Progress goes from 0 to 1, based on the timestamps of decoded frames
+	static AudioStreamWAV *get_audio(AVFormatContext *&a_format_ctx, AVStream *&a_stream, std::function<void(float)> a_progress = nullptr);
 };
@@ -0,0 +1,73 @@
+#include "frame_cache.hpp"
+
+
+void FrameCache::set_max_size(size_t a_size) {
+	max_size = a_size;
+	_evict(0);
+}
+
+const AVFrame *FrameCache::get(int64_t a_frame_nr) {
+	if (!is_enabled())
+		return nullptr;
+
+	auto l_it = lookup.find(a_frame_nr);
+	if (l_it == lookup.end()) {
+		misses++;
+		return nullptr;
+	}
+
+	// Marking as most recently used
+	entries.splice(entries.begin(), entries, l_it->second);
+
+	hits++;
+	return l_it->second->frame;
+}
+
+void FrameCache::insert(int64_t a_frame_nr, const AVFrame *a_frame) {
+	if (!is_enabled() || !a_frame->buf[0] || lookup.find(a_frame_nr) != lookup.end())
+		return;
+
+	size_t l_size = _get_frame_size(a_frame);
+	if (l_size > max_size)
+		return;
+
+	AVFrame *l_frame = av_frame_clone(a_frame);
+	if (!l_frame)
+		return;
+
+	_evict(l_size);
+
+	entries.push_front({ a_frame_nr, l_size, l_frame });
+	lookup[a_frame_nr] = entries.begin();
+	size += l_size;
+}
+
+void FrameCache::clear() {
+	for (Entry &l_entry : entries)
+		av_frame_free(&l_entry.frame);
+
+	entries.clear();
+	lookup.clear();
+	size = 0;
+}
+
+size_t FrameCache::_get_frame_size(const AVFrame *a_frame) {
+	size_t l_size = 0;
+
+	for (int i = 0; i < AV_NUM_DATA_POINTERS && a_frame->buf[i]; i++)
+		l_size += a_frame->buf[i]->size;
+
+	return l_size;
+}
+
+void FrameCache::_evict(size_t a_needed) {
+	while (!entries.empty() && size + a_needed > max_size) {
+		Entry &l_entry = entries.back();
+
+		lookup.erase(l_entry.frame_nr);
+		size -= l_entry.size;
+		av_frame_free(&l_entry.frame);
+		entries.pop_back();
+		evictions++;
+	}
+}
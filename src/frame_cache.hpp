@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+
+#include "ffmpeg.hpp"
+
+
+using namespace godot;
+
+
+// LRU cache of shown frames. Entries are references to the refcounted frame
+// buffers, so caching a frame doesn't copy its data.
+class FrameCache {
+private:
+	struct Entry {
+		int64_t frame_nr = 0;
+		size_t size = 0;
+		AVFrame *frame = nullptr;
+	};
+
+	std::list<Entry> entries; // Front is the most recently used frame
+	std::unordered_map<int64_t, std::list<Entry>::iterator> lookup;
+
+	size_t max_size = 0; // In bytes, 0 = disabled
+	size_t size = 0;
+
+	int64_t hits = 0;
+	int64_t misses = 0;
+	int64_t evictions = 0;
+
+
+	static size_t _get_frame_size(const AVFrame *a_frame);
+	void _evict(size_t a_needed);
+
+
+public:
+	~FrameCache() { clear(); }
+
+	void set_max_size(size_t a_size);
+	inline size_t get_max_size() const { return max_size; }
+	inline size_t get_size() const { return size; }
+	inline bool is_enabled() const { return max_size != 0; }
+
+	const AVFrame *get(int64_t a_frame_nr);
+	void insert(int64_t a_frame_nr, const AVFrame *a_frame);
+	void clear();
+
+	inline int64_t get_hits() const { return hits; }
+	inline int64_t get_misses() const { return misses; }
+	inline int64_t get_evictions() const { return evictions; }
+};
@@ -69,6 +69,15 @@ void GoZenError::print_error(ERROR a_err) {
 
 		case ERR_CREATING_SWR:
 			return _print("Couldn't get/create SWR context!");
+
+		case ERR_FAILED_FINDING_VIDEO_ENCODER:
+			return _print("Couldn't find codec encoder for video!");
+		case ERR_ENCODING:
+			return _print("Encoding or writing the file failed!");
+		case ERR_CANCELLED:
+			return _print("Operation got cancelled!");
+		case ERR_QUEUE_FULL:
+			return _print("Queue is full, try again later!");
 	}
 
 }
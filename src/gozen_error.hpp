@@ -50,6 +50,11 @@ public:
 		ERR_SCALING_FAILED,
 
 		ERR_CREATING_SWR,
+
+		ERR_FAILED_FINDING_VIDEO_ENCODER,
+		ERR_ENCODING,
+		ERR_CANCELLED,
+		ERR_QUEUE_FULL,
 	};
 
 	static void print_error(ERROR a_err);
@@ -93,6 +98,11 @@ protected:
 
 		BIND_ENUM_CONSTANT(ERR_CREATING_SWR);
 
+		BIND_ENUM_CONSTANT(ERR_FAILED_FINDING_VIDEO_ENCODER);
+		BIND_ENUM_CONSTANT(ERR_ENCODING);
+		BIND_ENUM_CONSTANT(ERR_CANCELLED);
+		BIND_ENUM_CONSTANT(ERR_QUEUE_FULL);
+
 		ClassDB::bind_static_method("GoZenError", D_METHOD("print_error", "a_err"), &GoZenError::print_error);
 	}
 };
@@ -0,0 +1,173 @@
+#include "packet_index.hpp"
+
+#include <algorithm>
+
+
+int PacketIndex::build(AVFormatContext *a_format_ctx, AVStream *a_stream) {
+	clear();
+
+	AVPacket *l_packet = av_packet_alloc();
+	if (!l_packet)
+		return GoZenError::ERR_FAILED_ALLOC_PACKET;
+
+	// Other streams get discarded so the demuxer can skip their data
+	std::vector<AVDiscard> l_discard;
+	for (unsigned int i = 0; i < a_format_ctx->nb_streams; i++) {
+		l_discard.push_back(a_format_ctx->streams[i]->discard);
+		if (a_format_ctx->streams[i] != a_stream)
+			a_format_ctx->streams[i]->discard = AVDISCARD_ALL;
+	}
+
+	int l_response = av_seek_frame(a_format_ctx, a_stream->index, a_stream->start_time != AV_NOPTS_VALUE ? a_stream->start_time : 0, AVSEEK_FLAG_BACKWARD);
+	if (l_response < 0)
+		FFmpeg::print_av_error("Seeking to start for packet index failed!", l_response);
+
+	if (a_stream->nb_frames > 0) {
+		pts.reserve(a_stream->nb_frames);
+		dts.reserve(a_stream->nb_frames);
+		pos.reserve(a_stream->nb_frames);
+		keyframe.reserve(a_stream->nb_frames);
+	}
+
+	while ((l_response = av_read_frame(a_format_ctx, l_packet)) >= 0) {
+		if (l_packet->stream_index == a_stream->index) {
+			pts.push_back(l_packet->pts != AV_NOPTS_VALUE ? l_packet->pts : l_packet->dts);
+			dts.push_back(l_packet->dts);
+			pos.push_back(l_packet->pos);
+			keyframe.push_back((l_packet->flags & AV_PKT_FLAG_KEY) != 0);
+		}
+		av_packet_unref(l_packet);
+	}
+	av_packet_free(&l_packet);
+
+	for (unsigned int i = 0; i < a_format_ctx->nb_streams; i++)
+		a_format_ctx->streams[i]->discard = l_discard[i];
+
+	if (l_response != AVERROR_EOF) {
+		FFmpeg::print_av_error("Reading packets for packet index failed!", l_response);
+		clear();
+		return GoZenError::ERR_SEEKING;
+	}
+
+	// Packets without any timestamp can't be shown at a known time
+	display_order.reserve(pts.size());
+	for (size_t i = 0; i < pts.size(); i++) {
+		if (pts[i] == AV_NOPTS_VALUE)
+			continue;
+
+		display_order.push_back(i);
+		if (keyframe[i])
+			keyframes.push_back(i);
+	}
+
+	auto l_compare = [this](int32_t a, int32_t b) { return pts[a] < pts[b]; };
+	std::stable_sort(display_order.begin(), display_order.end(), l_compare);
+	std::stable_sort(keyframes.begin(), keyframes.end(), l_compare);
+
+	if (keyframes.empty()) {
+		UtilityFunctions::printerr("No keyframes found for packet index!");
+		clear();
+		return GoZenError::ERR_INVALID_VIDEO;
+	}
+
+	return OK;
+}
+
+void PacketIndex::clear() {
+	pts.clear();
+	dts.clear();
+	pos.clear();
+	keyframe.clear();
+	display_order.clear();
+	keyframes.clear();
+}
+
+void PacketIndex::save(Ref<FileAccess> &a_file) const {
+	_store_vector(a_file, pts);
+	_store_vector(a_file, dts);
+	_store_vector(a_file, pos);
+	_store_vector(a_file, keyframe);
+	_store_vector(a_file, display_order);
+	_store_vector(a_file, keyframes);
+}
+
+bool PacketIndex::load(Ref<FileAccess> &a_file) {
+	clear();
+
+	if (!_get_vector(a_file, pts) || !_get_vector(a_file, dts) ||
+			!_get_vector(a_file, pos) || !_get_vector(a_file, keyframe) ||
+			!_get_vector(a_file, display_order) || !_get_vector(a_file, keyframes)) {
+		clear();
+		return false;
+	}
+
+	// The sidecar can be corrupt or edited, lookups index pts and the other
+	// arrays with these packet nr's without checking them
+	bool l_valid = !is_empty() && !keyframes.empty() && dts.size() == pts.size() &&
+			pos.size() == pts.size() && keyframe.size() == pts.size() && display_order.size() <= pts.size();
+
+	for (size_t i = 0; l_valid && i < display_order.size(); i++)
+		l_valid = display_order[i] >= 0 && static_cast<size_t>(display_order[i]) < pts.size() &&
+				(i == 0 || pts[display_order[i - 1]] <= pts[display_order[i]]);
+	for (size_t i = 0; l_valid && i < keyframes.size(); i++)
+		l_valid = keyframes[i] >= 0 && static_cast<size_t>(keyframes[i]) < pts.size();
+
+	if (!l_valid)
+		clear();
+	return l_valid;
+}
+
+template <typename T>
+void PacketIndex::_store_vector(Ref<FileAccess> &a_file, const std::vector<T> &a_vector) {
+	PackedByteArray l_data;
+	l_data.resize(a_vector.size() * sizeof(T));
+	if (!a_vector.empty())
+		memcpy(l_data.ptrw(), a_vector.data(), l_data.size());
+
+	a_file->store_64(a_vector.size());
+	a_file->store_buffer(l_data);
+}
+
+template <typename T>
+bool PacketIndex::_get_vector(Ref<FileAccess> &a_file, std::vector<T> &a_vector) {
+	uint64_t l_size = a_file->get_64();
+	// Dividing, since a corrupt size could overflow the multiplication
+	if (l_size > (a_file->get_length() - a_file->get_position()) / sizeof(T))
+		return false;
+
+	PackedByteArray l_data = a_file->get_buffer(l_size * sizeof(T));
+	if (static_cast<uint64_t>(l_data.size()) != l_size * sizeof(T))
+		return false;
+
+	a_vector.resize(l_size);
+	if (l_size)
+		memcpy(a_vector.data(), l_data.ptr(), l_data.size());
+	return true;
+}
+
+int64_t PacketIndex::get_frame_pts(int64_t a_frame_nr) const {
+	if (a_frame_nr < 0 || a_frame_nr >= get_frame_count())
+		return AV_NOPTS_VALUE;
+	return pts[display_order[a_frame_nr]];
+}
+
+int64_t PacketIndex::find_frame(int64_t a_pts) const {
+	// Returns the last frame which starts at or before the given pts
+	auto l_it = std::upper_bound(display_order.begin(), display_order.end(), a_pts,
+			[this](int64_t a_value, int32_t a_packet) { return a_value < pts[a_packet]; });
+
+	if (l_it == display_order.begin())
+		return 0;
+	return (l_it - display_order.begin()) - 1;
+}
+
+int64_t PacketIndex::get_keyframe_packet(int64_t a_frame_nr) const {
+	// Returns the last keyframe which is shown at or before the frame
+	int64_t l_pts = get_frame_pts(a_frame_nr);
+	auto l_it = std::upper_bound(keyframes.begin(), keyframes.end(), l_pts,
+			[this](int64_t a_value, int32_t a_packet) { return a_value < pts[a_packet]; });
+
+	if (l_it == keyframes.begin())
+		return keyframes.front();
+	return *(l_it - 1);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <godot_cpp/classes/file_access.hpp>
+
+#include "ffmpeg.hpp"
+#include "gozen_error.hpp"
+
+
+using namespace godot;
+
+
+// Demux-only index of all packets of one video stream. Packets are stored in
+// decode order as a struct of arrays, frames get looked up in display order.
+class PacketIndex {
+private:
+	std::vector<int64_t> pts;
+	std::vector<int64_t> dts;
+	std::vector<int64_t> pos;
+	std::vector<uint8_t> keyframe;
+
+	std::vector<int32_t> display_order; // Frame nr -> packet nr, sorted on pts
+	std::vector<int32_t> keyframes; // Packet nr's of keyframes, sorted on pts
+
+
+	template <typename T>
+	static void _store_vector(Ref<FileAccess> &a_file, const std::vector<T> &a_vector);
+	template <typename T>
+	static bool _get_vector(Ref<FileAccess> &a_file, std::vector<T> &a_vector);
+
+public:
+	int build(AVFormatContext *a_format_ctx, AVStream *a_stream);
+	void clear();
+
+	void save(Ref<FileAccess> &a_file) const;
+	bool load(Ref<FileAccess> &a_file);
+
+	inline bool is_empty() const { return display_order.empty(); }
+	inline int64_t get_frame_count() const { return display_order.size(); }
+	inline int64_t get_packet_count() const { return pts.size(); }
+	inline int64_t get_keyframe_count() const { return keyframes.size(); }
+
+	int64_t get_frame_pts(int64_t a_frame_nr) const;
+	int64_t find_frame(int64_t a_pts) const;
+	int64_t get_keyframe_packet(int64_t a_frame_nr) const;
+
+	inline int64_t get_packet_pts(int64_t a_packet_nr) const { return pts[a_packet_nr]; }
+	inline int64_t get_packet_dts(int64_t a_packet_nr) const { return dts[a_packet_nr]; }
+	inline int64_t get_packet_pos(int64_t a_packet_nr) const { return pos[a_packet_nr]; }
+	inline bool is_keyframe(int64_t a_packet_nr) const { return keyframe[a_packet_nr]; }
+
+	inline int64_t get_keyframe(int64_t a_keyframe_nr) const { return keyframes[a_keyframe_nr]; } // Packet nr
+};
@@ -0,0 +1,193 @@
+#include "proxy_generator.hpp"
+
+
+int ProxyGenerator::start(String a_path, String a_proxy_path, int a_height, int a_quality) {
+	if (running)
+		return GoZenError::ERR_ALREADY_OPEN_VIDEO;
+	if (worker.joinable())
+		worker.join();
+
+	path = a_path.utf8();
+	proxy_path = a_proxy_path.utf8();
+	global_part_path = ProjectSettings::get_singleton()->globalize_path(a_proxy_path + ".part").utf8();
+	height = std::max(a_height, 2);
+	quality = std::clamp(a_quality, 1, 31);
+
+	frame_count = 0;
+	frames_done = 0;
+	error = OK;
+	cancelled = false;
+	running = true;
+
+	worker = std::thread(&ProxyGenerator::_generate, this);
+	return OK;
+}
+
+void ProxyGenerator::cancel() {
+	cancelled = true;
+	if (worker.joinable())
+		worker.join();
+}
+
+float ProxyGenerator::get_progress() {
+	int64_t l_frame_count = frame_count;
+	if (l_frame_count <= 0)
+		return 0.0f;
+	return std::min(static_cast<float>(frames_done) / l_frame_count, 1.0f);
+}
+
+void ProxyGenerator::_generate() {
+	// Decoding runs on the segment workers, this thread only scales and encodes
+	SegmentDecoder l_decoder;
+	int l_response = l_decoder.open(path.c_str());
+	if (l_response)
+		return _finish(l_response);
+	frame_count = l_decoder.get_frame_count();
+
+	std::string l_part_path = proxy_path + ".part";
+	AVFormatContext *l_format_ctx = nullptr;
+	if (avformat_alloc_output_context2(&l_format_ctx, NULL, "matroska", global_part_path.c_str()) < 0 || !l_format_ctx)
+		return _finish(GoZenError::ERR_CREATING_AV_FORMAT_FAILED);
+
+	if (avio_open(&l_format_ctx->pb, global_part_path.c_str(), AVIO_FLAG_WRITE) < 0) {
+		avformat_free_context(l_format_ctx);
+		return _finish(GoZenError::ERR_OPENING_VIDEO);
+	}
+
+	l_response = _transcode(l_decoder, l_format_ctx);
+	l_decoder.close();
+
+	avio_closep(&l_format_ctx->pb);
+	avformat_free_context(l_format_ctx);
+
+	if (l_response) {
+		DirAccess::remove_absolute(l_part_path.c_str());
+		return _finish(l_response);
+	}
+
+	// An old proxy gets replaced
+	if (FileAccess::file_exists(proxy_path.c_str()))
+		DirAccess::remove_absolute(proxy_path.c_str());
+	if (DirAccess::rename_absolute(l_part_path.c_str(), proxy_path.c_str()) != Error::OK) {
+		DirAccess::remove_absolute(l_part_path.c_str());
+		return _finish(GoZenError::ERR_ENCODING);
+	}
+
+	_finish(OK);
+}
+
+int ProxyGenerator::_transcode(SegmentDecoder &a_decoder, AVFormatContext *a_format_ctx) {
+	const AVCodecParameters *l_params = a_decoder.get_codec_params();
+	const AVCodec *l_codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+	if (!l_codec)
+		return GoZenError::ERR_FAILED_FINDING_VIDEO_ENCODER;
+
+	// Proxy keeps the aspect ratio, both sizes need to be even for yuv420
+	int l_height = std::min(height, l_params->height) & ~1;
+	int l_width = static_cast<int>(av_rescale(l_params->width, l_height, l_params->height)) & ~1;
+	if (l_width <= 0 || l_height <= 0)
+		return GoZenError::ERR_INVALID_VIDEO;
+
+	AVStream *l_stream = avformat_new_stream(a_format_ctx, NULL);
+	if (!l_stream)
+		return GoZenError::ERR_FAILED_CREATING_STREAM;
+
+	AVCodecContext *l_codec_ctx = avcodec_alloc_context3(l_codec);
+	if (!l_codec_ctx)
+		return GoZenError::ERR_FAILED_ALLOC_VIDEO_CODEC;
+
+	// Timestamps stay the same as the source, so frame numbers line up
+	l_codec_ctx->width = l_width;
+	l_codec_ctx->height = l_height;
+	l_codec_ctx->pix_fmt = AV_PIX_FMT_YUVJ420P;
+	l_codec_ctx->color_range = AVCOL_RANGE_JPEG;
+	l_codec_ctx->sample_aspect_ratio = l_params->sample_aspect_ratio;
+	l_codec_ctx->time_base = a_decoder.get_time_base();
+	l_codec_ctx->framerate = a_decoder.get_frame_rate();
+	l_codec_ctx->flags |= AV_CODEC_FLAG_QSCALE;
+	l_codec_ctx->global_quality = FF_QP2LAMBDA * quality;
+	if (a_format_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+		l_codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+	FFmpeg::enable_multithreading(l_codec_ctx, l_codec);
+
+	AVFrame *l_frame = av_frame_alloc();
+	AVPacket *l_packet = av_packet_alloc();
+	SwsContext *l_sws_ctx = nullptr;
+	int l_error = OK;
+
+	if (!l_frame || !l_packet)
+		l_error = GoZenError::ERR_FAILED_ALLOC_FRAME;
+	else if (avcodec_open2(l_codec_ctx, l_codec, NULL) < 0)
+		l_error = GoZenError::ERR_FAILED_OPEN_VIDEO_CODEC;
+	else if (avcodec_parameters_from_context(l_stream->codecpar, l_codec_ctx) < 0)
+		l_error = GoZenError::ERR_COPY_STREAM_PARAMS;
+	else {
+		l_stream->time_base = l_codec_ctx->time_base;
+		l_stream->avg_frame_rate = l_codec_ctx->framerate;
+
+		l_frame->format = l_codec_ctx->pix_fmt;
+		l_frame->width = l_width;
+		l_frame->height = l_height;
+
+		if (av_frame_get_buffer(l_frame, 0) < 0)
+			l_error = GoZenError::ERR_FAILED_ALLOC_FRAME;
+		else if (avformat_write_header(a_format_ctx, NULL) < 0)
+			l_error = GoZenError::ERR_WRITING_HEADER;
+	}
+
+	int64_t l_frame_nr = 0;
+	AVFrame *l_source;
+	while (!l_error && (l_source = a_decoder.pop_frame(l_frame_nr))) {
+		if (cancelled) {
+			av_frame_free(&l_source);
+			l_error = GoZenError::ERR_CANCELLED;
+			break;
+		}
+
+		l_sws_ctx = sws_getCachedContext(l_sws_ctx,
+				l_source->width, l_source->height, static_cast<AVPixelFormat>(l_source->format),
+				l_width, l_height, l_codec_ctx->pix_fmt,
+				SWS_BILINEAR, NULL, NULL, NULL);
+
+		// The encoder can still hold a reference to the previous frame
+		if (!l_sws_ctx)
+			l_error = GoZenError::ERR_CREATING_SWS;
+		else if (av_frame_make_writable(l_frame) < 0)
+			l_error = GoZenError::ERR_FRAME_NOT_WRITABLE;
+		else {
+			sws_scale(l_sws_ctx, l_source->data, l_source->linesize, 0, l_source->height, l_frame->data, l_frame->linesize);
+			l_frame->pts = l_source->best_effort_timestamp;
+
+			if (FFmpeg::encode_frame(l_codec_ctx, a_format_ctx, l_stream, l_frame, l_packet) < 0)
+				l_error = GoZenError::ERR_ENCODING;
+		}
+
+		av_frame_free(&l_source);
+		frames_done = l_frame_nr + 1;
+	}
+
+	// Flushing and the trailer are only needed for a file we keep
+	if (!l_error) {
+		if (FFmpeg::encode_frame(l_codec_ctx, a_format_ctx, l_stream, nullptr, l_packet) < 0 ||
+				av_write_trailer(a_format_ctx) < 0)
+			l_error = GoZenError::ERR_ENCODING;
+	}
+
+	sws_freeContext(l_sws_ctx);
+	avcodec_free_context(&l_codec_ctx);
+	if (l_frame) av_frame_free(&l_frame);
+	if (l_packet) av_packet_free(&l_packet);
+
+	return l_error;
+}
+
+void ProxyGenerator::_finish(int a_error) {
+	if (a_error && a_error != GoZenError::ERR_CANCELLED)
+		GoZenError::print_error(static_cast<GoZenError::ERROR>(a_error));
+
+	error = a_error;
+	running = false;
+	if (emit_finished)
+		call_deferred("emit_signal", "finished", a_error);
+}
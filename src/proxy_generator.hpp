@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+#include <godot_cpp/classes/dir_access.hpp>
+#include <godot_cpp/classes/file_access.hpp>
+#include <godot_cpp/classes/project_settings.hpp>
+#include <godot_cpp/classes/resource.hpp>
+#include <godot_cpp/variant/utility_functions.hpp>
+
+#include "ffmpeg.hpp"
+#include "segment_decoder.hpp"
+#include "gozen_error.hpp"
+
+
+using namespace godot;
+
+
+// Transcodes a video on a background thread into a small intra only file
+// (MJPEG in Matroska) so editing doesn't need to decode long GOP's.
+// The file is written next to the proxy path with ".part" appended and only
+// gets renamed once it's complete, so Video never opens a half written proxy.
+class ProxyGenerator : public Resource {
+	GDCLASS(ProxyGenerator, Resource);
+
+private:
+	std::thread worker;
+	std::atomic<bool> running = false;
+	std::atomic<bool> cancelled = false;
+	std::atomic<bool> emit_finished = true; // Not when the generator gets freed
+	std::atomic<int64_t> frames_done = 0;
+	std::atomic<int> error = OK;
+
+	std::string path = "";
+	std::string proxy_path = "";
+	std::string global_part_path = ""; // For FFmpeg, which can't open user:// paths
+	std::atomic<int64_t> frame_count = 0;
+	int height = 540;
+	int quality = 5; // MJPEG qscale, lower is better
+
+
+	void _generate();
+	int _transcode(SegmentDecoder &a_decoder, AVFormatContext *a_format_ctx);
+	void _finish(int a_error);
+
+
+public:
+	ProxyGenerator() {}
+	~ProxyGenerator() {
+		emit_finished = false;
+		cancel();
+	}
+
+	int start(String a_path, String a_proxy_path, int a_height = 540, int a_quality = 5);
+	void cancel();
+
+	inline bool is_running() { return running; }
+	inline int get_error() { return error; }
+	float get_progress();
+
+	inline String get_path() { return path.c_str(); }
+	inline String get_proxy_path() { return proxy_path.c_str(); }
+
+
+protected:
+	static inline void _bind_methods() {
+		ClassDB::bind_method(D_METHOD("start", "a_path", "a_proxy_path", "a_height", "a_quality"), &ProxyGenerator::start, DEFVAL(540), DEFVAL(5));
+		ClassDB::bind_method(D_METHOD("cancel"), &ProxyGenerator::cancel);
+
+		ClassDB::bind_method(D_METHOD("is_running"), &ProxyGenerator::is_running);
+		ClassDB::bind_method(D_METHOD("get_error"), &ProxyGenerator::get_error);
+		ClassDB::bind_method(D_METHOD("get_progress"), &ProxyGenerator::get_progress);
+
+		ClassDB::bind_method(D_METHOD("get_path"), &ProxyGenerator::get_path);
+		ClassDB::bind_method(D_METHOD("get_proxy_path"), &ProxyGenerator::get_proxy_path);
+
+		ADD_SIGNAL(MethodInfo("finished", PropertyInfo(Variant::INT, "error")));
+	}
+};
@@ -6,7 +6,12 @@ void initialize_gozen_library_init_module(ModuleInitializationLevel p_level) {
 		return;
 	
 	ClassDB::register_class<Video>();
+	ClassDB::register_class<VideoFrame>();
+	ClassDB::register_class<SegmentDecoder>();
+	ClassDB::register_class<ProxyGenerator>();
+	ClassDB::register_class<Renderer>();
 	ClassDB::register_class<Audio>();
+	ClassDB::register_class<Waveform>();
 	ClassDB::register_class<GoZenError>();
 	ClassDB::register_class<AudioStreamFFmpeg>();
 	ClassDB::register_class<AudioStreamFFmpegPlayback>();
@@ -7,8 +7,12 @@
 #include <godot_cpp/core/class_db.hpp>
 
 #include "video.hpp"
+#include "segment_decoder.hpp"
+#include "proxy_generator.hpp"
+#include "renderer.hpp"
 #include "audio.hpp"
 #include "audio_stream_ffmpeg.hpp"
+#include "waveform.hpp"
 #include "gozen_error.hpp"
 
 using namespace godot;
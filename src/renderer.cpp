@@ -0,0 +1,484 @@
+#include "renderer.hpp"
+
+
+int Renderer::open(String a_path) {
+	if (loaded)
+		return GoZenError::ERR_ALREADY_OPEN_VIDEO;
+
+	path = a_path.utf8();
+	int l_response = OK;
+
+	// FFmpeg writes the file itself, so res:// and user:// need to be resolved
+	std::string l_path = ProjectSettings::get_singleton()->globalize_path(a_path).utf8().get_data();
+
+	// Container gets picked from the file extension
+	if (avformat_alloc_output_context2(&av_format_ctx, NULL, NULL, l_path.c_str()) < 0 || !av_format_ctx)
+		return GoZenError::ERR_CREATING_AV_FORMAT_FAILED;
+
+	if ((l_response = _open_video_encoder()) || (audio_enabled && (l_response = _open_audio_encoder()))) {
+		close();
+		return l_response;
+	}
+
+	if (!(av_packet = av_packet_alloc())) {
+		close();
+		return GoZenError::ERR_FAILED_ALLOC_PACKET;
+	}
+
+	if (!(av_format_ctx->oformat->flags & AVFMT_NOFILE) && avio_open(&av_format_ctx->pb, l_path.c_str(), AVIO_FLAG_WRITE) < 0) {
+		close();
+		return GoZenError::ERR_OPENING_VIDEO;
+	}
+
+	if (avformat_write_header(av_format_ctx, NULL) < 0) {
+		close();
+		return GoZenError::ERR_WRITING_HEADER;
+	}
+
+	next_sequence = 0;
+	encode_sequence = 0;
+	finishing = false;
+	queue_depth = 0;
+	error = OK;
+	frames_encoded = 0;
+	audio_pts = 0;
+	start_time = std::chrono::steady_clock::now();
+
+	// Converting is the heavy part, encoders have their own threads
+	int l_worker_count = thread_count > 0 ? thread_count : std::max(OS::get_singleton()->get_processor_count() / 2, 1);
+	for (int i = 0; i < l_worker_count; i++)
+		workers.emplace_back(&Renderer::_convert_loop, this);
+	encode_thread = std::thread(&Renderer::_encode_loop, this);
+
+	loaded = true;
+	return OK;
+}
+
+int Renderer::_open_video_encoder() {
+	const AVCodec *l_codec = video_codec.empty()
+			? avcodec_find_encoder(av_format_ctx->oformat->video_codec)
+			: avcodec_find_encoder_by_name(video_codec.c_str());
+	if (!l_codec)
+		return GoZenError::ERR_FAILED_FINDING_VIDEO_ENCODER;
+
+	AVRational l_framerate = av_d2q(framerate, 100000);
+	if (l_framerate.num <= 0 || l_framerate.den <= 0)
+		return GoZenError::ERR_INVALID_FRAMERATE;
+
+	if (!(av_stream_video = avformat_new_stream(av_format_ctx, NULL)))
+		return GoZenError::ERR_FAILED_CREATING_STREAM;
+
+	if (!(av_codec_ctx_video = avcodec_alloc_context3(l_codec)))
+		return GoZenError::ERR_FAILED_ALLOC_VIDEO_CODEC;
+
+	// Most encoders want even sizes for their chroma planes
+	av_codec_ctx_video->width = resolution.x & ~1;
+	av_codec_ctx_video->height = resolution.y & ~1;
+	av_codec_ctx_video->time_base = av_inv_q(l_framerate);
+	av_codec_ctx_video->framerate = l_framerate;
+
+	av_codec_ctx_video->pix_fmt = AV_PIX_FMT_YUV420P;
+	if (l_codec->pix_fmts) {
+		av_codec_ctx_video->pix_fmt = l_codec->pix_fmts[0];
+		for (const AVPixelFormat *l_format = l_codec->pix_fmts; *l_format != AV_PIX_FMT_NONE; l_format++) {
+			if (*l_format == AV_PIX_FMT_YUV420P) {
+				av_codec_ctx_video->pix_fmt = AV_PIX_FMT_YUV420P;
+				break;
+			}
+		}
+	}
+
+	if (bit_rate > 0)
+		av_codec_ctx_video->bit_rate = bit_rate;
+	if (gop_size > 0)
+		av_codec_ctx_video->gop_size = gop_size;
+	if (av_format_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+		av_codec_ctx_video->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+	FFmpeg::enable_multithreading(av_codec_ctx_video, l_codec);
+
+	if (avcodec_open2(av_codec_ctx_video, l_codec, NULL) < 0)
+		return GoZenError::ERR_FAILED_OPEN_VIDEO_CODEC;
+
+	if (avcodec_parameters_from_context(av_stream_video->codecpar, av_codec_ctx_video) < 0)
+		return GoZenError::ERR_COPY_STREAM_PARAMS;
+
+	av_stream_video->time_base = av_codec_ctx_video->time_base;
+	av_stream_video->avg_frame_rate = l_framerate;
+	return OK;
+}
+
+int Renderer::_open_audio_encoder() {
+	// Containers without a default audio codec only get audio when asked for
+	if (audio_codec.empty() && av_format_ctx->oformat->audio_codec == AV_CODEC_ID_NONE)
+		return OK;
+
+	const AVCodec *l_codec = audio_codec.empty()
+			? avcodec_find_encoder(av_format_ctx->oformat->audio_codec)
+			: avcodec_find_encoder_by_name(audio_codec.c_str());
+	if (!l_codec)
+		return GoZenError::ERR_FAILED_FINDING_AUDIO_ENCODER;
+
+	if (!(av_stream_audio = avformat_new_stream(av_format_ctx, NULL)))
+		return GoZenError::ERR_FAILED_CREATING_STREAM;
+
+	if (!(av_codec_ctx_audio = avcodec_alloc_context3(l_codec)))
+		return GoZenError::ERR_FAILED_ALLOC_AUDIO_CODEC;
+
+	av_codec_ctx_audio->sample_fmt = l_codec->sample_fmts ? l_codec->sample_fmts[0] : AV_SAMPLE_FMT_S16;
+	av_codec_ctx_audio->sample_rate = sample_rate;
+	av_codec_ctx_audio->time_base = { 1, sample_rate };
+	av_channel_layout_default(&av_codec_ctx_audio->ch_layout, audio_channels);
+
+	if (audio_bit_rate > 0)
+		av_codec_ctx_audio->bit_rate = audio_bit_rate;
+	if (av_format_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+		av_codec_ctx_audio->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+	if (avcodec_open2(av_codec_ctx_audio, l_codec, NULL) < 0)
+		return GoZenError::ERR_FAILED_OPEN_AUDIO_CODEC;
+
+	if (avcodec_parameters_from_context(av_stream_audio->codecpar, av_codec_ctx_audio) < 0)
+		return GoZenError::ERR_COPY_STREAM_PARAMS;
+	av_stream_audio->time_base = av_codec_ctx_audio->time_base;
+
+	// Audio arrives as 16 bit interleaved samples, like Godot's AudioStreamWAV
+	if (swr_alloc_set_opts2(&swr_ctx,
+			&av_codec_ctx_audio->ch_layout, av_codec_ctx_audio->sample_fmt, sample_rate,
+			&av_codec_ctx_audio->ch_layout, AV_SAMPLE_FMT_S16, sample_rate,
+			0, nullptr) < 0 || swr_init(swr_ctx) < 0)
+		return GoZenError::ERR_CREATING_SWR;
+
+	// Encoders want fixed size frames, so samples wait in a fifo
+	if (!(audio_fifo = av_audio_fifo_alloc(av_codec_ctx_audio->sample_fmt, audio_channels, 1)))
+		return GoZenError::ERR_FAILED_ALLOC_FRAME;
+
+	audio_frame_size = av_codec_ctx_audio->frame_size > 0 ? av_codec_ctx_audio->frame_size : 1024;
+	if (!(av_frame_audio = av_frame_alloc()))
+		return GoZenError::ERR_FAILED_ALLOC_FRAME;
+
+	av_frame_audio->format = av_codec_ctx_audio->sample_fmt;
+	av_frame_audio->sample_rate = sample_rate;
+	av_frame_audio->nb_samples = audio_frame_size;
+	if (av_channel_layout_copy(&av_frame_audio->ch_layout, &av_codec_ctx_audio->ch_layout) < 0 ||
+			av_frame_get_buffer(av_frame_audio, 0) < 0)
+		return GoZenError::ERR_FAILED_ALLOC_FRAME;
+
+	return OK;
+}
+
+int Renderer::close() {
+	int l_error = error;
+
+	if (loaded) {
+		{
+			std::lock_guard<std::mutex> l_lock(mutex);
+			finishing = true;
+		}
+		job_added.notify_all();
+		job_converted.notify_all();
+
+		for (std::thread &l_worker : workers)
+			if (l_worker.joinable())
+				l_worker.join();
+		workers.clear();
+		if (encode_thread.joinable())
+			encode_thread.join();
+
+		// Everything which got submitted is encoded, only the encoders
+		// still hold some packets
+		if (!error) {
+			if (av_codec_ctx_audio && (l_error = _encode_audio(true)))
+				_fail(l_error);
+			else if (FFmpeg::encode_frame(av_codec_ctx_video, av_format_ctx, av_stream_video, nullptr, av_packet) < 0)
+				_fail(GoZenError::ERR_ENCODING);
+			else if (av_write_trailer(av_format_ctx) < 0)
+				_fail(GoZenError::ERR_ENCODING);
+		}
+
+		l_error = error;
+		loaded = false;
+	}
+
+	for (Job *l_job : pending_jobs)
+		_free_job(l_job);
+	pending_jobs.clear();
+	for (auto &l_entry : converted_jobs)
+		_free_job(l_entry.second);
+	converted_jobs.clear();
+
+	if (av_codec_ctx_video) avcodec_free_context(&av_codec_ctx_video);
+	if (av_codec_ctx_audio) avcodec_free_context(&av_codec_ctx_audio);
+	if (av_frame_audio) av_frame_free(&av_frame_audio);
+	if (av_packet) av_packet_free(&av_packet);
+	if (audio_fifo) av_audio_fifo_free(audio_fifo);
+	if (swr_ctx) swr_free(&swr_ctx);
+
+	if (av_format_ctx) {
+		if (!(av_format_ctx->oformat->flags & AVFMT_NOFILE))
+			avio_closep(&av_format_ctx->pb);
+		avformat_free_context(av_format_ctx);
+	}
+
+	av_format_ctx = nullptr;
+	av_stream_video = nullptr;
+	av_stream_audio = nullptr;
+	audio_fifo = nullptr;
+	queue_depth = 0;
+
+	return l_error;
+}
+
+int Renderer::send_frame(Ref<Image> a_image) {
+	if (a_image.is_null() || a_image->is_empty())
+		return GoZenError::ERR_INVALID_VIDEO;
+
+	Job *l_job = new Job();
+	l_job->image = a_image;
+	return _submit(l_job);
+}
+
+int Renderer::send_frame_planes(PackedByteArray a_y, PackedByteArray a_u, PackedByteArray a_v) {
+	if (!loaded)
+		return GoZenError::ERR_NOT_OPEN_VIDEO;
+
+	// Planes are yuv420p at the resolution of the encoder
+	int64_t l_y_size = av_codec_ctx_video->width * av_codec_ctx_video->height;
+	if (a_y.size() < l_y_size || a_u.size() < l_y_size / 4 || a_v.size() < l_y_size / 4)
+		return GoZenError::ERR_INVALID_VIDEO;
+
+	Job *l_job = new Job();
+	l_job->y_data = a_y;
+	l_job->u_data = a_u;
+	l_job->v_data = a_v;
+	return _submit(l_job);
+}
+
+int Renderer::send_audio(PackedByteArray a_data) {
+	if (!loaded)
+		return GoZenError::ERR_NOT_OPEN_VIDEO;
+	else if (!av_codec_ctx_audio)
+		return GoZenError::ERR_OPENING_AUDIO;
+	else if (a_data.is_empty())
+		return OK;
+
+	Job *l_job = new Job();
+	l_job->audio_data = a_data;
+	return _submit(l_job);
+}
+
+int Renderer::_submit(Job *a_job) {
+	int l_error = OK;
+
+	if (!loaded)
+		l_error = GoZenError::ERR_NOT_OPEN_VIDEO;
+	else if (error)
+		l_error = error;
+	else if (queue_depth >= max_queue_size)
+		l_error = GoZenError::ERR_QUEUE_FULL;
+
+	if (l_error) {
+		_free_job(a_job);
+		return l_error;
+	}
+
+	{
+		std::lock_guard<std::mutex> l_lock(mutex);
+		a_job->sequence = next_sequence++;
+		pending_jobs.push_back(a_job);
+		queue_depth++;
+	}
+	job_added.notify_one();
+
+	return OK;
+}
+
+double Renderer::get_encoded_fps() {
+	double l_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+	return l_seconds > 0 ? frames_encoded / l_seconds : 0;
+}
+
+void Renderer::_convert_loop() {
+	SwsContext *l_sws_ctx = nullptr;
+
+	while (true) {
+		Job *l_job = nullptr;
+		{
+			std::unique_lock<std::mutex> l_lock(mutex);
+			job_added.wait(l_lock, [&] { return finishing || !pending_jobs.empty(); });
+			if (pending_jobs.empty())
+				break; // Finishing and nothing left to do
+			l_job = pending_jobs.front();
+			pending_jobs.pop_front();
+		}
+
+		// Failed jobs still get passed on, the encode thread needs every
+		// sequence number to move on
+		int l_error = _convert_job(l_job, l_sws_ctx);
+		if (l_error)
+			_fail(l_error);
+
+		{
+			std::lock_guard<std::mutex> l_lock(mutex);
+			converted_jobs[l_job->sequence] = l_job;
+		}
+		job_converted.notify_all();
+	}
+
+	sws_freeContext(l_sws_ctx);
+}
+
+int Renderer::_convert_job(Job *a_job, SwsContext *&a_sws_ctx) {
+	if (!a_job->audio_data.is_empty())
+		return OK; // Audio gets converted by the encode thread
+
+	const uint8_t *l_src_data[4] = {};
+	int l_src_linesize[4] = {};
+	Vector2i l_size = Vector2i(av_codec_ctx_video->width, av_codec_ctx_video->height);
+	AVPixelFormat l_src_format = AV_PIX_FMT_YUV420P;
+	PackedByteArray l_data; // Keeps the image data alive while converting
+
+	if (a_job->image.is_valid()) {
+		Ref<Image> l_image = a_job->image;
+		if (l_image->get_format() != Image::FORMAT_RGBA8 && l_image->get_format() != Image::FORMAT_RGB8) {
+			l_image = l_image->duplicate();
+			l_image->convert(Image::FORMAT_RGBA8);
+		}
+
+		bool l_rgb = l_image->get_format() == Image::FORMAT_RGB8;
+		l_data = l_image->get_data();
+		l_size = l_image->get_size();
+		l_src_format = l_rgb ? AV_PIX_FMT_RGB24 : AV_PIX_FMT_RGBA;
+		l_src_data[0] = l_data.ptr();
+		l_src_linesize[0] = l_size.x * (l_rgb ? 3 : 4);
+	} else {
+		l_src_data[0] = a_job->y_data.ptr();
+		l_src_data[1] = a_job->u_data.ptr();
+		l_src_data[2] = a_job->v_data.ptr();
+		l_src_linesize[0] = l_size.x;
+		l_src_linesize[1] = l_src_linesize[2] = AV_CEIL_RSHIFT(l_size.x, 1);
+	}
+
+	// A new frame for each job, the encoder may still reference older ones
+	if (!(a_job->frame = av_frame_alloc()))
+		return GoZenError::ERR_FAILED_ALLOC_FRAME;
+
+	a_job->frame->format = av_codec_ctx_video->pix_fmt;
+	a_job->frame->width = av_codec_ctx_video->width;
+	a_job->frame->height = av_codec_ctx_video->height;
+	if (av_frame_get_buffer(a_job->frame, 0) < 0)
+		return GoZenError::ERR_FAILED_ALLOC_FRAME;
+
+	a_sws_ctx = sws_getCachedContext(a_sws_ctx,
+			l_size.x, l_size.y, l_src_format,
+			a_job->frame->width, a_job->frame->height, av_codec_ctx_video->pix_fmt,
+			SWS_BILINEAR, NULL, NULL, NULL);
+	if (!a_sws_ctx)
+		return GoZenError::ERR_CREATING_SWS;
+
+	if (sws_scale(a_sws_ctx, l_src_data, l_src_linesize, 0, l_size.y, a_job->frame->data, a_job->frame->linesize) < 0)
+		return GoZenError::ERR_SCALING_FAILED;
+
+	// Source data isn't needed anymore, no need to keep it around in the queue
+	a_job->image.unref();
+	a_job->y_data.clear();
+	a_job->u_data.clear();
+	a_job->v_data.clear();
+
+	return OK;
+}
+
+void Renderer::_encode_loop() {
+	while (true) {
+		Job *l_job = nullptr;
+		{
+			std::unique_lock<std::mutex> l_lock(mutex);
+			job_converted.wait(l_lock, [&] {
+				return converted_jobs.count(encode_sequence) || (finishing && encode_sequence == next_sequence);
+			});
+
+			auto l_it = converted_jobs.find(encode_sequence);
+			if (l_it == converted_jobs.end())
+				break; // Finishing and everything is encoded
+
+			l_job = l_it->second;
+			converted_jobs.erase(l_it);
+			encode_sequence++;
+		}
+
+		// After an error jobs only get emptied out of the queue
+		if (!error) {
+			int l_error = _encode_job(l_job);
+			if (l_error)
+				_fail(l_error);
+		}
+
+		_free_job(l_job);
+		queue_depth--;
+	}
+}
+
+int Renderer::_encode_job(Job *a_job) {
+	if (a_job->frame) {
+		a_job->frame->pts = frames_encoded;
+		if (FFmpeg::encode_frame(av_codec_ctx_video, av_format_ctx, av_stream_video, a_job->frame, av_packet) < 0)
+			return GoZenError::ERR_ENCODING;
+
+		frames_encoded++;
+		return OK;
+	} else if (a_job->audio_data.is_empty())
+		return OK;
+
+	const uint8_t *l_data = a_job->audio_data.ptr();
+	int l_samples = a_job->audio_data.size() / (2 * audio_channels);
+	int l_out_samples = swr_get_out_samples(swr_ctx, l_samples);
+	uint8_t **l_buffer = nullptr;
+	int l_error = OK;
+
+	if (av_samples_alloc_array_and_samples(&l_buffer, NULL, audio_channels, l_out_samples, av_codec_ctx_audio->sample_fmt, 0) < 0)
+		return GoZenError::ERR_FAILED_ALLOC_FRAME;
+
+	if ((l_out_samples = swr_convert(swr_ctx, l_buffer, l_out_samples, &l_data, l_samples)) < 0)
+		l_error = GoZenError::ERR_ENCODING;
+	else if (av_audio_fifo_write(audio_fifo, reinterpret_cast<void **>(l_buffer), l_out_samples) < l_out_samples)
+		l_error = GoZenError::ERR_ENCODING;
+
+	av_freep(&l_buffer[0]);
+	av_freep(&l_buffer);
+
+	return l_error ? l_error : _encode_audio(false);
+}
+
+int Renderer::_encode_audio(bool a_flush) {
+	// Flushing also sends the last samples which don't fill a full frame
+	while (av_audio_fifo_size(audio_fifo) >= audio_frame_size || (a_flush && av_audio_fifo_size(audio_fifo) > 0)) {
+		av_frame_audio->nb_samples = audio_frame_size;
+		if (av_frame_make_writable(av_frame_audio) < 0)
+			return GoZenError::ERR_FRAME_NOT_WRITABLE;
+
+		av_frame_audio->nb_samples = av_audio_fifo_read(audio_fifo, reinterpret_cast<void **>(av_frame_audio->data), audio_frame_size);
+		av_frame_audio->pts = audio_pts;
+		audio_pts += av_frame_audio->nb_samples;
+
+		if (FFmpeg::encode_frame(av_codec_ctx_audio, av_format_ctx, av_stream_audio, av_frame_audio, av_packet) < 0)
+			return GoZenError::ERR_ENCODING;
+	}
+
+	if (a_flush && FFmpeg::encode_frame(av_codec_ctx_audio, av_format_ctx, av_stream_audio, nullptr, av_packet) < 0)
+		return GoZenError::ERR_ENCODING;
+	return OK;
+}
+
+void Renderer::_free_job(Job *a_job) {
+	if (a_job->frame)
+		av_frame_free(&a_job->frame);
+	delete a_job;
+}
+
+int Renderer::_fail(int a_error) {
+	// Only the first error gets kept, later ones are mostly caused by it
+	int l_expected = OK;
+	if (error.compare_exchange_strong(l_expected, a_error))
+		GoZenError::print_error(static_cast<GoZenError::ERROR>(a_error));
+	return a_error;
+}
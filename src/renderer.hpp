@@ -0,0 +1,205 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <godot_cpp/classes/image.hpp>
+#include <godot_cpp/classes/project_settings.hpp>
+#include <godot_cpp/classes/resource.hpp>
+#include <godot_cpp/variant/utility_functions.hpp>
+
+#include "ffmpeg.hpp"
+#include "gozen_error.hpp"
+
+extern "C" {
+	#include <libavutil/audio_fifo.h>
+}
+
+
+using namespace godot;
+
+
+// Writes video (and audio) files. Submitted frames go into a bounded queue,
+// worker threads convert them to the pixel format of the encoder and a single
+// encode thread encodes and muxes everything in the order it got submitted.
+// Sending never blocks, a full queue returns ERR_QUEUE_FULL instead.
+class Renderer : public Resource {
+	GDCLASS(Renderer, Resource);
+
+private:
+	struct Job {
+		int64_t sequence = 0;
+		Ref<Image> image; // Video from an image
+		PackedByteArray y_data, u_data, v_data; // Video from yuv420p planes
+		PackedByteArray audio_data; // Interleaved 16 bit samples
+		AVFrame *frame = nullptr; // Result of the conversion
+	};
+
+	AVFormatContext *av_format_ctx = nullptr;
+	AVCodecContext *av_codec_ctx_video = nullptr;
+	AVCodecContext *av_codec_ctx_audio = nullptr;
+	AVStream *av_stream_video = nullptr;
+	AVStream *av_stream_audio = nullptr;
+	AVPacket *av_packet = nullptr;
+	AVFrame *av_frame_audio = nullptr;
+	AVAudioFifo *audio_fifo = nullptr;
+	SwrContext *swr_ctx = nullptr;
+
+	// Pipeline
+	std::vector<std::thread> workers;
+	std::thread encode_thread;
+	std::mutex mutex;
+	std::condition_variable job_added;
+	std::condition_variable job_converted;
+
+	std::deque<Job*> pending_jobs;
+	std::map<int64_t, Job*> converted_jobs;
+	int64_t next_sequence = 0; // Given to the next submitted job
+	int64_t encode_sequence = 0; // Job the encode thread needs next
+	bool finishing = false;
+
+	std::atomic<int> queue_depth = 0;
+	std::atomic<int> error = OK;
+	std::atomic<int64_t> frames_encoded = 0;
+	std::chrono::steady_clock::time_point start_time;
+
+	int64_t audio_pts = 0;
+	int audio_frame_size = 1024;
+
+	// Settings
+	std::string path = "";
+	std::string video_codec = ""; // Empty = default of the container
+	std::string audio_codec = "";
+
+	Vector2i resolution = Vector2i(1920, 1080);
+	float framerate = 30.;
+	int64_t bit_rate = 0; // 0 = encoder default
+	int gop_size = 0; // 0 = encoder default
+
+	bool audio_enabled = true;
+	int sample_rate = 44100;
+	int audio_channels = 2;
+	int64_t audio_bit_rate = 0;
+
+	int thread_count = 0; // Conversion workers, 0 = half of the cores
+	int max_queue_size = 16;
+	bool loaded = false;
+
+
+	int _open_video_encoder();
+	int _open_audio_encoder();
+	int _submit(Job *a_job);
+
+	void _convert_loop();
+	int _convert_job(Job *a_job, SwsContext *&a_sws_ctx);
+	void _encode_loop();
+	int _encode_job(Job *a_job);
+	int _encode_audio(bool a_flush);
+	void _free_job(Job *a_job);
+
+	int _fail(int a_error);
+
+
+public:
+	Renderer() {}
+	~Renderer() { close(); }
+
+	int open(String a_path);
+	int close();
+
+	int send_frame(Ref<Image> a_image);
+	int send_frame_planes(PackedByteArray a_y, PackedByteArray a_u, PackedByteArray a_v);
+	int send_audio(PackedByteArray a_data);
+
+	inline bool is_open() { return loaded; }
+	inline bool is_queue_full() { return queue_depth >= max_queue_size; }
+	inline int get_queue_depth() { return queue_depth; }
+	inline int get_error() { return error; }
+	inline int64_t get_frames_encoded() { return frames_encoded; }
+	double get_encoded_fps();
+
+	inline String get_path() { return path.c_str(); }
+
+	inline void set_video_codec(String a_value) { video_codec = a_value.utf8(); }
+	inline String get_video_codec() { return video_codec.c_str(); }
+	inline void set_audio_codec(String a_value) { audio_codec = a_value.utf8(); }
+	inline String get_audio_codec() { return audio_codec.c_str(); }
+
+	inline void set_resolution(Vector2i a_value) { resolution = a_value; }
+	inline Vector2i get_resolution() { return resolution; }
+	inline void set_framerate(float a_value) { framerate = a_value; }
+	inline float get_framerate() { return framerate; }
+	inline void set_bit_rate(int64_t a_value) { bit_rate = a_value; }
+	inline int64_t get_bit_rate() { return bit_rate; }
+	inline void set_gop_size(int a_value) { gop_size = a_value; }
+	inline int get_gop_size() { return gop_size; }
+
+	inline void set_audio_enabled(bool a_value) { audio_enabled = a_value; }
+	inline bool get_audio_enabled() { return audio_enabled; }
+	inline void set_sample_rate(int a_value) { sample_rate = a_value; }
+	inline int get_sample_rate() { return sample_rate; }
+	inline void set_audio_channels(int a_value) { audio_channels = a_value; }
+	inline int get_audio_channels() { return audio_channels; }
+	inline void set_audio_bit_rate(int64_t a_value) { audio_bit_rate = a_value; }
+	inline int64_t get_audio_bit_rate() { return audio_bit_rate; }
+
+	inline void set_thread_count(int a_value) { thread_count = a_value; }
+	inline int get_thread_count() { return thread_count; }
+	inline void set_max_queue_size(int a_value) { max_queue_size = std::max(a_value, 1); }
+	inline int get_max_queue_size() { return max_queue_size; }
+
+
+protected:
+	static inline void _bind_methods() {
+		ClassDB::bind_method(D_METHOD("open", "a_path"), &Renderer::open);
+		ClassDB::bind_method(D_METHOD("close"), &Renderer::close);
+
+		ClassDB::bind_method(D_METHOD("send_frame", "a_image"), &Renderer::send_frame);
+		ClassDB::bind_method(D_METHOD("send_frame_planes", "a_y", "a_u", "a_v"), &Renderer::send_frame_planes);
+		ClassDB::bind_method(D_METHOD("send_audio", "a_data"), &Renderer::send_audio);
+
+		ClassDB::bind_method(D_METHOD("is_open"), &Renderer::is_open);
+		ClassDB::bind_method(D_METHOD("is_queue_full"), &Renderer::is_queue_full);
+		ClassDB::bind_method(D_METHOD("get_queue_depth"), &Renderer::get_queue_depth);
+		ClassDB::bind_method(D_METHOD("get_error"), &Renderer::get_error);
+		ClassDB::bind_method(D_METHOD("get_frames_encoded"), &Renderer::get_frames_encoded);
+		ClassDB::bind_method(D_METHOD("get_encoded_fps"), &Renderer::get_encoded_fps);
+
+		ClassDB::bind_method(D_METHOD("get_path"), &Renderer::get_path);
+
+		ClassDB::bind_method(D_METHOD("set_video_codec", "a_value"), &Renderer::set_video_codec);
+		ClassDB::bind_method(D_METHOD("get_video_codec"), &Renderer::get_video_codec);
+		ClassDB::bind_method(D_METHOD("set_audio_codec", "a_value"), &Renderer::set_audio_codec);
+		ClassDB::bind_method(D_METHOD("get_audio_codec"), &Renderer::get_audio_codec);
+
+		ClassDB::bind_method(D_METHOD("set_resolution", "a_value"), &Renderer::set_resolution);
+		ClassDB::bind_method(D_METHOD("get_resolution"), &Renderer::get_resolution);
+		ClassDB::bind_method(D_METHOD("set_framerate", "a_value"), &Renderer::set_framerate);
+		ClassDB::bind_method(D_METHOD("get_framerate"), &Renderer::get_framerate);
+		ClassDB::bind_method(D_METHOD("set_bit_rate", "a_value"), &Renderer::set_bit_rate);
+		ClassDB::bind_method(D_METHOD("get_bit_rate"), &Renderer::get_bit_rate);
+		ClassDB::bind_method(D_METHOD("set_gop_size", "a_value"), &Renderer::set_gop_size);
+		ClassDB::bind_method(D_METHOD("get_gop_size"), &Renderer::get_gop_size);
+
+		ClassDB::bind_method(D_METHOD("set_audio_enabled", "a_value"), &Renderer::set_audio_enabled);
+		ClassDB::bind_method(D_METHOD("get_audio_enabled"), &Renderer::get_audio_enabled);
+		ClassDB::bind_method(D_METHOD("set_sample_rate", "a_value"), &Renderer::set_sample_rate);
+		ClassDB::bind_method(D_METHOD("get_sample_rate"), &Renderer::get_sample_rate);
+		ClassDB::bind_method(D_METHOD("set_audio_channels", "a_value"), &Renderer::set_audio_channels);
+		ClassDB::bind_method(D_METHOD("get_audio_channels"), &Renderer::get_audio_channels);
+		ClassDB::bind_method(D_METHOD("set_audio_bit_rate", "a_value"), &Renderer::set_audio_bit_rate);
+		ClassDB::bind_method(D_METHOD("get_audio_bit_rate"), &Renderer::get_audio_bit_rate);
+
+		ClassDB::bind_method(D_METHOD("set_thread_count", "a_value"), &Renderer::set_thread_count);
+		ClassDB::bind_method(D_METHOD("get_thread_count"), &Renderer::get_thread_count);
+		ClassDB::bind_method(D_METHOD("set_max_queue_size", "a_value"), &Renderer::set_max_queue_size);
+		ClassDB::bind_method(D_METHOD("get_max_queue_size"), &Renderer::get_max_queue_size);
+	}
+};
@@ -0,0 +1,262 @@
+#include "sample_converter.hpp"
+
+#include <algorithm>
+
+#include "simd.hpp"
+
+
+static constexpr float S16_SCALE = 1.0f / 32768.0f;
+
+
+SampleConverter::Path SampleConverter::_get_path(Path a_path) {
+	Path l_best = ColorConverter::get_best_path();
+
+	if (a_path == ColorConverter::PATH_AUTO)
+		return l_best;
+	else if (a_path == l_best || (a_path == ColorConverter::PATH_SSE2 && l_best == ColorConverter::PATH_AVX2))
+		return a_path;
+	return ColorConverter::PATH_SCALAR;
+}
+
+void SampleConverter::s16_to_float(const int16_t *a_src, float *a_dst, int a_count, Path a_path) {
+	int i = 0;
+
+	switch (_get_path(a_path)) {
+		case ColorConverter::PATH_SSE2: i = _s16_sse2(a_src, a_dst, a_count); break;
+		case ColorConverter::PATH_AVX2: i = _s16_avx2(a_src, a_dst, a_count); break;
+		case ColorConverter::PATH_NEON: i = _s16_neon(a_src, a_dst, a_count); break;
+		default: break;
+	}
+
+	// Samples which don't fill a full vector are left for the scalar code
+	for (; i < a_count; i++)
+		a_dst[i] = a_src[i] * S16_SCALE;
+}
+
+void SampleConverter::interleave_stereo(const float *a_left, const float *a_right, float *a_dst, int a_frames, Path a_path) {
+	int i = 0;
+
+	switch (_get_path(a_path)) {
+		case ColorConverter::PATH_SSE2: i = _interleave_sse2(a_left, a_right, a_dst, a_frames); break;
+		case ColorConverter::PATH_AVX2: i = _interleave_avx2(a_left, a_right, a_dst, a_frames); break;
+		case ColorConverter::PATH_NEON: i = _interleave_neon(a_left, a_right, a_dst, a_frames); break;
+		default: break;
+	}
+
+	for (; i < a_frames; i++) {
+		a_dst[i * 2] = a_left[i];
+		a_dst[i * 2 + 1] = a_right[i];
+	}
+}
+
+void SampleConverter::reduce_peaks(const float *a_src, int a_count, float &r_min, float &r_max, double &r_squares, Path a_path) {
+	float l_min = r_min, l_max = r_max, l_squares = 0;
+	int i = 0;
+
+	switch (_get_path(a_path)) {
+		case ColorConverter::PATH_SSE2: i = _peaks_sse2(a_src, a_count, l_min, l_max, l_squares); break;
+		case ColorConverter::PATH_AVX2: i = _peaks_avx2(a_src, a_count, l_min, l_max, l_squares); break;
+		case ColorConverter::PATH_NEON: i = _peaks_neon(a_src, a_count, l_min, l_max, l_squares); break;
+		default: break;
+	}
+
+	for (; i < a_count; i++) {
+		l_min = std::min(l_min, a_src[i]);
+		l_max = std::max(l_max, a_src[i]);
+		l_squares += a_src[i] * a_src[i];
+	}
+
+	r_min = l_min;
+	r_max = l_max;
+	r_squares += l_squares;
+}
+
+
+#if defined(GOZEN_X86)
+int SampleConverter::_s16_sse2(const int16_t *a_src, float *a_dst, int a_count) {
+	const __m128 l_scale = _mm_set1_ps(S16_SCALE);
+	int i = 0;
+
+	for (; i + 8 <= a_count; i += 8) {
+		__m128i l_samples = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a_src + i));
+
+		// Putting the samples in the upper half and shifting back sign extends
+		__m128i l_lo = _mm_srai_epi32(_mm_unpacklo_epi16(l_samples, l_samples), 16);
+		__m128i l_hi = _mm_srai_epi32(_mm_unpackhi_epi16(l_samples, l_samples), 16);
+
+		_mm_storeu_ps(a_dst + i, _mm_mul_ps(_mm_cvtepi32_ps(l_lo), l_scale));
+		_mm_storeu_ps(a_dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(l_hi), l_scale));
+	}
+
+	return i;
+}
+
+GOZEN_TARGET_AVX2 int SampleConverter::_s16_avx2(const int16_t *a_src, float *a_dst, int a_count) {
+	const __m256 l_scale = _mm256_set1_ps(S16_SCALE);
+	int i = 0;
+
+	for (; i + 16 <= a_count; i += 16) {
+		__m256i l_lo = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a_src + i)));
+		__m256i l_hi = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a_src + i + 8)));
+
+		_mm256_storeu_ps(a_dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(l_lo), l_scale));
+		_mm256_storeu_ps(a_dst + i + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(l_hi), l_scale));
+	}
+
+	return i;
+}
+
+int SampleConverter::_interleave_sse2(const float *a_left, const float *a_right, float *a_dst, int a_frames) {
+	int i = 0;
+
+	for (; i + 4 <= a_frames; i += 4) {
+		__m128 l_left = _mm_loadu_ps(a_left + i);
+		__m128 l_right = _mm_loadu_ps(a_right + i);
+
+		_mm_storeu_ps(a_dst + i * 2, _mm_unpacklo_ps(l_left, l_right));
+		_mm_storeu_ps(a_dst + i * 2 + 4, _mm_unpackhi_ps(l_left, l_right));
+	}
+
+	return i;
+}
+
+GOZEN_TARGET_AVX2 int SampleConverter::_interleave_avx2(const float *a_left, const float *a_right, float *a_dst, int a_frames) {
+	int i = 0;
+
+	for (; i + 8 <= a_frames; i += 8) {
+		__m256 l_left = _mm256_loadu_ps(a_left + i);
+		__m256 l_right = _mm256_loadu_ps(a_right + i);
+
+		// Unpacking works per 128 bit lane, giving frames 0-1, 4-5 | 2-3, 6-7
+		__m256 l_lo = _mm256_unpacklo_ps(l_left, l_right);
+		__m256 l_hi = _mm256_unpackhi_ps(l_left, l_right);
+
+		_mm256_storeu_ps(a_dst + i * 2, _mm256_permute2f128_ps(l_lo, l_hi, 0x20));
+		_mm256_storeu_ps(a_dst + i * 2 + 8, _mm256_permute2f128_ps(l_lo, l_hi, 0x31));
+	}
+
+	return i;
+}
+
+// Vectors get reduced to single values at the end, only the parts which
+// fill full vectors are done here
+int SampleConverter::_peaks_sse2(const float *a_src, int a_count, float &r_min, float &r_max, float &r_squares) {
+	if (a_count < 4)
+		return 0;
+
+	__m128 l_min = _mm_set1_ps(r_min);
+	__m128 l_max = _mm_set1_ps(r_max);
+	__m128 l_squares = _mm_setzero_ps();
+	int i = 0;
+
+	for (; i + 4 <= a_count; i += 4) {
+		__m128 l_samples = _mm_loadu_ps(a_src + i);
+		l_min = _mm_min_ps(l_min, l_samples);
+		l_max = _mm_max_ps(l_max, l_samples);
+		l_squares = _mm_add_ps(l_squares, _mm_mul_ps(l_samples, l_samples));
+	}
+
+	alignas(16) float l_values[3][4];
+	_mm_store_ps(l_values[0], l_min);
+	_mm_store_ps(l_values[1], l_max);
+	_mm_store_ps(l_values[2], l_squares);
+	for (int j = 0; j < 4; j++) {
+		r_min = std::min(r_min, l_values[0][j]);
+		r_max = std::max(r_max, l_values[1][j]);
+		r_squares += l_values[2][j];
+	}
+
+	return i;
+}
+
+GOZEN_TARGET_AVX2 int SampleConverter::_peaks_avx2(const float *a_src, int a_count, float &r_min, float &r_max, float &r_squares) {
+	if (a_count < 8)
+		return 0;
+
+	__m256 l_min = _mm256_set1_ps(r_min);
+	__m256 l_max = _mm256_set1_ps(r_max);
+	__m256 l_squares = _mm256_setzero_ps();
+	int i = 0;
+
+	for (; i + 8 <= a_count; i += 8) {
+		__m256 l_samples = _mm256_loadu_ps(a_src + i);
+		l_min = _mm256_min_ps(l_min, l_samples);
+		l_max = _mm256_max_ps(l_max, l_samples);
+		l_squares = _mm256_add_ps(l_squares, _mm256_mul_ps(l_samples, l_samples));
+	}
+
+	alignas(32) float l_values[3][8];
+	_mm256_store_ps(l_values[0], l_min);
+	_mm256_store_ps(l_values[1], l_max);
+	_mm256_store_ps(l_values[2], l_squares);
+	for (int j = 0; j < 8; j++) {
+		r_min = std::min(r_min, l_values[0][j]);
+		r_max = std::max(r_max, l_values[1][j]);
+		r_squares += l_values[2][j];
+	}
+
+	return i;
+}
+#else
+int SampleConverter::_s16_sse2(const int16_t *, float *, int) { return 0; }
+int SampleConverter::_s16_avx2(const int16_t *, float *, int) { return 0; }
+int SampleConverter::_interleave_sse2(const float *, const float *, float *, int) { return 0; }
+int SampleConverter::_interleave_avx2(const float *, const float *, float *, int) { return 0; }
+int SampleConverter::_peaks_sse2(const float *, int, float &, float &, float &) { return 0; }
+int SampleConverter::_peaks_avx2(const float *, int, float &, float &, float &) { return 0; }
+#endif
+
+
+#if defined(GOZEN_NEON)
+int SampleConverter::_s16_neon(const int16_t *a_src, float *a_dst, int a_count) {
+	int i = 0;
+
+	for (; i + 8 <= a_count; i += 8) {
+		int16x8_t l_samples = vld1q_s16(a_src + i);
+
+		vst1q_f32(a_dst + i, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(l_samples))), S16_SCALE));
+		vst1q_f32(a_dst + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(l_samples))), S16_SCALE));
+	}
+
+	return i;
+}
+
+int SampleConverter::_interleave_neon(const float *a_left, const float *a_right, float *a_dst, int a_frames) {
+	int i = 0;
+
+	for (; i + 4 <= a_frames; i += 4) {
+		float32x4x2_t l_frames;
+		l_frames.val[0] = vld1q_f32(a_left + i);
+		l_frames.val[1] = vld1q_f32(a_right + i);
+		vst2q_f32(a_dst + i * 2, l_frames);
+	}
+
+	return i;
+}
+
+int SampleConverter::_peaks_neon(const float *a_src, int a_count, float &r_min, float &r_max, float &r_squares) {
+	if (a_count < 4)
+		return 0;
+
+	float32x4_t l_min = vdupq_n_f32(r_min);
+	float32x4_t l_max = vdupq_n_f32(r_max);
+	float32x4_t l_squares = vdupq_n_f32(0);
+	int i = 0;
+
+	for (; i + 4 <= a_count; i += 4) {
+		float32x4_t l_samples = vld1q_f32(a_src + i);
+		l_min = vminq_f32(l_min, l_samples);
+		l_max = vmaxq_f32(l_max, l_samples);
+		l_squares = vmlaq_f32(l_squares, l_samples, l_samples);
+	}
+
+	r_min = vminvq_f32(l_min);
+	r_max = vmaxvq_f32(l_max);
+	r_squares += vaddvq_f32(l_squares);
+	return i;
+}
+#else
+int SampleConverter::_s16_neon(const int16_t *, float *, int) { return 0; }
+int SampleConverter::_interleave_neon(const float *, const float *, float *, int) { return 0; }
+int SampleConverter::_peaks_neon(const float *, int, float &, float &, float &) { return 0; }
+#endif
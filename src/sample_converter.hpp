@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+
+#include "color_converter.hpp"
+
+
+// Turns decoded audio into the interleaved float stereo frames which Godot
+// mixes with. Only the layouts decoders give out most get a kernel here, all
+// others go through swresample. Paths and CPU detection are the same as for
+// ColorConverter.
+class SampleConverter {
+public:
+	using Path = ColorConverter::Path;
+
+
+private:
+	static int _s16_sse2(const int16_t *a_src, float *a_dst, int a_count);
+	static int _s16_avx2(const int16_t *a_src, float *a_dst, int a_count);
+	static int _s16_neon(const int16_t *a_src, float *a_dst, int a_count);
+
+	static int _interleave_sse2(const float *a_left, const float *a_right, float *a_dst, int a_frames);
+	static int _interleave_avx2(const float *a_left, const float *a_right, float *a_dst, int a_frames);
+	static int _interleave_neon(const float *a_left, const float *a_right, float *a_dst, int a_frames);
+
+	static int _peaks_sse2(const float *a_src, int a_count, float &r_min, float &r_max, float &r_squares);
+	static int _peaks_avx2(const float *a_src, int a_count, float &r_min, float &r_max, float &r_squares);
+	static int _peaks_neon(const float *a_src, int a_count, float &r_min, float &r_max, float &r_squares);
+
+	static Path _get_path(Path a_path);
+
+
+public:
+	// Signed 16 bit samples to floats between -1 and 1, a_count is the
+	// amount of samples and not frames
+	static void s16_to_float(const int16_t *a_src, float *a_dst, int a_count, Path a_path = ColorConverter::PATH_AUTO);
+
+	// Two planar channels to interleaved stereo, giving the same pointer for
+	// both channels upmixes mono
+	static void interleave_stereo(const float *a_left, const float *a_right, float *a_dst, int a_frames, Path a_path = ColorConverter::PATH_AUTO);
+
+	// Lowest and highest sample and the sum of all squared samples, adding to
+	// the values which are given in so a block can be reduced in parts
+	static void reduce_peaks(const float *a_src, int a_count, float &r_min, float &r_max, double &r_squares, Path a_path = ColorConverter::PATH_AUTO);
+};
@@ -0,0 +1,290 @@
+#include "segment_decoder.hpp"
+
+
+int SegmentDecoder::open(String a_path) {
+	if (loaded)
+		return GoZenError::ERR_ALREADY_OPEN_VIDEO;
+
+	path = a_path.utf8();
+
+	AVFormatContext *l_format_ctx = avformat_alloc_context();
+	if (!l_format_ctx)
+		return GoZenError::ERR_CREATING_AV_FORMAT_FAILED;
+
+	if (AvioFile::open_input(&l_format_ctx, path.c_str(), NULL))
+		return GoZenError::ERR_OPENING_VIDEO;
+
+	if (avformat_find_stream_info(l_format_ctx, NULL)) {
+		AvioFile::close_input(&l_format_ctx);
+		return GoZenError::ERR_NO_STREAM_INFO_FOUND;
+	}
+
+	if ((stream_index = av_find_best_stream(l_format_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0)) < 0) {
+		AvioFile::close_input(&l_format_ctx);
+		return GoZenError::ERR_INVALID_VIDEO;
+	}
+
+	AVStream *l_stream = l_format_ctx->streams[stream_index];
+	time_base = l_stream->time_base;
+	frame_rate = av_guess_frame_rate(l_format_ctx, l_stream, NULL);
+	start_time = l_stream->start_time != AV_NOPTS_VALUE ? l_stream->start_time : 0;
+
+	// Workers only demux, so the parameters found here get shared with them
+	if (!(codec_params = avcodec_parameters_alloc()) || avcodec_parameters_copy(codec_params, l_stream->codecpar) < 0) {
+		AvioFile::close_input(&l_format_ctx);
+		close();
+		return GoZenError::ERR_FAILED_INIT_VIDEO_CODEC;
+	}
+
+	// Keyframe positions are needed to know where segments can start
+	int l_response = packet_index.build(l_format_ctx, l_stream);
+	AvioFile::close_input(&l_format_ctx);
+	if (l_response) {
+		close();
+		return l_response;
+	}
+
+	for (int64_t i = 0; i < packet_index.get_keyframe_count(); i++) {
+		int64_t l_keyframe = packet_index.get_keyframe(i);
+		int64_t l_frame_nr = packet_index.find_frame(packet_index.get_packet_pts(l_keyframe));
+
+		// Frames in front of the first keyframe go along with the first segment
+		if (segments.empty()) {
+			segments.push_back({ 0, 0, l_keyframe });
+		} else if (l_frame_nr - segments.back().start_frame >= MIN_SEGMENT_FRAMES) {
+			segments.back().end_frame = l_frame_nr;
+			segments.push_back({ l_frame_nr, 0, l_keyframe });
+		}
+	}
+	segments.back().end_frame = packet_index.get_frame_count();
+
+	segment_progress.assign(segments.size(), -1);
+	next_segment = 0;
+	next_output = 0;
+	stopping = false;
+
+	loaded = true;
+	return OK;
+}
+
+void SegmentDecoder::close() {
+	_stop_workers();
+
+	for (auto &l_entry : reorder_buffer)
+		av_frame_free(&l_entry.second);
+	reorder_buffer.clear();
+
+	if (codec_params)
+		avcodec_parameters_free(&codec_params);
+
+	packet_index.clear();
+	segments.clear();
+	segment_progress.clear();
+	stream_index = -1;
+	loaded = false;
+}
+
+void SegmentDecoder::_start_workers() {
+	int l_cores = OS::get_singleton()->get_processor_count();
+	int l_worker_count = thread_count > 0 ? thread_count : std::max(l_cores - 1, 1);
+	l_worker_count = std::clamp<int64_t>(l_worker_count, 1, segments.size());
+
+	// Cores which are left over get used by the codec threads of each worker
+	int l_codec_threads = std::max(l_cores / l_worker_count, 1);
+
+	active_workers = l_worker_count;
+	for (int i = 0; i < l_worker_count; i++)
+		workers.emplace_back(&SegmentDecoder::_decode_loop, this, l_codec_threads);
+}
+
+void SegmentDecoder::_stop_workers() {
+	{
+		std::lock_guard<std::mutex> l_lock(mutex);
+		stopping = true;
+	}
+	frame_taken.notify_all();
+
+	for (std::thread &l_worker : workers)
+		if (l_worker.joinable())
+			l_worker.join();
+	workers.clear();
+}
+
+void SegmentDecoder::_decode_loop(int a_codec_threads) {
+	AVFormatContext *l_format_ctx = nullptr;
+	AVCodecContext *l_codec_ctx = nullptr;
+	const AVCodec *l_codec = avcodec_find_decoder(codec_params->codec_id);
+	AVFrame *l_frame = av_frame_alloc();
+	AVPacket *l_packet = av_packet_alloc();
+
+	if (!l_frame || !l_packet) {
+		UtilityFunctions::printerr("Couldn't allocate frame or packet for segment decoding!");
+	} else if (AvioFile::open_input(&l_format_ctx, path.c_str(), NULL)) {
+		UtilityFunctions::printerr("Couldn't open file for segment decoding!");
+	} else if (!l_codec || !(l_codec_ctx = avcodec_alloc_context3(l_codec)) ||
+			avcodec_parameters_to_context(l_codec_ctx, codec_params) < 0) {
+		UtilityFunctions::printerr("Couldn't create decoder for segment decoding!");
+	} else {
+		for (unsigned int i = 0; i < l_format_ctx->nb_streams; i++)
+			if (i != static_cast<unsigned int>(stream_index))
+				l_format_ctx->streams[i]->discard = AVDISCARD_ALL;
+
+		l_codec_ctx->pkt_timebase = time_base;
+		FFmpeg::enable_multithreading(l_codec_ctx, l_codec, a_codec_threads);
+
+		if (avcodec_open2(l_codec_ctx, l_codec, NULL))
+			UtilityFunctions::printerr("Couldn't open decoder for segment decoding!");
+		else {
+			int64_t l_segment;
+			while ((l_segment = next_segment++) < static_cast<int64_t>(segments.size()))
+				if (_decode_segment(l_format_ctx, l_codec_ctx, l_frame, l_packet, l_segment) == ERR_SKIP)
+					break; // Stopping
+		}
+	}
+
+	// When the last worker stops early, the segments which nobody took still
+	// need to get finished so the reader doesn't wait on them forever
+	if (--active_workers == 0) {
+		std::lock_guard<std::mutex> l_lock(mutex);
+		for (int64_t l_segment; (l_segment = next_segment++) < static_cast<int64_t>(segments.size());)
+			segment_progress[l_segment] = INT64_MAX;
+	}
+	frame_added.notify_all();
+
+	if (l_codec_ctx) avcodec_free_context(&l_codec_ctx);
+	if (l_format_ctx) AvioFile::close_input(&l_format_ctx);
+	if (l_frame) av_frame_free(&l_frame);
+	if (l_packet) av_packet_free(&l_packet);
+}
+
+int SegmentDecoder::_decode_segment(AVFormatContext *a_format_ctx, AVCodecContext *a_codec_ctx, AVFrame *a_frame, AVPacket *a_packet, int64_t a_segment) {
+	const Segment &l_segment = segments[a_segment];
+	int64_t l_keyframe = l_segment.keyframe;
+	int l_response;
+
+	avcodec_flush_buffers(a_codec_ctx);
+	if (packet_index.get_packet_dts(l_keyframe) != AV_NOPTS_VALUE)
+		l_response = av_seek_frame(a_format_ctx, stream_index, packet_index.get_packet_dts(l_keyframe), AVSEEK_FLAG_BACKWARD);
+	else
+		l_response = av_seek_frame(a_format_ctx, stream_index, packet_index.get_packet_pos(l_keyframe), AVSEEK_FLAG_BYTE);
+
+	if (l_response < 0)
+		FFmpeg::print_av_error("Seeking to segment failed!", l_response);
+	else {
+		// Frames come out in display order, so the first frame past the end
+		// means all frames of this segment are done. Decoding continues past
+		// the next keyframe for open GOP's, which we can decode correctly.
+		while (!FFmpeg::get_frame(a_format_ctx, a_codec_ctx, stream_index, a_frame, a_packet)) {
+			int64_t l_pts = a_frame->best_effort_timestamp;
+			int64_t l_frame_nr = packet_index.find_frame(l_pts);
+
+			if (l_pts == AV_NOPTS_VALUE || l_frame_nr < l_segment.start_frame) {
+				av_frame_unref(a_frame);
+				continue;
+			} else if (l_frame_nr >= l_segment.end_frame) {
+				av_frame_unref(a_frame);
+				break;
+			} else if (!_push_frame(a_frame, l_frame_nr, a_segment))
+				return ERR_SKIP;
+		}
+	}
+
+	av_packet_unref(a_packet);
+	{
+		std::lock_guard<std::mutex> l_lock(mutex);
+		segment_progress[a_segment] = INT64_MAX;
+	}
+	frame_added.notify_all();
+
+	if (l_response < 0)
+		return GoZenError::ERR_SEEKING;
+	return OK;
+}
+
+bool SegmentDecoder::_push_frame(AVFrame *a_frame, int64_t a_frame_nr, int64_t a_segment) {
+	std::unique_lock<std::mutex> l_lock(mutex);
+
+	// Frames arrive in display order, so frames before this one which this
+	// segment didn't deliver yet won't come anymore
+	segment_progress[a_segment] = std::max(segment_progress[a_segment], a_frame_nr);
+	frame_added.notify_all();
+
+	// Workers which are too far ahead wait, the worker with the oldest
+	// segment always has its next frame inside of the window
+	frame_taken.wait(l_lock, [&] { return stopping || a_frame_nr < next_output + max_buffered_frames; });
+	if (stopping) {
+		av_frame_unref(a_frame);
+		return false;
+	}
+
+	if (a_frame_nr >= next_output && !reorder_buffer.count(a_frame_nr)) {
+		AVFrame *l_frame = av_frame_alloc();
+		av_frame_move_ref(l_frame, a_frame);
+		reorder_buffer[a_frame_nr] = l_frame;
+	} else av_frame_unref(a_frame);
+
+	l_lock.unlock();
+	frame_added.notify_all();
+
+	return true;
+}
+
+AVFrame *SegmentDecoder::pop_frame(int64_t &a_frame_nr) {
+	if (!loaded)
+		return nullptr;
+	else if (workers.empty())
+		_start_workers();
+
+	std::unique_lock<std::mutex> l_lock(mutex);
+
+	while (next_output < packet_index.get_frame_count()) {
+		// A segment which got past the frame without delivering it means
+		// the frame couldn't get decoded
+		int64_t l_segment = _get_segment(next_output);
+		frame_added.wait(l_lock, [&] {
+			return reorder_buffer.count(next_output) || segment_progress[l_segment] > next_output;
+		});
+
+		auto l_it = reorder_buffer.find(next_output);
+		AVFrame *l_frame = nullptr;
+		if (l_it != reorder_buffer.end()) {
+			l_frame = l_it->second;
+			reorder_buffer.erase(l_it);
+			a_frame_nr = next_output;
+		}
+
+		next_output++;
+		frame_taken.notify_all();
+
+		if (l_frame)
+			return l_frame;
+	}
+
+	return nullptr;
+}
+
+Ref<VideoFrame> SegmentDecoder::next_frame() {
+	int64_t l_frame_nr = -1;
+	AVFrame *l_frame = pop_frame(l_frame_nr);
+
+	if (!l_frame)
+		return Ref<VideoFrame>();
+
+	double l_pts = (l_frame->best_effort_timestamp - start_time) * av_q2d(time_base);
+	Ref<VideoFrame> l_video_frame = VideoFrame::create(l_frame, l_frame_nr, l_pts);
+
+	av_frame_free(&l_frame);
+	return l_video_frame;
+}
+
+int SegmentDecoder::get_buffered_frames() {
+	std::lock_guard<std::mutex> l_lock(mutex);
+	return reorder_buffer.size();
+}
+
+int64_t SegmentDecoder::_get_segment(int64_t a_frame_nr) const {
+	auto l_it = std::upper_bound(segments.begin(), segments.end(), a_frame_nr,
+			[](int64_t a_value, const Segment &a_segment) { return a_value < a_segment.start_frame; });
+
+	return std::max<int64_t>((l_it - segments.begin()) - 1, 0);
+}
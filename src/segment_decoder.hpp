@@ -0,0 +1,129 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <godot_cpp/classes/resource.hpp>
+#include <godot_cpp/variant/utility_functions.hpp>
+
+#include "ffmpeg.hpp"
+#include "avio_file.hpp"
+#include "packet_index.hpp"
+#include "video_frame.hpp"
+#include "gozen_error.hpp"
+
+
+using namespace godot;
+
+
+// Offline decoding for analysis and exporting. The video stream gets split at
+// keyframes into segments which are decoded in parallel, each by a worker
+// with its own format and codec context. Frames get handed back in display
+// order through a reorder buffer.
+class SegmentDecoder : public Resource {
+	GDCLASS(SegmentDecoder, Resource);
+
+private:
+	struct Segment {
+		int64_t start_frame = 0; // First frame of this segment
+		int64_t end_frame = 0; // First frame of the next segment
+		int64_t keyframe = 0; // Packet nr to start decoding from
+	};
+
+	// GOP's get merged until a segment has at least this amount of frames,
+	// otherwise intra only video would seek for every single frame
+	static constexpr int64_t MIN_SEGMENT_FRAMES = 48;
+
+	std::string path = "";
+	int stream_index = -1;
+	AVCodecParameters *codec_params = nullptr;
+	AVRational time_base = { 0, 1 };
+	AVRational frame_rate = { 0, 1 };
+	int64_t start_time = 0;
+
+	PacketIndex packet_index;
+	std::vector<Segment> segments;
+
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable frame_added;
+	std::condition_variable frame_taken;
+
+	std::map<int64_t, AVFrame*> reorder_buffer;
+	std::vector<int64_t> segment_progress; // Last frame nr each segment delivered
+	std::atomic<int64_t> next_segment = 0;
+	std::atomic<int> active_workers = 0;
+	int64_t next_output = 0;
+	bool stopping = false;
+
+	int thread_count = 0;
+	int max_buffered_frames = 256;
+	bool loaded = false;
+
+
+	void _start_workers();
+	void _stop_workers();
+	void _decode_loop(int a_codec_threads);
+	int _decode_segment(AVFormatContext *a_format_ctx, AVCodecContext *a_codec_ctx, AVFrame *a_frame, AVPacket *a_packet, int64_t a_segment);
+	bool _push_frame(AVFrame *a_frame, int64_t a_frame_nr, int64_t a_segment);
+	int64_t _get_segment(int64_t a_frame_nr) const;
+
+
+public:
+	SegmentDecoder() {}
+	~SegmentDecoder() { close(); }
+
+	int open(String a_path = "");
+	void close();
+
+	// Ownership of the frame goes to the caller, nullptr after the last frame
+	AVFrame *pop_frame(int64_t &a_frame_nr);
+	Ref<VideoFrame> next_frame();
+
+	inline bool is_open() { return loaded; }
+	inline String get_path() { return path.c_str(); }
+
+	inline AVRational get_time_base() const { return time_base; }
+	inline AVRational get_frame_rate() const { return frame_rate; }
+	inline const AVCodecParameters *get_codec_params() const { return codec_params; }
+
+	inline int64_t get_frame_count() { return packet_index.get_frame_count(); }
+	inline int64_t get_segment_count() { return segments.size(); }
+	inline int get_worker_count() { return workers.size(); }
+	int get_buffered_frames();
+
+	inline void set_thread_count(int a_value) { thread_count = a_value; }
+	inline int get_thread_count() { return thread_count; }
+
+	inline void set_max_buffered_frames(int a_value) { max_buffered_frames = std::max(a_value, 1); }
+	inline int get_max_buffered_frames() { return max_buffered_frames; }
+
+
+protected:
+	static inline void _bind_methods() {
+		ClassDB::bind_method(D_METHOD("open", "a_path"), &SegmentDecoder::open, DEFVAL(""));
+		ClassDB::bind_method(D_METHOD("close"), &SegmentDecoder::close);
+
+		ClassDB::bind_method(D_METHOD("next_frame"), &SegmentDecoder::next_frame);
+
+		ClassDB::bind_method(D_METHOD("is_open"), &SegmentDecoder::is_open);
+		ClassDB::bind_method(D_METHOD("get_path"), &SegmentDecoder::get_path);
+
+		ClassDB::bind_method(D_METHOD("get_frame_count"), &SegmentDecoder::get_frame_count);
+		ClassDB::bind_method(D_METHOD("get_segment_count"), &SegmentDecoder::get_segment_count);
+		ClassDB::bind_method(D_METHOD("get_worker_count"), &SegmentDecoder::get_worker_count);
+		ClassDB::bind_method(D_METHOD("get_buffered_frames"), &SegmentDecoder::get_buffered_frames);
+
+		ClassDB::bind_method(D_METHOD("set_thread_count", "a_value"), &SegmentDecoder::set_thread_count);
+		ClassDB::bind_method(D_METHOD("get_thread_count"), &SegmentDecoder::get_thread_count);
+
+		ClassDB::bind_method(D_METHOD("set_max_buffered_frames", "a_value"), &SegmentDecoder::set_max_buffered_frames);
+		ClassDB::bind_method(D_METHOD("get_max_buffered_frames"), &SegmentDecoder::get_max_buffered_frames);
+	}
+};
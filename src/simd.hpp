@@ -0,0 +1,19 @@
+#pragma once
+
+
+// Decides which SIMD kernels get compiled in, shared by all converters. AVX2
+// kernels are marked with GOZEN_TARGET_AVX2 so the rest of the build stays at
+// baseline x86-64, ColorConverter::get_best_path() checks the CPU at runtime.
+#if defined(__x86_64__) || defined(_M_X64)
+	#define GOZEN_X86
+	#include <immintrin.h>
+	#if defined(_MSC_VER) && !defined(__clang__)
+		#include <intrin.h>
+		#define GOZEN_TARGET_AVX2
+	#else
+		#define GOZEN_TARGET_AVX2 __attribute__((target("avx2")))
+	#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+	#define GOZEN_NEON
+	#include <arm_neon.h>
+#endif
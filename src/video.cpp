@@ -7,24 +7,159 @@ Dictionary Video::get_file_meta(String a_file_path) {
 	const AVDictionaryEntry *l_av_dic = NULL;
 	Dictionary l_dic = {};
 
-	if (avformat_open_input(&l_av_format_ctx, a_file_path.utf8(), NULL, NULL)) {
+	if (AvioFile::open_input(&l_av_format_ctx, a_file_path.utf8(), NULL)) {
 		UtilityFunctions::printerr("Couldn't open file!");
 		return l_dic;
 	}
 
 	if (avformat_find_stream_info(l_av_format_ctx, NULL)) {
 		UtilityFunctions::printerr("Couldn't find stream info!");
-		avformat_close_input(&l_av_format_ctx);
+		AvioFile::close_input(&l_av_format_ctx);
 		return l_dic;
 	}
 
 	while ((l_av_dic = av_dict_iterate(l_av_format_ctx->metadata, l_av_dic)))
 		l_dic[l_av_dic->key] = l_av_dic->value;
 
-	avformat_close_input(&l_av_format_ctx);
+	AvioFile::close_input(&l_av_format_ctx);
 	return l_dic;
 }
 
+Dictionary Video::get_files_meta(PackedStringArray a_file_paths, int64_t a_probe_size, float a_analyze_duration, int a_thread_count) {
+	Dictionary l_dic = {};
+	if (a_file_paths.is_empty())
+		return l_dic;
+
+	std::vector<std::string> l_paths;
+	for (const String &l_path : a_file_paths)
+		l_paths.push_back(l_path.utf8().get_data());
+
+	// Probing is mostly waiting on disk reads, so all cores get a worker
+	std::vector<FileInfo> l_infos(l_paths.size());
+	std::atomic<int> l_next = 0;
+	int l_worker_count = a_thread_count > 0 ? a_thread_count : OS::get_singleton()->get_processor_count();
+	l_worker_count = std::clamp<int>(l_worker_count, 1, l_paths.size());
+	int64_t l_analyze_duration = static_cast<int64_t>(a_analyze_duration * AV_TIME_BASE);
+
+	std::vector<std::thread> l_workers;
+	for (int i = 0; i < l_worker_count; i++)
+		l_workers.emplace_back(_probe_worker, std::cref(l_paths), std::ref(l_infos), std::ref(l_next), a_probe_size, l_analyze_duration);
+	for (std::thread &l_worker : l_workers)
+		l_worker.join();
+
+	for (size_t i = 0; i < l_infos.size(); i++) {
+		const FileInfo &l_info = l_infos[i];
+		Dictionary l_file = {};
+		Dictionary l_tags = {};
+		Array l_streams = Array();
+
+		for (const auto &l_tag : l_info.tags)
+			l_tags[String::utf8(l_tag.first.c_str())] = String::utf8(l_tag.second.c_str());
+
+		for (const StreamInfo &l_info_stream : l_info.streams) {
+			Dictionary l_stream = {};
+			l_stream["type"] = l_info_stream.type.c_str();
+			l_stream["codec"] = l_info_stream.codec.c_str();
+			l_stream["duration"] = l_info_stream.duration;
+
+			if (l_info_stream.type == "video") {
+				l_stream["resolution"] = l_info_stream.resolution;
+				l_stream["framerate"] = l_info_stream.framerate;
+			} else if (l_info_stream.type == "audio") {
+				l_stream["channels"] = l_info_stream.channels;
+				l_stream["sample_rate"] = l_info_stream.sample_rate;
+			}
+			l_streams.append(l_stream);
+		}
+
+		l_file["error"] = l_info.error;
+		l_file["format"] = l_info.format.c_str();
+		l_file["duration"] = l_info.duration;
+		l_file["bit_rate"] = l_info.bit_rate;
+		l_file["tags"] = l_tags;
+		l_file["streams"] = l_streams;
+		l_dic[a_file_paths[i]] = l_file;
+	}
+
+	return l_dic;
+}
+
+void Video::_probe_worker(const std::vector<std::string> &a_paths, std::vector<FileInfo> &a_infos, std::atomic<int> &a_next, int64_t a_probe_size, int64_t a_analyze_duration) {
+	for (int i = a_next++; i < static_cast<int>(a_paths.size()); i = a_next++)
+		a_infos[i].error = _probe_file(a_paths[i], a_infos[i], a_probe_size, a_analyze_duration);
+}
+
+int Video::_probe_file(const std::string &a_path, FileInfo &a_info, int64_t a_probe_size, int64_t a_analyze_duration) {
+	AVFormatContext *l_format_ctx = nullptr;
+	AVDictionary *l_options = nullptr;
+	const AVDictionaryEntry *l_av_dic = nullptr;
+
+	// Smaller limits than FFmpeg's defaults, headers are enough for most files
+	if (a_probe_size > 0)
+		av_dict_set_int(&l_options, "probesize", std::max<int64_t>(a_probe_size, 32), 0);
+	if (a_analyze_duration > 0)
+		av_dict_set_int(&l_options, "analyzeduration", a_analyze_duration, 0);
+
+	int l_response = AvioFile::open_input(&l_format_ctx, a_path.c_str(), &l_options);
+	av_dict_free(&l_options);
+	if (l_response)
+		return GoZenError::ERR_OPENING_VIDEO;
+
+	if (avformat_find_stream_info(l_format_ctx, NULL) < 0) {
+		AvioFile::close_input(&l_format_ctx);
+		return GoZenError::ERR_NO_STREAM_INFO_FOUND;
+	}
+
+	while ((l_av_dic = av_dict_iterate(l_format_ctx->metadata, l_av_dic)))
+		a_info.tags.emplace_back(l_av_dic->key, l_av_dic->value);
+
+	a_info.format = l_format_ctx->iformat->name;
+	a_info.bit_rate = l_format_ctx->bit_rate;
+	if (l_format_ctx->duration != AV_NOPTS_VALUE)
+		a_info.duration = static_cast<double>(l_format_ctx->duration) / AV_TIME_BASE;
+
+	for (unsigned int i = 0; i < l_format_ctx->nb_streams; i++) {
+		AVStream *l_stream = l_format_ctx->streams[i];
+		AVCodecParameters *l_params = l_stream->codecpar;
+		const char *l_type = av_get_media_type_string(l_params->codec_type);
+		StreamInfo l_info;
+
+		l_info.type = l_type ? l_type : "unknown";
+		l_info.codec = avcodec_get_name(l_params->codec_id);
+		l_info.duration = l_stream->duration != AV_NOPTS_VALUE
+				? l_stream->duration * av_q2d(l_stream->time_base) : a_info.duration;
+
+		if (l_params->codec_type == AVMEDIA_TYPE_VIDEO) {
+			l_info.resolution = Vector2i(l_params->width, l_params->height);
+			l_info.framerate = av_q2d(av_guess_frame_rate(l_format_ctx, l_stream, NULL));
+		} else if (l_params->codec_type == AVMEDIA_TYPE_AUDIO) {
+			l_info.channels = l_params->ch_layout.nb_channels;
+			l_info.sample_rate = l_params->sample_rate;
+		}
+
+		a_info.streams.push_back(l_info);
+	}
+
+	AvioFile::close_input(&l_format_ctx);
+	return OK;
+}
+
+int Video::_get_rotation(const AVStream *a_stream) {
+	AVDictionaryEntry *l_rotate_tag = av_dict_get(a_stream->metadata, "rotate", nullptr, 0);
+	int l_rotation = l_rotate_tag ? atoi(l_rotate_tag->value) : 0;
+
+	if (l_rotation == 0) { // Check modern rotation detecting
+		for (int i = 0; i < a_stream->codecpar->nb_coded_side_data; ++i) {
+			const AVPacketSideData *side_data = &a_stream->codecpar->coded_side_data[i];
+
+			if (side_data->type == AV_PKT_DATA_DISPLAYMATRIX && side_data->size == sizeof(int32_t) * 9)
+				l_rotation = av_display_rotation_get(reinterpret_cast<const int32_t *>(side_data->data));
+		}
+	}
+
+	return l_rotation;
+}
+
 PackedStringArray Video::get_available_hw_devices() {
 	PackedStringArray l_devices = PackedStringArray();
 	enum AVHWDeviceType l_type = AV_HWDEVICE_TYPE_NONE;
@@ -39,30 +174,198 @@ enum AVPixelFormat Video::_get_format(AVCodecContext *a_av_ctx, const enum AVPix
 	return FFmpeg::get_hw_format(a_pix_fmt, &static_cast<Video *>(a_av_ctx->opaque)->hw_pix_fmt);
 }
 
+int Video::_get_buffer(AVCodecContext *a_av_ctx, AVFrame *a_frame, int a_flags) {
+	return static_cast<Video *>(a_av_ctx->opaque)->frame_pool.get_buffer(a_av_ctx, a_frame);
+}
+
 
 //----------------------------------------------- NON-STATIC FUNCTIONS
 int Video::open(String a_path, bool a_load_audio) {
 	if (loaded)
 		return GoZenError::ERR_ALREADY_OPEN_VIDEO;
 
+	uint64_t l_start_time = Time::get_singleton()->get_ticks_usec();
+	String l_cache_dir = String::utf8(cache_dir.c_str());
+	open_progress = 0.;
+	VideoMeta l_meta;
+
+	// Frames get decoded from the proxy, everything else comes from the source.
+	// Locals first, since a failed _open() calls close() which resets members.
+	String l_proxy_path = String::utf8(proxy_path.c_str());
+	bool l_using_proxy = !proxy_path.empty() && FileAccess::file_exists(l_proxy_path);
+	String l_path = l_using_proxy ? l_proxy_path : a_path;
+	bool l_load_audio = a_load_audio && !l_using_proxy && !stream_audio;
+
+	bool l_from_cache = !cache_dir.empty() && l_meta.load(l_cache_dir, l_path, packet_index);
+	bool l_had_index = !packet_index.is_empty();
+
+	if ((response = _open(l_path, l_load_audio, l_from_cache ? &l_meta : nullptr)) && l_from_cache) {
+		_print_debug("Opening with cached video info failed, probing file instead!");
+		l_from_cache = false;
+		response = _open(l_path, l_load_audio, nullptr);
+	}
+
+	if (response == OK) {
+		using_proxy = l_using_proxy;
+		opened_from_cache = l_from_cache;
+	}
+
+	// Writing the sidecar when there was none, or when we now have an index
+	if (response == OK && !cache_dir.empty() && (!opened_from_cache || l_had_index != !packet_index.is_empty()))
+		_save_meta();
+
+	if (response == OK && using_proxy && (response = _open_source(a_path, a_load_audio && !stream_audio)))
+		close();
+
+	// Streamed audio only gets probed here, every playback reads the packets
+	// from a format context of its own while playing
+	if (response == OK && a_load_audio && stream_audio && !cancel_requested) {
+		audio_stream = AudioStreamFFmpeg::_stream_from_file(a_path, { &Video::_interrupt_callback, this });
+		if (audio_stream.is_valid() && audio_stream->get_error()) {
+			_print_debug("No audio stream found or audio couldn't be opened!");
+			audio_stream.unref();
+		}
+	}
+
+	// Interrupted FFmpeg calls give all kinds of errors
+	if (cancel_requested) {
+		if (response == OK)
+			close();
+		response = GoZenError::ERR_CANCELLED;
+	} else if (response == OK)
+		_set_open_progress(1.);
+
+	open_time = Time::get_singleton()->get_ticks_usec() - l_start_time;
+	_print_debug("Opening video took " + std::to_string(open_time) + " usec" + (opened_from_cache ? " (cached)" : ""));
+
+	return response;
+}
+
+int Video::open_async(String a_path, bool a_load_audio) {
+	if (loaded || open_task_id != -1)
+		return GoZenError::ERR_ALREADY_OPEN_VIDEO;
+
+	cancel_requested = false;
+	opening_async = true;
+	async_self = Ref<Video>(this);
+	open_task_id = WorkerThreadPool::get_singleton()->add_task(
+			callable_mp(this, &Video::_open_task).bind(a_path, a_load_audio), true, "Opening video");
+
+	return OK;
+}
+
+void Video::_open_task(String a_path, bool a_load_audio) {
+	int l_response = open(a_path, a_load_audio);
+	callable_mp(this, &Video::_open_task_done).call_deferred(l_response);
+}
+
+void Video::_open_task_done(int a_response) {
+	// Holding on to ourselves until the end, the reference from open_async
+	// might be the last one
+	Ref<Video> l_self = async_self;
+	async_self.unref();
+
+	// Pool tasks need to be waited on to get released
+	WorkerThreadPool::get_singleton()->wait_for_task_completion(open_task_id);
+	open_task_id = -1;
+	opening_async = false;
+	cancel_requested = false;
+
+	emit_signal("opened", a_response);
+}
+
+void Video::cancel() {
+	if (open_task_id != -1)
+		cancel_requested = true;
+}
+
+int Video::_interrupt_callback(void *a_opaque) {
+	return static_cast<Video *>(a_opaque)->cancel_requested ? 1 : 0;
+}
+
+void Video::_set_open_progress(float a_value) {
+	// Signals only for open_async, and not for every single audio frame
+	float l_progress = open_progress;
+	if (a_value - l_progress < 0.01 && (a_value < 1. || l_progress >= 1.))
+		return;
+
+	open_progress = a_value;
+	if (opening_async)
+		call_deferred("emit_signal", "open_progress", a_value);
+}
+
+int Video::_open_source(String a_path, bool a_load_audio) {
+	AVFormatContext *l_format_ctx = avformat_alloc_context();
+	int l_stream_index = -1;
+
+	if (!l_format_ctx)
+		return GoZenError::ERR_CREATING_AV_FORMAT_FAILED;
+
+	l_format_ctx->interrupt_callback = { &Video::_interrupt_callback, this };
+	if (AvioFile::open_input(&l_format_ctx, a_path.utf8(), NULL))
+		return GoZenError::ERR_OPENING_VIDEO;
+
+	if (avformat_find_stream_info(l_format_ctx, NULL)) {
+		AvioFile::close_input(&l_format_ctx);
+		return GoZenError::ERR_NO_STREAM_INFO_FOUND;
+	}
+
+	if ((l_stream_index = av_find_best_stream(l_format_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0)) < 0) {
+		AvioFile::close_input(&l_format_ctx);
+		return GoZenError::ERR_INVALID_VIDEO;
+	}
+
+	// The proxy has a smaller size, but we report the size of the source
+	AVStream *l_stream = l_format_ctx->streams[l_stream_index];
+	proxy_resolution = resolution;
+	resolution.x = l_stream->codecpar->width;
+	resolution.y = l_stream->codecpar->height;
+	rotation = _get_rotation(l_stream);
+
+	float l_aspect_ratio = av_q2d(l_stream->codecpar->sample_aspect_ratio);
+	if (l_aspect_ratio > 1.0)
+		resolution.x = static_cast<int>(std::round(resolution.x * l_aspect_ratio));
+
+	// Proxies don't have audio, so it gets loaded from the source
+	if (a_load_audio && (l_stream_index = av_find_best_stream(l_format_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0)) >= 0) {
+		l_stream = l_format_ctx->streams[l_stream_index];
+		if ((audio = Ref<AudioStreamWAV>(FFmpeg::get_audio(l_format_ctx, l_stream, [this](float a_value) { _set_open_progress(0.1 + a_value * 0.8); }))).is_null()) {
+			AvioFile::close_input(&l_format_ctx);
+			return GoZenError::ERR_OPENING_AUDIO;
+		}
+	}
+
+	source_path = a_path.utf8();
+	AvioFile::close_input(&l_format_ctx);
+	return OK;
+}
+
+int Video::_open(String a_path, bool a_load_audio, const VideoMeta *a_meta) {
 	path = a_path.utf8();
+	using_sws = false;
+	interlaced = 0;
 
 	// Allocate video file context
 	av_format_ctx = avformat_alloc_context();
 	if (!av_format_ctx)
 		return GoZenError::ERR_CREATING_AV_FORMAT_FAILED;
+
+	// Lets cancel() stop FFmpeg while it's reading
+	av_format_ctx->interrupt_callback = { &Video::_interrupt_callback, this };
 	
 	// Open file with avformat
-	if (avformat_open_input(&av_format_ctx, path.c_str(), NULL, NULL)) {
+	if (AvioFile::open_input(&av_format_ctx, path.c_str(), NULL)) {
 		close();
 		return GoZenError::ERR_OPENING_VIDEO;
 	}
+	_set_open_progress(0.05);
 
-	// Find stream information
-	if (avformat_find_stream_info(av_format_ctx, NULL)) {
+	// Find stream information, the cached info already has what we need
+	if (!a_meta && avformat_find_stream_info(av_format_ctx, NULL)) {
 		close();
 		return GoZenError::ERR_NO_STREAM_INFO_FOUND;
 	}
+	_set_open_progress(0.1);
 
 	// Getting the audio and video stream
 	for (int i = 0; i < av_format_ctx->nb_streams; i++) {
@@ -72,7 +375,11 @@ int Video::open(String a_path, bool a_load_audio) {
 			av_format_ctx->streams[i]->discard = AVDISCARD_ALL;
 			continue;
 		} else if (av_codec_params->codec_type == AVMEDIA_TYPE_AUDIO) {
-			if (a_load_audio && (audio = FFmpeg::get_audio(av_format_ctx, av_format_ctx->streams[i])) == nullptr) {
+			// Decoding all audio is what takes the longest when opening
+			auto l_progress = [this](float a_value) { _set_open_progress(0.1 + a_value * 0.8); };
+			if (!a_load_audio)
+				av_format_ctx->streams[i]->discard = AVDISCARD_ALL; // Streamed or not needed
+			else if ((audio = Ref<AudioStreamWAV>(FFmpeg::get_audio(av_format_ctx, av_format_ctx->streams[i], l_progress))).is_null()) {
 				close();
 				return response;
 			}
@@ -83,18 +390,10 @@ int Video::open(String a_path, bool a_load_audio) {
 			resolution.y = av_codec_params->height;
 			color_profile = av_codec_params->color_primaries;
 
-			AVDictionaryEntry *l_rotate_tag = av_dict_get(av_stream_video->metadata, "rotate", nullptr, 0);
-			rotation = l_rotate_tag ? atoi(l_rotate_tag->value) : 0;
-			if (rotation == 0) { // Check modern rotation detecting
-				for (int i = 0; i < av_stream_video->codecpar->nb_coded_side_data; ++i) {
-					const AVPacketSideData *side_data = &av_stream_video->codecpar->coded_side_data[i];
-
-					if (side_data->type == AV_PKT_DATA_DISPLAYMATRIX && side_data->size == sizeof(int32_t) * 9)
-						rotation = av_display_rotation_get(reinterpret_cast<const int32_t *>(side_data->data));
-				}
-			}
+			rotation = _get_rotation(av_stream_video);
 
-			if (av_codec_params->format != AV_PIX_FMT_YUV420P && hw_decoding) {
+			int l_format = a_meta ? a_meta->source_format : av_codec_params->format;
+			if (l_format != AV_PIX_FMT_YUV420P && hw_decoding) {
 				_print_debug("Hardware decoding not supported for this pixel format, switching to software decoding!");
 				hw_decoding = false;
 			}
@@ -104,6 +403,11 @@ int Video::open(String a_path, bool a_load_audio) {
 		av_format_ctx->streams[i]->discard = AVDISCARD_ALL;
 	}
 
+	if (!av_stream_video || (a_meta && av_stream_video->codecpar->codec_id != a_meta->codec_id)) {
+		close();
+		return GoZenError::ERR_INVALID_VIDEO;
+	}
+
 	// Setup Decoder codec context
 	const AVCodec *av_codec_video;
 	if (hw_decoding)
@@ -116,23 +420,91 @@ int Video::open(String a_path, bool a_load_audio) {
 		return GoZenError::ERR_FAILED_FINDING_VIDEO_DECODER;
 	}
 
-	// Allocate codec context for decoder
-	av_codec_ctx_video = avcodec_alloc_context3(av_codec_video);
-	if (av_codec_ctx_video == NULL) {
+	if ((response = _open_codec(av_codec_video))) {
 		close();
-		return GoZenError::ERR_FAILED_ALLOC_VIDEO_CODEC;
+		return response;
 	}
+
+	float l_aspect_ratio = av_q2d(av_stream_video->codecpar->sample_aspect_ratio);
+	if (l_aspect_ratio > 1.0)
+		resolution.x = static_cast<int>(std::round(resolution.x * l_aspect_ratio));
+
+	// The cached plane layout is only valid for the same decoding path
+	if (a_meta && a_meta->hw_decoding != hw_decoding) {
+		close();
+		return GoZenError::ERR_INVALID_VIDEO;
+	}
+
+	if (hw_decoding)
+		pixel_format = av_get_pix_fmt_name(hw_pix_fmt);
+	else
+		pixel_format = av_get_pix_fmt_name(av_codec_ctx_video->pix_fmt);
+	_print_debug("Selected pixel format is: " + pixel_format);
+
+	start_time_video = av_stream_video->start_time != AV_NOPTS_VALUE ? (int64_t)(av_stream_video->start_time * stream_time_base_video) : 0;
+
+	// Getting some data out of first frame
+	if (!(av_packet = av_packet_alloc())) {
+		close();
+		return GoZenError::ERR_FAILED_ALLOC_PACKET;
+	}
+
+	if (!(av_frame = av_frame_alloc()) || !(shown_frame = av_frame_alloc())) {
+		close();
+		return GoZenError::ERR_FAILED_ALLOC_FRAME;
+	}
+
+	if (hw_decoding && !(av_hw_frame = av_frame_alloc())) {
+		close();
+		return GoZenError::ERR_FAILED_ALLOC_FRAME;
+	}
+
+	avcodec_flush_buffers(av_codec_ctx_video);
+	if (av_format_ctx->duration_estimation_method == AVFMT_DURATION_FROM_BITRATE) {
+		close();
+		return GoZenError::ERR_INVALID_VIDEO;
+	}
+
+	// Optional demux-only pass to know where every frame and keyframe is
+	if (build_index && packet_index.is_empty() && (response = packet_index.build(av_format_ctx, av_stream_video)) != OK)
+		UtilityFunctions::printerr("Couldn't build packet index, using estimated seeking!");
+	_set_open_progress(0.95);
+
+	if ((response = a_meta ? _apply_meta(*a_meta) : _probe_video())) {
+		close();
+		return response;
+	}
+
+	if (av_packet)
+		av_packet_unref(av_packet);
+	if (av_frame)
+		av_frame_unref(av_frame);
+
+	current_frame = 0;
+	decoder_frame = -1; // Probing moved the decoder, next_frame() has to seek first
+
+	loaded = true;
+	response = OK;
+
+	return OK;
+}
+
+int Video::_open_codec(const AVCodec *a_codec) {
+	// Allocate codec context for decoder
+	av_codec_ctx_video = avcodec_alloc_context3(a_codec);
+	if (av_codec_ctx_video == NULL)
+		return GoZenError::ERR_FAILED_ALLOC_VIDEO_CODEC;
 	
 	if (hw_decoding && hw_device_ctx) {
-		av_codec_ctx_video->hw_device_ctx = hw_device_ctx;
+		av_codec_ctx_video->hw_device_ctx = av_buffer_ref(hw_device_ctx);
 
 		for (int i = 0;; i++) {
-			const AVCodecHWConfig *config = avcodec_get_hw_config(av_codec_video, i);
+			const AVCodecHWConfig *config = avcodec_get_hw_config(a_codec, i);
 			if (!config) {
 				_printerr_debug("Current decoder does not accept selected device!");
-				_printerr_debug(std::string("Codec name: ") + av_codec_video->long_name + "  -  Device: " + av_hwdevice_get_type_name(hw_decoder));
+				_printerr_debug(std::string("Codec name: ") + a_codec->long_name + "  -  Device: " + av_hwdevice_get_type_name(hw_decoder));
 				hw_decoding = false;
-				av_codec_ctx_video->hw_device_ctx = nullptr;
+				av_buffer_unref(&av_codec_ctx_video->hw_device_ctx);
 				break;
 			}
 			if ((config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX) && config->device_type == hw_decoder) {
@@ -144,66 +516,73 @@ int Video::open(String a_path, bool a_load_audio) {
 
 		av_codec_ctx_video->opaque = this;
 		av_codec_ctx_video->get_format = _get_format;
+	} else if (a_codec->capabilities & AV_CODEC_CAP_DR1) {
+		// Software decoders write straight into our pooled frame buffers
+		av_codec_ctx_video->opaque = this;
+		av_codec_ctx_video->get_buffer2 = _get_buffer;
 	}
 
 	// Copying parameters
-	if (avcodec_parameters_to_context(av_codec_ctx_video, av_stream_video->codecpar)) {
-		close();
+	if (avcodec_parameters_to_context(av_codec_ctx_video, av_stream_video->codecpar))
 		return GoZenError::ERR_FAILED_INIT_VIDEO_CODEC;
-	}
 
-	FFmpeg::enable_multithreading(av_codec_ctx_video, av_codec_video);
+	FFmpeg::enable_multithreading(av_codec_ctx_video, a_codec);
+
+	if (preview_quality) {
+		// Deblocking gets skipped for all frames, the inverse transform only
+		// for frames which aren't referenced so the errors don't spread
+		av_codec_ctx_video->skip_loop_filter = AVDISCARD_ALL;
+		av_codec_ctx_video->skip_idct = AVDISCARD_NONREF;
+		av_codec_ctx_video->flags2 |= AV_CODEC_FLAG2_FAST;
+
+		// Frame threading holds back a frame per thread, slice threading
+		// gives the frame right away which is what seeking needs
+		if (av_codec_ctx_video->thread_count > 1 && (a_codec->capabilities & AV_CODEC_CAP_SLICE_THREADS))
+			av_codec_ctx_video->thread_type = FF_THREAD_SLICE;
+		av_codec_ctx_video->flags |= AV_CODEC_FLAG_LOW_DELAY;
+	}
 	
 	// Open codec - Video
-	if (avcodec_open2(av_codec_ctx_video, av_codec_video, NULL)) {
-		close();
+	if (avcodec_open2(av_codec_ctx_video, a_codec, NULL))
 		return GoZenError::ERR_FAILED_OPEN_VIDEO_CODEC;
-	}
 
-	float l_aspect_ratio = av_q2d(av_stream_video->codecpar->sample_aspect_ratio);
-	if (l_aspect_ratio > 1.0)
-		resolution.x = static_cast<int>(std::round(resolution.x * l_aspect_ratio));
-
-	if (hw_decoding)
-		pixel_format = av_get_pix_fmt_name(hw_pix_fmt);
-	else
-		pixel_format = av_get_pix_fmt_name(av_codec_ctx_video->pix_fmt);
-	_print_debug("Selected pixel format is: " + pixel_format);
+	return OK;
+}
 
-	start_time_video = av_stream_video->start_time != AV_NOPTS_VALUE ? (int64_t)(av_stream_video->start_time * stream_time_base_video) : 0;
+void Video::set_preview_quality(bool a_value) {
+	if (preview_quality == a_value)
+		return;
 
-	// Getting some data out of first frame
-	if (!(av_packet = av_packet_alloc())) {
-		close();
-		return GoZenError::ERR_FAILED_ALLOC_PACKET;
-	}
+	preview_quality = a_value;
+	if (!loaded)
+		return;
 
-	if (!(av_frame = av_frame_alloc())) {
-		close();
-		return GoZenError::ERR_FAILED_ALLOC_FRAME;
-	}
+	// Threading can only be changed by opening a new decoder
+	_stop_prefetch();
+	const AVCodec *l_codec = av_codec_ctx_video->codec;
+	avcodec_free_context(&av_codec_ctx_video);
 
-	if (hw_decoding && !(av_hw_frame = av_frame_alloc())) {
+	if ((response = _open_codec(l_codec))) {
+		UtilityFunctions::printerr("Couldn't reopen decoder for new quality!");
 		close();
-		return GoZenError::ERR_FAILED_ALLOC_FRAME;
+		return;
 	}
+	decoder_frame = -1; // New decoder has to seek first
 
-	avcodec_flush_buffers(av_codec_ctx_video);
-	bool l_duration_from_bitrate = av_format_ctx->duration_estimation_method == AVFMT_DURATION_FROM_BITRATE;
-	if (l_duration_from_bitrate) {
-		close();
-		return GoZenError::ERR_INVALID_VIDEO;
-	}
+	// Replacing the preview frame which is being shown with an exact one
+	if (!preview_quality)
+		seek_frame(current_frame);
+}
 
+int Video::_probe_video() {
+	// Decodes the first frames to find out what the open() caller needs.
 	if ((response = _seek_frame(0)) < 0) {
 		FFmpeg::print_av_error("Seeking to beginning error: ", response);
-		close();
 		return GoZenError::ERR_SEEKING;
 	}
 
 	if ((response = FFmpeg::get_frame(av_format_ctx, av_codec_ctx_video, av_stream_video->index, av_frame, av_packet))) {
 		FFmpeg::print_av_error("Something went wrong getting first frame!", response);
-		close();
 		return GoZenError::ERR_SEEKING;
 	}
 	
@@ -216,58 +595,56 @@ int Video::open(String a_path, bool a_load_audio) {
 
 	// Getting frame rate
 	framerate = av_q2d(av_guess_frame_rate(av_format_ctx, av_stream_video, av_frame));
-	if (framerate == 0) {
-		close();
+	if (framerate == 0)
 		return GoZenError::ERR_INVALID_FRAMERATE;
-	}
 
 	// Setting variables
 	average_frame_duration = 10000000.0 / framerate;								// eg. 1 sec / 25 fps = 400.000 ticks (40ms)
 	stream_time_base_video = av_q2d(av_stream_video->time_base) * 1000.0 * 10000.0; // Converting timebase to ticks
 
-	// Preparing the data array's
-	if (!hw_decoding) {
-		if (av_frame->format == AV_PIX_FMT_YUV420P) {
-			y_data = Image::create_empty(av_frame->linesize[0] , resolution.y, false, Image::FORMAT_R8);
-			u_data = Image::create_empty(av_frame->linesize[1] , resolution.y/2, false, Image::FORMAT_R8);
-			v_data = Image::create_empty(av_frame->linesize[2] , resolution.y/2, false, Image::FORMAT_R8);
-			padding = av_frame->linesize[0] - resolution.x;
-		} else {
-			using_sws = true;
-			sws_ctx = sws_getContext(
-							resolution.x, resolution.y, av_codec_ctx_video->pix_fmt,
-							resolution.x, resolution.y, AV_PIX_FMT_YUV420P,
-							SWS_BICUBIC, NULL, NULL, NULL);
-
-			// We will use av_hw_frame to convert the frame data to as we won't use it anyway without hw decoding.
-			av_hw_frame = av_frame_alloc();
-			sws_scale_frame(sws_ctx, av_hw_frame, av_frame);
-
-			y_data = Image::create_empty(av_hw_frame->linesize[0] , resolution.y, false, Image::FORMAT_R8);
-			u_data = Image::create_empty(av_hw_frame->linesize[1] , resolution.y/2, false, Image::FORMAT_R8);
-			v_data = Image::create_empty(av_hw_frame->linesize[2] , resolution.y/2, false, Image::FORMAT_R8);
-			padding = av_hw_frame->linesize[0] - resolution.x;
-
-			av_frame_unref(av_hw_frame);
-		}
-	} else {
+	// Preparing the data array's, frames which the shaders can't handle
+	// directly get converted to yuv420p with sws
+	AVPixelFormat l_layout = static_cast<AVPixelFormat>(av_frame->format);
+	if (hw_decoding) {
 		if (av_hwframe_transfer_data(av_hw_frame, av_frame, 0) < 0)
 			_printerr_debug("Error transferring the frame to system memory!");
 
-		y_data = Image::create_empty(av_hw_frame->linesize[0] , resolution.y, false, Image::FORMAT_R8);
-		u_data = Image::create_empty(av_hw_frame->linesize[1]/2 , resolution.y/2, false, Image::FORMAT_RG8);
-		padding = av_hw_frame->linesize[0] - resolution.x;
+		l_layout = static_cast<AVPixelFormat>(av_hw_frame->format);
+		_create_planes(av_hw_frame);
+		av_frame_unref(av_hw_frame);
+	} else if (_is_native_format(l_layout)) {
+		// The yuvj formats are deprecated but always full range
+		if (l_layout == AV_PIX_FMT_YUVJ420P || l_layout == AV_PIX_FMT_YUVJ422P || l_layout == AV_PIX_FMT_YUVJ444P)
+			full_color_range = true;
+		_create_planes(av_frame);
+	} else {
+		using_sws = true;
+		l_layout = AV_PIX_FMT_YUV420P;
+		sws_ctx = sws_getContext(
+						resolution.x, resolution.y, av_codec_ctx_video->pix_fmt,
+						resolution.x, resolution.y, AV_PIX_FMT_YUV420P,
+						SWS_BICUBIC, NULL, NULL, NULL);
+
+		// We will use av_hw_frame to convert the frame data to as we won't use it anyway without hw decoding.
+		av_hw_frame = av_frame_alloc();
+		sws_scale_frame(sws_ctx, av_hw_frame, av_frame);
+
+		_create_planes(av_hw_frame);
 		av_frame_unref(av_hw_frame);
-	} 
+	}
+
+	// From here on the pixel format is the layout of the planes
+	pixel_format = av_get_pix_fmt_name(l_layout);
+	bit_depth = av_pix_fmt_desc_get(l_layout)->comp[0].depth;
+	_print_debug("Plane layout is: " + pixel_format + (using_sws ? " (converted with sws)" : ""));
 
 	// Checking second frame
 	if ((response = FFmpeg::get_frame(av_format_ctx, av_codec_ctx_video, av_stream_video->index, av_frame, av_packet)))
 		FFmpeg::print_av_error("Something went wrong getting second frame!", response);
 
 	duration = av_format_ctx->duration;
-	if (av_stream_video->duration == AV_NOPTS_VALUE || l_duration_from_bitrate) {
-		if (duration == AV_NOPTS_VALUE || l_duration_from_bitrate) {
-			close();
+	if (av_stream_video->duration == AV_NOPTS_VALUE) {
+		if (duration == AV_NOPTS_VALUE) {
 			return GoZenError::ERR_INVALID_VIDEO;
 		} else {
 			AVRational l_temp_rational = AVRational{1, AV_TIME_BASE};
@@ -277,44 +654,209 @@ int Video::open(String a_path, bool a_load_audio) {
 		av_stream_video->duration = duration;
 	}
 
-	frame_count = (static_cast<double>(duration) / static_cast<double>(AV_TIME_BASE)) * framerate;
+	if (!packet_index.is_empty())
+		frame_count = packet_index.get_frame_count();
+	else
+		frame_count = (static_cast<double>(duration) / static_cast<double>(AV_TIME_BASE)) * framerate;
 
-	if (av_packet)
-		av_packet_unref(av_packet);
-	if (av_frame)
-		av_frame_unref(av_frame);
+	return OK;
+}
 
-	loaded = true;
-	response = OK;
+bool Video::_is_native_format(AVPixelFormat a_format) {
+	// Formats of which the planes can go to the shaders as decoded
+	switch (a_format) {
+		case AV_PIX_FMT_YUV420P:
+		case AV_PIX_FMT_YUVJ420P:
+		case AV_PIX_FMT_YUV422P:
+		case AV_PIX_FMT_YUVJ422P:
+		case AV_PIX_FMT_YUV444P:
+		case AV_PIX_FMT_YUVJ444P:
+		case AV_PIX_FMT_YUVA420P:
+		case AV_PIX_FMT_NV12:
+		case AV_PIX_FMT_YUV420P10LE:
+		case AV_PIX_FMT_YUV422P10LE:
+		case AV_PIX_FMT_YUV444P10LE:
+		case AV_PIX_FMT_YUV420P12LE:
+		case AV_PIX_FMT_YUV422P12LE:
+		case AV_PIX_FMT_YUV444P12LE:
+		case AV_PIX_FMT_P010LE:
+			return true;
+		default:
+			return false;
+	}
+}
+
+void Video::_create_planes(const AVFrame *a_frame) {
+	// Images are linesize wide so copying a plane is a single memcpy. A texel
+	// holds one 8 bit sample (R8), a 16 bit sample or 8 bit UV pair (RG8), or
+	// a 16 bit UV pair (RGBA8).
+	const AVPixFmtDescriptor *l_desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(a_frame->format));
+	Ref<Image> *l_planes[4] = { &y_data, &u_data, &v_data, &a_data };
+
+	for (int i = 0; i < 4; i++) {
+		int l_texel_size = 0;
+		for (int l_comp = 0; l_comp < l_desc->nb_components; l_comp++)
+			if (l_desc->comp[l_comp].plane == i)
+				l_texel_size = l_desc->comp[l_comp].step;
+
+		if (l_texel_size == 0) {
+			l_planes[i]->unref();
+			plane_sizes[i] = 0;
+			continue;
+		}
+
+		Image::Format l_format = l_texel_size == 1 ? Image::FORMAT_R8 : l_texel_size == 2 ? Image::FORMAT_RG8 : Image::FORMAT_RGBA8;
+		int l_height = (i == 1 || i == 2) ? AV_CEIL_RSHIFT(a_frame->height, l_desc->log2_chroma_h) : a_frame->height;
+		*l_planes[i] = Image::create_empty(a_frame->linesize[i] / l_texel_size, l_height, false, l_format);
+		plane_sizes[i] = (*l_planes[i])->get_data().size();
+	}
+
+	padding = y_data->get_width() - resolution.x;
+}
+
+int Video::_apply_meta(const VideoMeta &a_meta) {
+	resolution = a_meta.resolution;
+	rotation = a_meta.rotation;
+	interlaced = a_meta.interlaced;
+	padding = a_meta.padding;
+	bit_depth = a_meta.bit_depth;
+	color_profile = static_cast<AVColorPrimaries>(a_meta.color_profile);
+	full_color_range = a_meta.full_color_range;
+	pixel_format = a_meta.pixel_format.utf8().get_data();
+
+	framerate = a_meta.framerate;
+	duration = a_meta.duration;
+	frame_count = !packet_index.is_empty() ? packet_index.get_frame_count() : a_meta.frame_count;
+
+	average_frame_duration = 10000000.0 / framerate;
+	stream_time_base_video = av_q2d(av_stream_video->time_base) * 1000.0 * 10000.0;
+
+	if ((using_sws = a_meta.using_sws)) {
+		sws_ctx = sws_getContext(
+						resolution.x, resolution.y, static_cast<AVPixelFormat>(a_meta.decoder_format),
+						resolution.x, resolution.y, AV_PIX_FMT_YUV420P,
+						SWS_BICUBIC, NULL, NULL, NULL);
+		if (!sws_ctx)
+			return GoZenError::ERR_CREATING_SWS;
+		if (!av_hw_frame && !(av_hw_frame = av_frame_alloc()))
+			return GoZenError::ERR_FAILED_ALLOC_FRAME;
+	}
+
+	Ref<Image> *l_planes[4] = { &y_data, &u_data, &v_data, &a_data };
+	for (int i = 0; i < 4; i++) {
+		if (a_meta.plane_format[i] < 0) {
+			l_planes[i]->unref();
+			plane_sizes[i] = 0;
+		} else {
+			*l_planes[i] = Image::create_empty(a_meta.plane_width[i], a_meta.plane_height[i], false, static_cast<Image::Format>(a_meta.plane_format[i]));
+			plane_sizes[i] = (*l_planes[i])->get_data().size();
+		}
+	}
 
 	return OK;
 }
 
+void Video::_save_meta() {
+	VideoMeta l_meta;
+	String l_path = String::utf8(path.c_str());
+
+	if (!l_meta.read_file_stats(l_path))
+		return;
+
+	l_meta.resolution = resolution;
+	l_meta.rotation = rotation;
+	l_meta.interlaced = interlaced;
+	l_meta.padding = padding;
+	l_meta.bit_depth = bit_depth;
+
+	l_meta.codec_id = av_stream_video->codecpar->codec_id;
+	l_meta.source_format = av_stream_video->codecpar->format;
+	l_meta.decoder_format = av_codec_ctx_video->pix_fmt;
+	l_meta.color_profile = color_profile;
+	l_meta.full_color_range = full_color_range;
+	l_meta.hw_decoding = hw_decoding;
+	l_meta.using_sws = using_sws;
+	l_meta.pixel_format = String(pixel_format.c_str());
+
+	l_meta.framerate = framerate;
+	l_meta.duration = duration;
+	l_meta.frame_count = frame_count;
+
+	const Ref<Image> l_planes[4] = { y_data, u_data, v_data, a_data };
+	for (int i = 0; i < 4; i++) {
+		if (l_planes[i].is_null())
+			continue;
+
+		l_meta.plane_width[i] = l_planes[i]->get_width();
+		l_meta.plane_height[i] = l_planes[i]->get_height();
+		l_meta.plane_format[i] = l_planes[i]->get_format();
+	}
+
+	if (!l_meta.save(String::utf8(cache_dir.c_str()), l_path, packet_index))
+		UtilityFunctions::printerr("Couldn't write video cache file!");
+}
+
 void Video::close() {
 	_print_debug("Closing video file on path: " + path);
+	_stop_prefetch();
 	loaded = false;
 
+	for (AVFrame *l_frame : ring_frames)
+		av_frame_free(&l_frame);
+	ring_frames.clear();
+	frame_cache.clear();
+	packet_index.clear();
+
 	if (av_frame) av_frame_free(&av_frame);
 	if (av_hw_frame) av_frame_free(&av_hw_frame);
+	if (shown_frame) av_frame_free(&shown_frame);
 	if (av_packet) av_packet_free(&av_packet);
 
 	if (av_codec_ctx_video) avcodec_free_context(&av_codec_ctx_video);
-	if (av_format_ctx) avformat_close_input(&av_format_ctx);
+	if (av_format_ctx) AvioFile::close_input(&av_format_ctx);
 
 	if (sws_ctx) sws_freeContext(sws_ctx);
+	frame_pool.clear();
+	rgba_data.unref();
+	audio.unref();
+	audio_stream.unref();
 
+	sws_ctx = nullptr;
 	av_frame = nullptr;
 	av_packet = nullptr;
-	hw_device_ctx = nullptr;
+	av_buffer_unref(&hw_device_ctx);
 
 	av_codec_ctx_video = nullptr;
 	av_format_ctx = nullptr;
+	av_stream_video = nullptr;
+
+	// State of the last opened file, so a reused Video doesn't report it
+	using_proxy = false;
+	using_sws = false;
+	opened_from_cache = false;
+	current_frame = 0;
+	decoder_frame = -1;
+	prefetch_underruns = 0;
 }
 
 int Video::seek_frame(int a_frame_nr) {
 	if (!loaded)
 		return GoZenError::ERR_NOT_OPEN_VIDEO;
 
+	// The decode thread owns the codec, so it has to stop before we seek.
+	// It gets restarted by the next call of next_frame().
+	_stop_prefetch();
+	current_frame = a_frame_nr;
+
+	if (const AVFrame *l_cached = frame_cache.get(a_frame_nr)) {
+		_show_frame(l_cached);
+		return OK;
+	}
+
+	return _seek_and_decode(a_frame_nr);
+}
+
+int Video::_seek_and_decode(int a_frame_nr) {
 	// Video seeking
 	if ((response = _seek_frame(a_frame_nr)) < 0)
 		return GoZenError::ERR_SEEKING;
@@ -340,15 +882,18 @@ int Video::seek_frame(int a_frame_nr) {
 			continue;
 
 		// Skip to actual requested frame
-		if ((int64_t)(current_pts * stream_time_base_video) / 10000 >=
-			frame_timestamp / 10000) {
+		if (!packet_index.is_empty() ? current_pts >= target_pts :
+				(int64_t)(current_pts * stream_time_base_video) / 10000 >= frame_timestamp / 10000) {
 			_copy_frame_data();
+			if (!preview_quality) // Only exact frames get cached
+				frame_cache.insert(current_frame, shown_frame);
 			break;
 		}
 	}
 
 	av_frame_unref(av_frame);
 	av_packet_unref(av_packet);
+	decoder_frame = current_frame;
 
 	return OK;
 }
@@ -357,54 +902,545 @@ bool Video::next_frame(bool a_skip) {
 	if (!loaded)
 		return false;
 
-	FFmpeg::get_frame(av_format_ctx, av_codec_ctx_video, av_stream_video->index, av_frame, av_packet);
+	current_frame++;
+	if (!prefetching) {
+		// Only look at the cache when the decoder isn't at the previous frame,
+		// like after seeking or cache hits. Sequential playback decodes anyway.
+		if (decoder_frame != current_frame - 1) {
+			if (const AVFrame *l_cached = frame_cache.get(current_frame)) {
+				if (!a_skip)
+					_show_frame(l_cached);
+				return true;
+			}
 
-	if (!a_skip)
-		_copy_frame_data();
+			return _seek_and_decode(current_frame) == OK;
+		}
 
-	av_frame_unref(av_frame);
-	av_packet_unref(av_packet);
+		_start_prefetch(); // Only starts when prefetch_frames is set
+	}
+
+	if (prefetching) {
+		if (!_next_prefetched_frame(a_skip))
+			return false;
+	} else {
+		FFmpeg::get_frame(av_format_ctx, av_codec_ctx_video, av_stream_video->index, av_frame, av_packet);
+
+		if (!a_skip)
+			_copy_frame_data();
+
+		av_frame_unref(av_frame);
+		av_packet_unref(av_packet);
+	}
+
+	decoder_frame = current_frame;
+	if (!a_skip && !preview_quality)
+		frame_cache.insert(current_frame, shown_frame);
 	
 	return true;
 }
 
 void Video::_copy_frame_data() {
-	if (hw_decoding && av_frame->format == hw_pix_fmt) {
-		if (av_hwframe_transfer_data(av_hw_frame, av_frame, 0) < 0) {
-			UtilityFunctions::printerr("Error transferring the frame to system memory!");
+	if ((hw_decoding && av_frame->format == hw_pix_fmt) || using_sws) {
+		if (_convert_frame(av_frame, av_hw_frame))
 			return;
-		} else if (av_hw_frame->data[0] == nullptr) {
+
+		_show_frame(av_hw_frame);
+		av_frame_unref(av_hw_frame);
+	} else if (av_frame->data[0] == nullptr)
+		_printerr_debug("Frame is empty!");
+	else
+		_show_frame(av_frame);
+}
+
+void Video::_show_frame(const AVFrame *a_frame) {
+	// Keeping a reference around for get_video_frame() and the frame cache
+	av_frame_unref(shown_frame);
+	if (av_frame_ref(shown_frame, a_frame) < 0)
+		_printerr_debug("Couldn't reference shown frame!");
+
+	// The SIMD conversion only handles the 8 bit 4:2:0 layouts
+	bool l_rgba = output_rgba && (a_frame->format == AV_PIX_FMT_YUV420P || a_frame->format == AV_PIX_FMT_YUVJ420P ||
+			a_frame->format == AV_PIX_FMT_YUVA420P || a_frame->format == AV_PIX_FMT_NV12);
+
+	if (copy_frame_data && l_rgba)
+		_copy_rgba(a_frame);
+	else if (copy_frame_data)
+		_copy_planes(a_frame);
+}
+
+void Video::_copy_planes(const AVFrame *a_frame) {
+	// Images are linesize wide, so every plane is a single copy
+	Ref<Image> l_planes[4] = { y_data, u_data, v_data, a_data };
+	for (int i = 0; i < 4; i++) {
+		if (l_planes[i].is_null())
+			continue;
+
+		memcpy(l_planes[i]->ptrw(), a_frame->data[i], plane_sizes[i]);
+	}
+}
+
+void Video::_copy_rgba(const AVFrame *a_frame) {
+	if (rgba_data.is_null() || rgba_data->get_width() != a_frame->width || rgba_data->get_height() != a_frame->height) {
+		rgba_data = Image::create_empty(a_frame->width, a_frame->height, false, Image::FORMAT_RGBA8);
+
+		// Same matrix choice as the addon makes for the shaders
+		switch (color_profile) {
+			case AVCOL_PRI_BT470M:
+			case AVCOL_PRI_BT470BG:
+			case AVCOL_PRI_SMPTE170M:
+			case AVCOL_PRI_SMPTE240M:
+				color_converter.set_matrix(ColorConverter::MATRIX_BT601, full_color_range);
+				break;
+			case AVCOL_PRI_BT2020:
+				color_converter.set_matrix(ColorConverter::MATRIX_BT2020, full_color_range);
+				break;
+			default:
+				color_converter.set_matrix(ColorConverter::MATRIX_BT709, full_color_range);
+		}
+	}
+
+	if (a_frame->format == AV_PIX_FMT_NV12)
+		color_converter.convert(a_frame->data[0], a_frame->linesize[0], a_frame->data[1], nullptr, a_frame->linesize[1],
+				rgba_data->ptrw(), a_frame->width * 4, a_frame->width, a_frame->height);
+	else
+		color_converter.convert(a_frame->data[0], a_frame->linesize[0], a_frame->data[1], a_frame->data[2], a_frame->linesize[1],
+				rgba_data->ptrw(), a_frame->width * 4, a_frame->width, a_frame->height);
+}
+
+Dictionary Video::benchmark_rgba(int a_width, int a_height, int a_iterations) {
+	Dictionary l_result = Dictionary();
+	a_width = std::max(a_width & ~1, 2);
+	a_height = std::max(a_height & ~1, 2);
+	a_iterations = std::max(a_iterations, 1);
+
+	AVFrame *l_src = av_frame_alloc();
+	AVFrame *l_dst = av_frame_alloc();
+	l_src->format = AV_PIX_FMT_YUV420P;
+	l_src->width = a_width;
+	l_src->height = a_height;
+	l_dst->format = AV_PIX_FMT_RGBA;
+	l_dst->width = a_width;
+	l_dst->height = a_height;
+
+	if (av_frame_get_buffer(l_src, 0) < 0 || av_frame_get_buffer(l_dst, 0) < 0) {
+		UtilityFunctions::printerr("Couldn't allocate frames for benchmark!");
+		av_frame_free(&l_src);
+		av_frame_free(&l_dst);
+		return l_result;
+	}
+
+	// Gradients so the data isn't all the same
+	for (int y = 0; y < a_height; y++)
+		for (int x = 0; x < a_width; x++)
+			l_src->data[0][y * l_src->linesize[0] + x] = (x + y) & 0xFF;
+	for (int y = 0; y < a_height / 2; y++)
+		for (int x = 0; x < a_width / 2; x++) {
+			l_src->data[1][y * l_src->linesize[1] + x] = x & 0xFF;
+			l_src->data[2][y * l_src->linesize[2] + x] = y & 0xFF;
+		}
+
+	ColorConverter l_converter;
+	ColorConverter::Path l_paths[2] = { ColorConverter::PATH_AUTO, ColorConverter::PATH_SCALAR };
+	const char *l_names[2] = { "simd_usec", "scalar_usec" };
+
+	for (int i = 0; i < 2; i++) {
+		l_converter.set_path(l_paths[i]);
+
+		uint64_t l_start = Time::get_singleton()->get_ticks_usec();
+		for (int j = 0; j < a_iterations; j++)
+			l_converter.convert(l_src->data[0], l_src->linesize[0], l_src->data[1], l_src->data[2], l_src->linesize[1],
+					l_dst->data[0], l_dst->linesize[0], a_width, a_height);
+		l_result[l_names[i]] = static_cast<double>(Time::get_singleton()->get_ticks_usec() - l_start) / a_iterations;
+	}
+
+	struct SwsContext *l_sws_ctx = sws_getContext(
+			a_width, a_height, AV_PIX_FMT_YUV420P,
+			a_width, a_height, AV_PIX_FMT_RGBA,
+			SWS_BILINEAR, NULL, NULL, NULL);
+	if (l_sws_ctx) {
+		uint64_t l_start = Time::get_singleton()->get_ticks_usec();
+		for (int j = 0; j < a_iterations; j++)
+			sws_scale(l_sws_ctx, l_src->data, l_src->linesize, 0, a_height, l_dst->data, l_dst->linesize);
+		l_result["sws_usec"] = static_cast<double>(Time::get_singleton()->get_ticks_usec() - l_start) / a_iterations;
+		sws_freeContext(l_sws_ctx);
+	} else UtilityFunctions::printerr("Couldn't create SWS context for benchmark!");
+
+	l_result["path"] = ColorConverter::get_path_name(ColorConverter::get_best_path());
+	l_result["width"] = a_width;
+	l_result["height"] = a_height;
+	l_result["iterations"] = a_iterations;
+
+	av_frame_free(&l_src);
+	av_frame_free(&l_dst);
+	return l_result;
+}
+
+Dictionary Video::benchmark_file(String a_path, int a_seeks, int a_copies) {
+	Dictionary l_result = Dictionary();
+	a_seeks = std::max(a_seeks, 1);
+	a_copies = std::max(a_copies, 1);
+
+	Ref<Video> l_video = memnew(Video);
+	uint64_t l_start = Time::get_singleton()->get_ticks_usec();
+	int l_response = l_video->open(a_path, false);
+	if (l_response) {
+		UtilityFunctions::printerr("Couldn't open file for benchmark!");
+		l_result["error"] = l_response;
+		return l_result;
+	}
+	l_result["open_usec"] = static_cast<int64_t>(Time::get_singleton()->get_ticks_usec() - l_start);
+
+	int64_t l_frame_count = l_video->frame_count;
+	l_result["frame_count"] = l_frame_count;
+	l_result["resolution"] = l_video->resolution;
+	l_result["pixel_format"] = l_video->get_pixel_format();
+
+	// Sequential decoding, first only decoding and then with copying into
+	// the planes. The frame cache is off by default, so nothing gets reused.
+	const char *l_fps_names[2] = { "decode_fps", "next_frame_fps" };
+	for (int i = 0; i < 2; i++) {
+		l_video->set_copy_frame_data(i == 1);
+		l_video->seek_frame(0);
+
+		l_start = Time::get_singleton()->get_ticks_usec();
+		for (int64_t j = 1; j < l_frame_count; j++)
+			l_video->next_frame();
+		double l_seconds = static_cast<double>(Time::get_singleton()->get_ticks_usec() - l_start) / 1000000.0;
+		l_result[l_fps_names[i]] = l_seconds > 0 ? (l_frame_count - 1) / l_seconds : 0.0;
+	}
+
+	// Random seeking with a fixed seed so runs can be compared
+	std::mt19937 l_random(1234);
+	std::uniform_int_distribution<int64_t> l_distribution(0, std::max<int64_t>(l_frame_count - 1, 0));
+	std::vector<double> l_latencies(a_seeks);
+
+	for (int i = 0; i < a_seeks; i++) {
+		int64_t l_frame_nr = l_distribution(l_random);
+		l_start = Time::get_singleton()->get_ticks_usec();
+		l_video->seek_frame(l_frame_nr);
+		l_latencies[i] = static_cast<double>(Time::get_singleton()->get_ticks_usec() - l_start);
+	}
+	std::sort(l_latencies.begin(), l_latencies.end());
+
+	l_result["seek_p50_usec"] = l_latencies[(a_seeks - 1) * 50 / 100];
+	l_result["seek_p90_usec"] = l_latencies[(a_seeks - 1) * 90 / 100];
+	l_result["seek_p99_usec"] = l_latencies[(a_seeks - 1) * 99 / 100];
+	l_result["seek_max_usec"] = l_latencies.back();
+	l_result["seeks"] = a_seeks;
+
+	// Copying the last shown frame again, av_frame holds the reference
+	// _copy_frame_data() takes its data from
+	int64_t l_bytes = 0;
+	for (int i = 0; i < 4; i++)
+		l_bytes += l_video->plane_sizes[i];
+
+	if (l_video->shown_frame->buf[0] && av_frame_ref(l_video->av_frame, l_video->shown_frame) >= 0) {
+		l_start = Time::get_singleton()->get_ticks_usec();
+		for (int i = 0; i < a_copies; i++)
+			l_video->_copy_frame_data();
+		double l_usec = static_cast<double>(Time::get_singleton()->get_ticks_usec() - l_start) / a_copies;
+		av_frame_unref(l_video->av_frame);
+
+		l_result["copy_usec"] = l_usec;
+		l_result["copy_mb_per_sec"] = l_usec > 0 ? l_bytes / l_usec : 0.0;
+	} else UtilityFunctions::printerr("No frame to copy for benchmark!");
+
+	l_result["copy_bytes"] = l_bytes;
+	l_result["copies"] = a_copies;
+
+	l_video->close();
+	return l_result;
+}
+
+int Video::_convert_frame(AVFrame *a_src, AVFrame *a_dst) {
+	// Brings a decoded frame into the plane layout of y_data/u_data/v_data.
+	if (hw_decoding && a_src->format == hw_pix_fmt) {
+		if (av_hwframe_transfer_data(a_dst, a_src, 0) < 0) {
+			UtilityFunctions::printerr("Error transferring the frame to system memory!");
+			return GoZenError::ERR_GET_FRAME_BUFFER;
+		} else if (a_dst->data[0] == nullptr) {
 			_printerr_debug("Frame is empty!");
-			return;
+			return GoZenError::ERR_GET_FRAME_BUFFER;
 		}
+	} else if (a_src->data[0] == nullptr) {
+		_printerr_debug("Frame is empty!");
+		return GoZenError::ERR_GET_FRAME_BUFFER;
+	} else if (using_sws) {
+		if (sws_scale_frame(sws_ctx, a_dst, a_src) < 0)
+			return GoZenError::ERR_SCALING_FAILED;
+	} else
+		return av_frame_ref(a_dst, a_src) < 0 ? GoZenError::ERR_GET_FRAME_BUFFER : OK;
+
+	av_frame_copy_props(a_dst, a_src);
+	return OK;
+}
 
-		memcpy(y_data->ptrw(), av_hw_frame->data[0], y_data->get_size().x*y_data->get_size().y);
-		memcpy(u_data->ptrw(), av_hw_frame->data[1], u_data->get_size().x*u_data->get_size().y*2);
+Ref<VideoFrame> Video::get_video_frame() {
+	if (!loaded || !shown_frame->buf[0])
+		return Ref<VideoFrame>();
 
-		av_frame_unref(av_hw_frame);
+	Ref<VideoFrame> l_frame = VideoFrame::create(shown_frame, current_frame, get_frame_pts(current_frame));
+	if (l_frame.is_valid()) {
+		l_frame->set_plane_layout(0, y_data);
+		l_frame->set_plane_layout(1, u_data);
+		l_frame->set_plane_layout(2, v_data);
+		l_frame->set_plane_layout(3, a_data);
+	}
+
+	return l_frame;
+}
+
+TypedArray<Image> Video::get_thumbnails(int a_count, int a_max_width) {
+	TypedArray<Image> l_thumbnails = TypedArray<Image>();
+
+	if (!loaded || a_count <= 0 || a_max_width <= 0 || frame_count <= 0)
+		return l_thumbnails;
+
+	// Evenly spread targets, taking the middle frame of each part
+	std::vector<int64_t> l_targets;
+	for (int i = 0; i < a_count; i++) {
+		int64_t l_frame_nr = (frame_count * (2 * i + 1)) / (2 * a_count);
+
+		if (!packet_index.is_empty())
+			l_targets.push_back(packet_index.get_frame_pts(l_frame_nr));
+		else {
+			int64_t l_start = av_stream_video->start_time != AV_NOPTS_VALUE ? av_stream_video->start_time : 0;
+			l_targets.push_back(l_start + av_rescale_q(l_frame_nr / framerate * AV_TIME_BASE, AV_TIME_BASE_Q, av_stream_video->time_base));
+		}
+	}
+
+	Vector2i l_size = Vector2i(std::min(a_max_width, resolution.x), 0);
+	l_size.y = std::max(1, static_cast<int>(std::round(static_cast<double>(l_size.x) * resolution.y / resolution.x)));
+
+	// Every worker has its own format and codec context for the same file.
+	// With a proxy, path and av_stream_video both belong to the proxy, and
+	// so do the targets. Workers only fill RGB buffers, the Images get
+	// created here since workers can't create Godot variants safely.
+	std::vector<std::vector<uint8_t>> l_buffers(a_count);
+	std::atomic<int> l_next = 0;
+	int l_worker_count = std::clamp(OS::get_singleton()->get_processor_count() - 1, 1, a_count);
+
+	std::vector<std::thread> l_workers;
+	for (int i = 0; i < l_worker_count; i++)
+		l_workers.emplace_back(_thumbnail_worker, path, av_stream_video->index, std::cref(l_targets), l_size, std::ref(l_buffers), std::ref(l_next));
+	for (std::thread &l_worker : l_workers)
+		l_worker.join();
+
+	for (const std::vector<uint8_t> &l_buffer : l_buffers) {
+		if (l_buffer.empty()) {
+			l_thumbnails.append(Ref<Image>());
+			continue;
+		}
+
+		PackedByteArray l_data;
+		l_data.resize(l_buffer.size());
+		memcpy(l_data.ptrw(), l_buffer.data(), l_buffer.size());
+		l_thumbnails.append(Image::create_from_data(l_size.x, l_size.y, false, Image::FORMAT_RGB8, l_data));
+	}
+
+	return l_thumbnails;
+}
+
+void Video::_thumbnail_worker(std::string a_path, int a_stream_index, const std::vector<int64_t> &a_targets, Vector2i a_size, std::vector<std::vector<uint8_t>> &a_buffers, std::atomic<int> &a_next) {
+	AVFormatContext *l_format_ctx = nullptr;
+	AVCodecContext *l_codec_ctx = nullptr;
+	struct SwsContext *l_sws_ctx = nullptr;
+	AVFrame *l_frame = av_frame_alloc();
+	AVPacket *l_packet = av_packet_alloc();
+	const AVCodec *l_codec = nullptr;
+	AVStream *l_stream = nullptr;
+	int l_response = 0;
+
+	if (!l_frame || !l_packet) {
+		UtilityFunctions::printerr("Couldn't allocate frame or packet for thumbnails!");
+		goto cleanup;
+	} else if (AvioFile::open_input(&l_format_ctx, a_path.c_str(), NULL) || avformat_find_stream_info(l_format_ctx, NULL)) {
+		UtilityFunctions::printerr("Couldn't open file for thumbnails!");
+		goto cleanup;
+	}
+
+	if (a_stream_index >= static_cast<int>(l_format_ctx->nb_streams) ||
+			l_format_ctx->streams[a_stream_index]->codecpar->codec_type != AVMEDIA_TYPE_VIDEO) {
+		UtilityFunctions::printerr("Video stream for thumbnails not found!");
+		goto cleanup;
+	}
+
+	l_stream = l_format_ctx->streams[a_stream_index];
+	for (unsigned int i = 0; i < l_format_ctx->nb_streams; i++)
+		if (i != static_cast<unsigned int>(a_stream_index))
+			l_format_ctx->streams[i]->discard = AVDISCARD_ALL;
+
+	if (!(l_codec = avcodec_find_decoder(l_stream->codecpar->codec_id)) ||
+			!(l_codec_ctx = avcodec_alloc_context3(l_codec)) ||
+			avcodec_parameters_to_context(l_codec_ctx, l_stream->codecpar)) {
+		UtilityFunctions::printerr("Couldn't create decoder for thumbnails!");
+		goto cleanup;
+	}
+
+	// Workers run in parallel already, and only keyframes are needed
+	l_codec_ctx->thread_count = 1;
+	l_codec_ctx->skip_frame = AVDISCARD_NONKEY;
+
+	if (avcodec_open2(l_codec_ctx, l_codec, NULL)) {
+		UtilityFunctions::printerr("Couldn't open decoder for thumbnails!");
+		goto cleanup;
+	}
+
+	for (int i = a_next++; i < static_cast<int>(a_targets.size()); i = a_next++) {
+		avcodec_flush_buffers(l_codec_ctx);
+		if ((l_response = av_seek_frame(l_format_ctx, a_stream_index, a_targets[i], AVSEEK_FLAG_BACKWARD)) < 0) {
+			FFmpeg::print_av_error("Seeking for thumbnail failed!", l_response);
+			continue;
+		}
+
+		if ((l_response = FFmpeg::get_frame(l_format_ctx, l_codec_ctx, a_stream_index, l_frame, l_packet))) {
+			FFmpeg::print_av_error("Decoding thumbnail failed!", l_response);
+			continue;
+		}
+
+		l_sws_ctx = sws_getCachedContext(l_sws_ctx,
+				l_frame->width, l_frame->height, static_cast<AVPixelFormat>(l_frame->format),
+				a_size.x, a_size.y, AV_PIX_FMT_RGB24,
+				SWS_BILINEAR, NULL, NULL, NULL);
+		if (!l_sws_ctx) {
+			UtilityFunctions::printerr("Couldn't create SWS context for thumbnails!");
+			av_frame_unref(l_frame);
+			break;
+		}
+
+		std::vector<uint8_t> &l_buffer = a_buffers[i];
+		l_buffer.resize(static_cast<size_t>(a_size.x) * a_size.y * 3);
+		uint8_t *l_dst[4] = { l_buffer.data(), nullptr, nullptr, nullptr };
+		int l_dst_linesize[4] = { a_size.x * 3, 0, 0, 0 };
+
+		sws_scale(l_sws_ctx, l_frame->data, l_frame->linesize, 0, l_frame->height, l_dst, l_dst_linesize);
+
+		av_frame_unref(l_frame);
+		av_packet_unref(l_packet);
+	}
+
+cleanup:
+	if (l_sws_ctx) sws_freeContext(l_sws_ctx);
+	if (l_codec_ctx) avcodec_free_context(&l_codec_ctx);
+	if (l_format_ctx) AvioFile::close_input(&l_format_ctx);
+	if (l_frame) av_frame_free(&l_frame);
+	if (l_packet) av_packet_free(&l_packet);
+}
+
+void Video::set_prefetch_frames(int a_value) {
+	_stop_prefetch();
+
+	for (AVFrame *l_frame : ring_frames)
+		av_frame_free(&l_frame);
+	ring_frames.clear();
+
+	prefetch_frames = a_value > 0 ? a_value : 0;
+	prefetch_underruns = 0;
+}
+
+void Video::_start_prefetch() {
+	if (!loaded || prefetching || prefetch_frames <= 0)
 		return;
-	} else {
-		if (av_frame->data[0] == nullptr) {
-			_printerr_debug("Frame is empty!");
+
+	while (ring_frames.size() < static_cast<size_t>(prefetch_frames)) {
+		AVFrame *l_frame = av_frame_alloc();
+		if (!l_frame) {
+			UtilityFunctions::printerr("Couldn't allocate frame for prefetch ring!");
 			return;
 		}
+		ring_frames.push_back(l_frame);
+	}
 
-		if (using_sws) {
-			sws_scale_frame(sws_ctx, av_hw_frame, av_frame);
+	ring_read = 0;
+	ring_write = 0;
+	prefetch_stop = false;
+	prefetch_eof = false;
 
-			memcpy(y_data->ptrw(), av_hw_frame->data[0], y_data->get_size().x*y_data->get_size().y);
-			memcpy(u_data->ptrw(), av_hw_frame->data[1], u_data->get_size().x*u_data->get_size().y);
-			memcpy(v_data->ptrw(), av_hw_frame->data[2], v_data->get_size().x*v_data->get_size().y);
+	prefetch_thread = std::thread(&Video::_prefetch_loop, this);
+	prefetching = true;
+}
 
-			av_frame_unref(av_hw_frame);
-		} else {
-			memcpy(y_data->ptrw(), av_frame->data[0], y_data->get_size().x*y_data->get_size().y);
-			memcpy(u_data->ptrw(), av_frame->data[1], u_data->get_size().x*u_data->get_size().y);
-			memcpy(v_data->ptrw(), av_frame->data[2], v_data->get_size().x*v_data->get_size().y);
+int Video::_stop_prefetch() {
+	if (!prefetching)
+		return 0;
+
+	prefetch_stop = true;
+	prefetch_thread.join();
+	prefetching = false;
+
+	// Frames still in the ring are lost, so the decoder is ahead of the caller
+	int l_dropped = static_cast<int>(ring_write - ring_read);
+	if (l_dropped > 0)
+		decoder_frame = -1;
+
+	for (AVFrame *l_frame : ring_frames)
+		av_frame_unref(l_frame);
+
+	ring_read = 0;
+	ring_write = 0;
+
+	return l_dropped;
+}
+
+void Video::_prefetch_loop() {
+	AVFrame *l_frame = av_frame_alloc();
+	uint64_t l_size = ring_frames.size();
+	int l_response = 0;
+
+	while (!prefetch_stop.load(std::memory_order_relaxed)) {
+		uint64_t l_write = ring_write.load(std::memory_order_relaxed);
+
+		if (l_write - ring_read.load(std::memory_order_acquire) >= l_size) {
+			std::this_thread::sleep_for(std::chrono::microseconds(500));
+			continue;
 		}
 
-		return;
+		if ((l_response = FFmpeg::get_frame(av_format_ctx, av_codec_ctx_video, av_stream_video->index, l_frame, av_packet))) {
+			if (l_response != AVERROR_EOF)
+				FFmpeg::print_av_error("Problem happened getting frame in prefetch thread!", l_response);
+			break;
+		}
+
+		AVFrame *l_slot = ring_frames[l_write % l_size];
+		av_frame_unref(l_slot);
+
+		l_response = _convert_frame(l_frame, l_slot);
+		av_frame_unref(l_frame);
+
+		if (l_response == OK)
+			ring_write.store(l_write + 1, std::memory_order_release);
+	}
+
+	av_packet_unref(av_packet);
+	av_frame_free(&l_frame);
+	prefetch_eof.store(true, std::memory_order_release);
+}
+
+bool Video::_next_prefetched_frame(bool a_skip) {
+	uint64_t l_read = ring_read.load(std::memory_order_relaxed);
+
+	if (ring_write.load(std::memory_order_acquire) == l_read) {
+		// The ring starts empty after every (re)start, like after seeking, so
+		// only waits after the first delivered frame count as underruns
+		if (l_read > 0)
+			prefetch_underruns++;
+
+		while (ring_write.load(std::memory_order_acquire) == l_read) {
+			// The last frame is written before the eof flag gets set
+			if (prefetch_eof.load(std::memory_order_acquire) && ring_write.load(std::memory_order_acquire) == l_read)
+				return false;
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
 	}
+
+	AVFrame *l_frame = ring_frames[l_read % ring_frames.size()];
+	if (!a_skip)
+		_show_frame(l_frame);
+
+	av_frame_unref(l_frame);
+	ring_read.store(l_read + 1, std::memory_order_release);
+
+	return true;
 }
 
 const AVCodec *Video::_get_hw_codec() {
@@ -454,9 +1490,43 @@ const AVCodec *Video::_get_hw_codec() {
 }
  
 
+int Video::seek_time(double a_time) {
+	if (!loaded)
+		return GoZenError::ERR_NOT_OPEN_VIDEO;
+	else if (packet_index.is_empty())
+		return seek_frame(static_cast<int>(a_time * framerate));
+
+	int64_t l_pts = packet_index.get_frame_pts(0) + std::llround(a_time / av_q2d(av_stream_video->time_base));
+	return seek_frame(packet_index.find_frame(l_pts));
+}
+
+double Video::get_frame_pts(int a_frame_nr) {
+	if (!loaded)
+		return -1;
+	else if (packet_index.is_empty())
+		return a_frame_nr / framerate;
+
+	int64_t l_pts = packet_index.get_frame_pts(a_frame_nr);
+	if (l_pts == AV_NOPTS_VALUE)
+		return -1;
+
+	return (l_pts - packet_index.get_frame_pts(0)) * av_q2d(av_stream_video->time_base);
+}
+
 int Video::_seek_frame(int a_frame_nr) {
 	avcodec_flush_buffers(av_codec_ctx_video);
 
+	if (!packet_index.is_empty()) {
+		// Going straight to the keyframe from which the frame can be decoded
+		a_frame_nr = std::clamp<int64_t>(a_frame_nr, 0, packet_index.get_frame_count() - 1);
+		target_pts = packet_index.get_frame_pts(a_frame_nr);
+
+		int64_t l_keyframe = packet_index.get_keyframe_packet(a_frame_nr);
+		if (packet_index.get_packet_dts(l_keyframe) != AV_NOPTS_VALUE)
+			return av_seek_frame(av_format_ctx, av_stream_video->index, packet_index.get_packet_dts(l_keyframe), AVSEEK_FLAG_BACKWARD);
+		return av_seek_frame(av_format_ctx, av_stream_video->index, packet_index.get_packet_pos(l_keyframe), AVSEEK_FLAG_BYTE);
+	}
+
 	frame_timestamp = (int64_t)(a_frame_nr * average_frame_duration);
 	return av_seek_frame(av_format_ctx, -1, (start_time_video + frame_timestamp) / 10, AVSEEK_FLAG_BACKWARD | AVSEEK_FLAG_FRAME);
 }
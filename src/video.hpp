@@ -1,7 +1,13 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <cmath>
+#include <random>
+#include <thread>
+#include <vector>
 
 #include <godot_cpp/classes/audio_stream_wav.hpp>
 #include <godot_cpp/classes/control.hpp>
@@ -10,9 +16,19 @@
 #include <godot_cpp/classes/image_texture.hpp>
 #include <godot_cpp/classes/gd_extension_manager.hpp>
 #include <godot_cpp/variant/utility_functions.hpp>
+#include <godot_cpp/variant/typed_array.hpp>
 #include <godot_cpp/classes/rendering_server.hpp>
+#include <godot_cpp/classes/worker_thread_pool.hpp>
+#include <godot_cpp/variant/callable_method_pointer.hpp>
 
 #include "ffmpeg.hpp"
+#include "avio_file.hpp"
+#include "audio_stream_ffmpeg.hpp"
+#include "color_converter.hpp"
+#include "frame_cache.hpp"
+#include "packet_index.hpp"
+#include "video_frame.hpp"
+#include "video_meta.hpp"
 #include "gozen_error.hpp"
 
 
@@ -30,6 +46,7 @@ private:
 
 	AVFrame *av_frame = nullptr;
 	AVFrame *av_hw_frame = nullptr;
+	AVFrame *shown_frame = nullptr; // Reference to the converted frame of current_frame
 	AVPacket *av_packet = nullptr;
 
 	struct SwsContext *sws_ctx = nullptr;
@@ -41,16 +58,21 @@ private:
 	// Default variable types
 	int response = 0;
 	int padding = 0;
+	int bit_depth = 8; // Of the samples in y_data, u_data and v_data
 
 	int8_t rotation = 0;
 	int8_t interlaced = 0; // 0 = no interlacing, 1 = interlaced top first, 2 interlaced bottom first
 	
 	int64_t duration = 0;
 	int64_t frame_count = 0;
+	int64_t open_time = 0; // In usec
 
 	int64_t start_time_video = 0;
 	int64_t frame_timestamp = 0;
 	int64_t current_pts = 0;
+	int64_t target_pts = 0; // Pts of the frame we seek to when using the packet index
+	int64_t current_frame = 0;
+	int64_t decoder_frame = -1; // Last frame the decoder gave, -1 when unknown
 
 	double average_frame_duration = 0;
 	double stream_time_base_video = 0;
@@ -60,31 +82,120 @@ private:
 	bool loaded = false; // Is true after open()
 	bool hw_decoding = false; // Set by user
 	bool debug = false;
+	bool build_index = false; // Set by user
+	bool opened_from_cache = false;
 	bool using_sws = false; // This is set for when the pixel format is foreign and not directly supported by the addon
 	bool full_color_range = true;
-
-	std::string path = "";
+	bool copy_frame_data = true; // Copy frames into y_data, u_data and v_data
+	bool output_rgba = false; // Convert frames into rgba_data instead of the planes
+	bool preview_quality = false; // Faster but inexact decoding for scrubbing
+	bool using_proxy = false; // Is true when the frames come from proxy_path
+	bool stream_audio = true; // Set by user, false decodes the full track on open
+
+	std::string path = ""; // File we decode from, the proxy when using one
+	std::string source_path = ""; // Only set when using a proxy
+	std::string proxy_path = ""; // Set by user
 	std::string pixel_format = "";
 	std::string prefered_hw_decoder = "";
+	std::string cache_dir = ""; // Empty = no sidecar caching
 
 	// Godot classes
 	Vector2i resolution = Vector2i(0, 0);
+	Vector2i proxy_resolution = Vector2i(0, 0);
 
-	AudioStreamWAV *audio = nullptr;
+	Ref<AudioStreamWAV> audio; // Whole track, only when not streaming
+	Ref<AudioStreamFFmpeg> audio_stream;
 
 	Ref<Image> y_data;
 	Ref<Image> u_data;
 	Ref<Image> v_data;
+	Ref<Image> a_data; // Only for yuva420p
+	int64_t plane_sizes[4] = {}; // In bytes, set when the planes get created
+	Ref<Image> rgba_data;
+
+	ColorConverter color_converter;
+
+	// Prefetch ring, filled by the decode thread and emptied by next_frame()
+	std::thread prefetch_thread;
+	std::vector<AVFrame *> ring_frames;
+	std::atomic<uint64_t> ring_read = 0; // Only written by the caller thread
+	std::atomic<uint64_t> ring_write = 0; // Only written by the decode thread
+	std::atomic<bool> prefetch_stop = false;
+	std::atomic<bool> prefetch_eof = false;
+
+	int prefetch_frames = 0; // 0 = prefetching disabled
+	bool prefetching = false; // Is true while the decode thread is running
+	int64_t prefetch_underruns = 0;
+
+	FramePool frame_pool;
+	FrameCache frame_cache;
+	PacketIndex packet_index;
+
+	// Opening on the WorkerThreadPool
+	Ref<Video> async_self; // Keeps us alive while the task is running
+	int64_t open_task_id = -1;
+	std::atomic<bool> opening_async = false;
+	std::atomic<bool> cancel_requested = false; // Checked by FFmpeg through the interrupt callback
+	std::atomic<float> open_progress = 0.;
+
+
+	// Results of get_files_meta, workers can't create Godot variants safely
+	struct StreamInfo {
+		std::string type = "";
+		std::string codec = "";
+		Vector2i resolution = Vector2i(0, 0);
+		double framerate = 0.;
+		double duration = 0.;
+		int channels = 0;
+		int sample_rate = 0;
+	};
+	struct FileInfo {
+		int error = OK;
+		std::string format = "";
+		double duration = 0.;
+		int64_t bit_rate = 0;
+		std::vector<std::pair<std::string, std::string>> tags;
+		std::vector<StreamInfo> streams;
+	};
 
 
 	// Private functions
 	static enum AVPixelFormat _get_format(AVCodecContext *a_av_ctx, const enum AVPixelFormat *a_pix_fmt);
+	static int _get_buffer(AVCodecContext *a_av_ctx, AVFrame *a_frame, int a_flags);
 	const AVCodec *_get_hw_codec();
+
+	int _open(String a_path, bool a_load_audio, const VideoMeta *a_meta);
+	int _open_source(String a_path, bool a_load_audio);
+	static int _interrupt_callback(void *a_opaque);
+	void _set_open_progress(float a_value);
+	void _open_task(String a_path, bool a_load_audio);
+	void _open_task_done(int a_response);
+	static int _get_rotation(const AVStream *a_stream);
+	int _probe_video();
+	int _apply_meta(const VideoMeta &a_meta);
+	int _open_codec(const AVCodec *a_codec);
+	static bool _is_native_format(AVPixelFormat a_format);
+	void _create_planes(const AVFrame *a_frame);
+	void _save_meta();
 	
 	void _copy_frame_data();
+	void _show_frame(const AVFrame *a_frame);
+	void _copy_planes(const AVFrame *a_frame);
+	void _copy_rgba(const AVFrame *a_frame);
+	int _convert_frame(AVFrame *a_src, AVFrame *a_dst);
 	void _clean_frame_data();
 
+	static void _probe_worker(const std::vector<std::string> &a_paths, std::vector<FileInfo> &a_infos, std::atomic<int> &a_next, int64_t a_probe_size, int64_t a_analyze_duration);
+	static int _probe_file(const std::string &a_path, FileInfo &a_info, int64_t a_probe_size, int64_t a_analyze_duration);
+	static void _thumbnail_worker(std::string a_path, int a_stream_index, const std::vector<int64_t> &a_targets, Vector2i a_size, std::vector<std::vector<uint8_t>> &a_buffers, std::atomic<int> &a_next);
+
+	void _start_prefetch();
+	int _stop_prefetch();
+	void _prefetch_loop();
+	bool _next_prefetched_frame(bool a_skip);
+
 	int _seek_frame(int a_frame_nr);
+	int _seek_and_decode(int a_frame_nr);
 
 	void _print_debug(std::string a_text);
 	void _printerr_debug(std::string a_text);
@@ -94,19 +205,42 @@ public:
 	~Video() { close(); }
 
 	static Dictionary get_file_meta(String a_file_path);
+	static Dictionary get_files_meta(PackedStringArray a_file_paths, int64_t a_probe_size = 1000000, float a_analyze_duration = 1.0, int a_thread_count = 0);
 	static PackedStringArray get_available_hw_devices();
 
+	// res:// and user:// files get read through FileAccess (see AvioFile)
+	static inline void set_io_buffer_size(int a_value) { AvioFile::buffer_size = std::max(a_value, 4096); }
+	static inline int get_io_buffer_size() { return AvioFile::buffer_size; }
+	static inline void set_io_read_ahead(int a_value) { AvioFile::read_ahead = std::max(a_value, 4096); }
+	static inline int get_io_read_ahead() { return AvioFile::read_ahead; }
+
 	int open(String a_path = "", bool a_load_audio = true);
+	int open_async(String a_path = "", bool a_load_audio = true);
+	void cancel();
 	void close();
 
 	inline bool is_open() { return loaded; }
+	inline bool is_opening() { return open_task_id != -1; }
+	inline float get_open_progress() { return open_progress; }
 
 	int seek_frame(int a_frame_nr);
+	int seek_time(double a_time);
 	bool next_frame(bool a_skip = false);
 
-	inline Ref<AudioStreamWAV> get_audio() { return audio; };
+	double get_frame_pts(int a_frame_nr);
+
+	inline Ref<AudioStream> get_audio() {
+		if (stream_audio)
+			return audio_stream;
+		return audio; }
 
-	inline String get_path() { return path.c_str(); }
+	inline void set_stream_audio(bool a_value) {
+		if (loaded)
+			UtilityFunctions::printerr("Setting stream_audio after opening file has no effect!");
+		stream_audio = a_value; }
+	inline bool get_stream_audio() { return stream_audio; }
+
+	inline String get_path() { return using_proxy ? source_path.c_str() : path.c_str(); }
 
 	inline float get_framerate() { return framerate; }
 	inline int get_frame_count() { return frame_count; };
@@ -114,6 +248,8 @@ public:
 	inline int get_width() { return resolution.x; }
 	inline int get_height() { return resolution.y; }
 	inline int get_padding() { return padding; }
+	inline Vector2i get_frame_resolution() { return using_proxy ? proxy_resolution : resolution; }
+	inline int get_bit_depth() { return bit_depth; }
 	inline int get_rotation() { return rotation; }
 
 	inline void set_hw_decoding(bool a_value) {
@@ -122,6 +258,28 @@ public:
 		hw_decoding = a_value; }
 	inline bool get_hw_decoding() { return hw_decoding; }
 
+	inline void set_build_index(bool a_value) {
+		if (loaded)
+			UtilityFunctions::printerr("Setting build_index after opening file has no effect!");
+		build_index = a_value; }
+	inline bool get_build_index() { return build_index; }
+	inline bool has_index() { return !packet_index.is_empty(); }
+
+	inline void set_cache_dir(String a_value) {
+		if (loaded)
+			UtilityFunctions::printerr("Setting cache_dir after opening file has no effect!");
+		cache_dir = a_value.utf8(); }
+	inline String get_cache_dir() { return String::utf8(cache_dir.c_str()); }
+	inline bool is_opened_from_cache() { return opened_from_cache; }
+
+	inline void set_proxy_path(String a_value) {
+		if (loaded)
+			UtilityFunctions::printerr("Setting proxy_path after opening file has no effect!");
+		proxy_path = a_value.utf8(); }
+	inline String get_proxy_path() { return String::utf8(proxy_path.c_str()); }
+	inline bool is_using_proxy() { return using_proxy; }
+	inline int64_t get_open_time() { return open_time; }
+
 	inline void set_prefered_hw_decoder(String a_value) {
 		if (loaded)
 			UtilityFunctions::printerr("Setting prefered_hw_decoder after opening file has no effect!");
@@ -133,6 +291,7 @@ public:
 	inline bool get_debug_enabled() { return debug; }
 
 	inline String get_pixel_format() { return pixel_format.c_str(); }
+	inline bool is_using_sws() { return using_sws; }
 	inline String get_color_profile() { return av_color_primaries_name(color_profile); }
 
 	inline bool is_full_color_range() { return full_color_range; }
@@ -140,24 +299,85 @@ public:
 	inline Ref<Image> get_y_data() { return y_data; }
 	inline Ref<Image> get_u_data() { return u_data; }
 	inline Ref<Image> get_v_data() { return v_data; }
+	inline Ref<Image> get_a_data() { return a_data; }
+	inline Ref<Image> get_rgba_data() { return rgba_data; }
+
+	Ref<VideoFrame> get_video_frame();
+	TypedArray<Image> get_thumbnails(int a_count, int a_max_width);
+
+	inline void set_copy_frame_data(bool a_value) { copy_frame_data = a_value; }
+	inline bool get_copy_frame_data() { return copy_frame_data; }
+
+	inline void set_output_rgba(bool a_value) { output_rgba = a_value; }
+	inline bool get_output_rgba() { return output_rgba; }
+	void set_preview_quality(bool a_value);
+	inline bool get_preview_quality() { return preview_quality; }
+
+	static Dictionary benchmark_rgba(int a_width = 1920, int a_height = 1080, int a_iterations = 100);
+	static Dictionary benchmark_file(String a_path, int a_seeks = 100, int a_copies = 100);
+
+	void set_prefetch_frames(int a_value);
+	inline int get_prefetch_frames() { return prefetch_frames; }
+	inline int get_prefetch_depth() { return prefetching ? static_cast<int>(ring_write - ring_read) : 0; }
+	inline int64_t get_prefetch_underruns() { return prefetch_underruns; }
+
+	inline void set_frame_cache_size(int64_t a_bytes) { frame_cache.set_max_size(a_bytes > 0 ? a_bytes : 0); }
+	inline int64_t get_frame_cache_size() { return frame_cache.get_max_size(); }
+	inline int64_t get_frame_cache_usage() { return frame_cache.get_size(); }
+	inline int64_t get_frame_cache_hits() { return frame_cache.get_hits(); }
+	inline int64_t get_frame_cache_misses() { return frame_cache.get_misses(); }
+	inline int64_t get_frame_cache_evictions() { return frame_cache.get_evictions(); }
+	inline void clear_frame_cache() { frame_cache.clear(); }
 
 
 protected:
 	static inline void _bind_methods() {
 		ClassDB::bind_static_method("Video", D_METHOD("get_file_meta", "a_file_path"), &Video::get_file_meta);
+		ClassDB::bind_static_method("Video", D_METHOD("get_files_meta", "a_file_paths", "a_probe_size", "a_analyze_duration", "a_thread_count"), &Video::get_files_meta, DEFVAL(1000000), DEFVAL(1.0), DEFVAL(0));
 		ClassDB::bind_static_method("Video", D_METHOD("get_available_hw_devices"), &Video::get_available_hw_devices);
+		ClassDB::bind_static_method("Video", D_METHOD("set_io_buffer_size", "a_value"), &Video::set_io_buffer_size);
+		ClassDB::bind_static_method("Video", D_METHOD("get_io_buffer_size"), &Video::get_io_buffer_size);
+		ClassDB::bind_static_method("Video", D_METHOD("set_io_read_ahead", "a_value"), &Video::set_io_read_ahead);
+		ClassDB::bind_static_method("Video", D_METHOD("get_io_read_ahead"), &Video::get_io_read_ahead);
+		ClassDB::bind_static_method("Video", D_METHOD("benchmark_rgba", "a_width", "a_height", "a_iterations"), &Video::benchmark_rgba, DEFVAL(1920), DEFVAL(1080), DEFVAL(100));
+		ClassDB::bind_static_method("Video", D_METHOD("benchmark_file", "a_path", "a_seeks", "a_copies"), &Video::benchmark_file, DEFVAL(100), DEFVAL(100));
 
 		ClassDB::bind_method(D_METHOD("open", "a_path", "a_load_audio"), &Video::open, DEFVAL(""), DEFVAL(true));
 
+		ClassDB::bind_method(D_METHOD("open_async", "a_path", "a_load_audio"), &Video::open_async, DEFVAL(""), DEFVAL(true));
+		ClassDB::bind_method(D_METHOD("cancel"), &Video::cancel);
+
 		ClassDB::bind_method(D_METHOD("is_open"), &Video::is_open);
+		ClassDB::bind_method(D_METHOD("is_opening"), &Video::is_opening);
+		ClassDB::bind_method(D_METHOD("get_open_progress"), &Video::get_open_progress);
+
+		ADD_SIGNAL(MethodInfo("opened", PropertyInfo(Variant::INT, "error")));
+		ADD_SIGNAL(MethodInfo("open_progress", PropertyInfo(Variant::FLOAT, "progress")));
 
 		ClassDB::bind_method(D_METHOD("seek_frame", "a_frame_nr"), &Video::seek_frame);
+		ClassDB::bind_method(D_METHOD("seek_time", "a_time"), &Video::seek_time);
 		ClassDB::bind_method(D_METHOD("next_frame", "a_skip"), &Video::next_frame);
+		ClassDB::bind_method(D_METHOD("get_frame_pts", "a_frame_nr"), &Video::get_frame_pts);
 		ClassDB::bind_method(D_METHOD("get_audio"), &Video::get_audio);
+		ClassDB::bind_method(D_METHOD("set_stream_audio", "a_value"), &Video::set_stream_audio);
+		ClassDB::bind_method(D_METHOD("get_stream_audio"), &Video::get_stream_audio);
 
 		ClassDB::bind_method(D_METHOD("set_hw_decoding", "a_value"), &Video::set_hw_decoding);
 		ClassDB::bind_method(D_METHOD("get_hw_decoding"), &Video::get_hw_decoding);
 
+		ClassDB::bind_method(D_METHOD("set_build_index", "a_value"), &Video::set_build_index);
+		ClassDB::bind_method(D_METHOD("get_build_index"), &Video::get_build_index);
+		ClassDB::bind_method(D_METHOD("has_index"), &Video::has_index);
+
+		ClassDB::bind_method(D_METHOD("set_cache_dir", "a_dir"), &Video::set_cache_dir);
+		ClassDB::bind_method(D_METHOD("get_cache_dir"), &Video::get_cache_dir);
+		ClassDB::bind_method(D_METHOD("is_opened_from_cache"), &Video::is_opened_from_cache);
+
+		ClassDB::bind_method(D_METHOD("set_proxy_path", "a_path"), &Video::set_proxy_path);
+		ClassDB::bind_method(D_METHOD("get_proxy_path"), &Video::get_proxy_path);
+		ClassDB::bind_method(D_METHOD("is_using_proxy"), &Video::is_using_proxy);
+		ClassDB::bind_method(D_METHOD("get_open_time"), &Video::get_open_time);
+
 		ClassDB::bind_method(D_METHOD("set_prefered_hw_decoder", "a_codec"), &Video::set_prefered_hw_decoder);
 		ClassDB::bind_method(D_METHOD("get_prefered_hw_decoder"), &Video::get_prefered_hw_decoder);
 
@@ -169,6 +389,8 @@ protected:
 		ClassDB::bind_method(D_METHOD("get_width"), &Video::get_width);
 		ClassDB::bind_method(D_METHOD("get_height"), &Video::get_height);
 		ClassDB::bind_method(D_METHOD("get_padding"), &Video::get_padding);
+		ClassDB::bind_method(D_METHOD("get_frame_resolution"), &Video::get_frame_resolution);
+		ClassDB::bind_method(D_METHOD("get_bit_depth"), &Video::get_bit_depth);
 		ClassDB::bind_method(D_METHOD("get_rotation"), &Video::get_rotation);
 
 		ClassDB::bind_method(D_METHOD("get_frame_count"), &Video::get_frame_count);
@@ -178,6 +400,7 @@ protected:
 		ClassDB::bind_method(D_METHOD("get_debug_enabled"), &Video::get_debug_enabled);
 
 		ClassDB::bind_method(D_METHOD("get_pixel_format"), &Video::get_pixel_format);
+		ClassDB::bind_method(D_METHOD("is_using_sws"), &Video::is_using_sws);
 		ClassDB::bind_method(D_METHOD("get_color_profile"), &Video::get_color_profile);
 
 		ClassDB::bind_method(D_METHOD("is_full_color_range"), &Video::is_full_color_range);
@@ -185,5 +408,31 @@ protected:
 		ClassDB::bind_method(D_METHOD("get_y_data"), &Video::get_y_data);
 		ClassDB::bind_method(D_METHOD("get_u_data"), &Video::get_u_data);
 		ClassDB::bind_method(D_METHOD("get_v_data"), &Video::get_v_data);
+		ClassDB::bind_method(D_METHOD("get_a_data"), &Video::get_a_data);
+		ClassDB::bind_method(D_METHOD("get_rgba_data"), &Video::get_rgba_data);
+
+		ClassDB::bind_method(D_METHOD("get_video_frame"), &Video::get_video_frame);
+		ClassDB::bind_method(D_METHOD("get_thumbnails", "a_count", "a_max_width"), &Video::get_thumbnails);
+		ClassDB::bind_method(D_METHOD("set_copy_frame_data", "a_value"), &Video::set_copy_frame_data);
+		ClassDB::bind_method(D_METHOD("get_copy_frame_data"), &Video::get_copy_frame_data);
+
+		ClassDB::bind_method(D_METHOD("set_output_rgba", "a_value"), &Video::set_output_rgba);
+		ClassDB::bind_method(D_METHOD("get_output_rgba"), &Video::get_output_rgba);
+
+		ClassDB::bind_method(D_METHOD("set_preview_quality", "a_value"), &Video::set_preview_quality);
+		ClassDB::bind_method(D_METHOD("get_preview_quality"), &Video::get_preview_quality);
+
+		ClassDB::bind_method(D_METHOD("set_prefetch_frames", "a_value"), &Video::set_prefetch_frames);
+		ClassDB::bind_method(D_METHOD("get_prefetch_frames"), &Video::get_prefetch_frames);
+		ClassDB::bind_method(D_METHOD("get_prefetch_depth"), &Video::get_prefetch_depth);
+		ClassDB::bind_method(D_METHOD("get_prefetch_underruns"), &Video::get_prefetch_underruns);
+
+		ClassDB::bind_method(D_METHOD("set_frame_cache_size", "a_bytes"), &Video::set_frame_cache_size);
+		ClassDB::bind_method(D_METHOD("get_frame_cache_size"), &Video::get_frame_cache_size);
+		ClassDB::bind_method(D_METHOD("get_frame_cache_usage"), &Video::get_frame_cache_usage);
+		ClassDB::bind_method(D_METHOD("get_frame_cache_hits"), &Video::get_frame_cache_hits);
+		ClassDB::bind_method(D_METHOD("get_frame_cache_misses"), &Video::get_frame_cache_misses);
+		ClassDB::bind_method(D_METHOD("get_frame_cache_evictions"), &Video::get_frame_cache_evictions);
+		ClassDB::bind_method(D_METHOD("clear_frame_cache"), &Video::clear_frame_cache);
 	}
 };
@@ -0,0 +1,109 @@
+#include "video_frame.hpp"
+
+
+//----------------------------------------------- FRAME POOL
+int FramePool::get_buffer(AVCodecContext *a_codec_ctx, AVFrame *a_frame) {
+	AVPixelFormat l_format = static_cast<AVPixelFormat>(a_frame->format);
+	int l_width = a_frame->width;
+	int l_height = a_frame->height;
+	int l_align[AV_NUM_DATA_POINTERS];
+	int l_response = 0;
+
+	// Decoders need some room around the picture for motion vectors
+	avcodec_align_dimensions2(a_codec_ctx, &l_width, &l_height, l_align);
+
+	int l_linesize[4];
+	if ((l_response = av_image_fill_linesizes(l_linesize, l_format, l_width)) < 0)
+		return l_response;
+
+	ptrdiff_t l_linesizes[4];
+	for (int i = 0; i < 4; i++)
+		l_linesizes[i] = l_linesize[i] = (l_linesize[i] + 63) & ~63;
+
+	size_t l_sizes[4];
+	if ((l_response = av_image_fill_plane_sizes(l_sizes, l_format, l_height, l_linesizes)) < 0)
+		return l_response;
+
+	std::lock_guard<std::mutex> l_lock(mutex);
+
+	for (int i = 0; i < 4 && l_sizes[i]; i++) {
+		if (pool_sizes[i] != l_sizes[i]) { // Resolution or format changed
+			av_buffer_pool_uninit(&pools[i]);
+			pools[i] = av_buffer_pool_init(l_sizes[i] + 16 + 64 - 1, nullptr);
+			pool_sizes[i] = pools[i] ? l_sizes[i] : 0;
+		}
+
+		if (!pools[i] || !(a_frame->buf[i] = av_buffer_pool_get(pools[i]))) {
+			for (int j = 0; j < i; j++)
+				av_buffer_unref(&a_frame->buf[j]);
+			return AVERROR(ENOMEM);
+		}
+
+		a_frame->data[i] = a_frame->buf[i]->data;
+		a_frame->linesize[i] = l_linesize[i];
+	}
+
+	a_frame->extended_data = a_frame->data;
+	return 0;
+}
+
+void FramePool::clear() {
+	std::lock_guard<std::mutex> l_lock(mutex);
+
+	for (int i = 0; i < 4; i++) {
+		av_buffer_pool_uninit(&pools[i]);
+		pool_sizes[i] = 0;
+	}
+}
+
+
+//----------------------------------------------- VIDEO FRAME
+Ref<VideoFrame> VideoFrame::create(const AVFrame *a_frame, int64_t a_frame_nr, double a_pts) {
+	Ref<VideoFrame> l_frame = memnew(VideoFrame);
+
+	// Only takes a new reference, the frame data itself isn't copied
+	if (!(l_frame->av_frame = av_frame_clone(a_frame))) {
+		UtilityFunctions::printerr("Couldn't reference frame for VideoFrame!");
+		return Ref<VideoFrame>();
+	}
+
+	l_frame->frame_nr = a_frame_nr;
+	l_frame->pts = a_pts;
+	return l_frame;
+}
+
+void VideoFrame::set_plane_layout(int a_plane, const Ref<Image> &a_image) {
+	if (a_image.is_null())
+		return;
+
+	plane_size[a_plane] = a_image->get_size();
+	plane_format[a_plane] = a_image->get_format();
+}
+
+PackedByteArray VideoFrame::get_plane_data(int a_plane) {
+	PackedByteArray l_data = PackedByteArray();
+
+	if (!av_frame || a_plane < 0 || a_plane >= 4 || !av_frame->data[a_plane])
+		return l_data;
+
+	const AVPixFmtDescriptor *l_desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(av_frame->format));
+	int l_height = av_frame->height;
+	if (l_desc && (a_plane == 1 || a_plane == 2))
+		l_height = AV_CEIL_RSHIFT(l_height, l_desc->log2_chroma_h);
+
+	l_data.resize(static_cast<int64_t>(av_frame->linesize[a_plane]) * l_height);
+	memcpy(l_data.ptrw(), av_frame->data[a_plane], l_data.size());
+	return l_data;
+}
+
+Ref<Image> VideoFrame::_get_plane_image(int a_plane) {
+	if (!av_frame || plane_format[a_plane] < 0 || !av_frame->data[a_plane])
+		return Ref<Image>();
+
+	// The one copy, straight from the decoder buffer into the Godot image
+	Ref<Image> l_image = Image::create_empty(plane_size[a_plane].x, plane_size[a_plane].y, false, static_cast<Image::Format>(plane_format[a_plane]));
+	int64_t l_size = l_image->get_data().size();
+
+	memcpy(l_image->ptrw(), av_frame->data[a_plane], l_size);
+	return l_image;
+}
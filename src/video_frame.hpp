@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+
+#include <godot_cpp/classes/image.hpp>
+#include <godot_cpp/classes/resource.hpp>
+
+#include "ffmpeg.hpp"
+
+
+using namespace godot;
+
+
+// Pool of plane buffers which the decoder writes into directly through
+// AVCodecContext::get_buffer2. Buffers go back to the pool once the last
+// AVFrame referencing them gets unreferenced, which can be after the pool
+// owner is gone.
+class FramePool {
+private:
+	std::mutex mutex;
+	AVBufferPool *pools[4] = { nullptr, nullptr, nullptr, nullptr };
+	size_t pool_sizes[4] = { 0, 0, 0, 0 };
+
+
+public:
+	~FramePool() { clear(); }
+
+	int get_buffer(AVCodecContext *a_codec_ctx, AVFrame *a_frame);
+	void clear();
+};
+
+
+class VideoFrame : public Resource {
+	GDCLASS(VideoFrame, Resource);
+
+private:
+	AVFrame *av_frame = nullptr;
+
+	int64_t frame_nr = -1;
+	double pts = 0; // In seconds
+
+	// Layout of the planes, matching the y_data/u_data/v_data/a_data of Video
+	Vector2i plane_size[4];
+	int plane_format[4] = { -1, -1, -1, -1 };
+
+
+	Ref<Image> _get_plane_image(int a_plane);
+
+
+public:
+	VideoFrame() {}
+	~VideoFrame() { if (av_frame) av_frame_free(&av_frame); }
+
+	static Ref<VideoFrame> create(const AVFrame *a_frame, int64_t a_frame_nr, double a_pts);
+	void set_plane_layout(int a_plane, const Ref<Image> &a_image);
+
+	inline const AVFrame *get_av_frame() const { return av_frame; }
+
+	inline bool is_valid() { return av_frame != nullptr; }
+	inline int64_t get_frame_nr() { return frame_nr; }
+	inline double get_pts() { return pts; }
+
+	inline int get_width() { return av_frame ? av_frame->width : 0; }
+	inline int get_height() { return av_frame ? av_frame->height : 0; }
+	inline int get_linesize(int a_plane) { return av_frame && a_plane >= 0 && a_plane < 4 ? av_frame->linesize[a_plane] : 0; }
+	inline String get_pixel_format() { return av_frame ? av_get_pix_fmt_name(static_cast<AVPixelFormat>(av_frame->format)) : ""; }
+
+	PackedByteArray get_plane_data(int a_plane);
+
+	inline Ref<Image> get_y_data() { return _get_plane_image(0); }
+	inline Ref<Image> get_u_data() { return _get_plane_image(1); }
+	inline Ref<Image> get_v_data() { return _get_plane_image(2); }
+	inline Ref<Image> get_a_data() { return _get_plane_image(3); }
+
+
+protected:
+	static inline void _bind_methods() {
+		ClassDB::bind_method(D_METHOD("is_valid"), &VideoFrame::is_valid);
+		ClassDB::bind_method(D_METHOD("get_frame_nr"), &VideoFrame::get_frame_nr);
+		ClassDB::bind_method(D_METHOD("get_pts"), &VideoFrame::get_pts);
+
+		ClassDB::bind_method(D_METHOD("get_width"), &VideoFrame::get_width);
+		ClassDB::bind_method(D_METHOD("get_height"), &VideoFrame::get_height);
+		ClassDB::bind_method(D_METHOD("get_linesize", "a_plane"), &VideoFrame::get_linesize);
+		ClassDB::bind_method(D_METHOD("get_pixel_format"), &VideoFrame::get_pixel_format);
+
+		ClassDB::bind_method(D_METHOD("get_plane_data", "a_plane"), &VideoFrame::get_plane_data);
+
+		ClassDB::bind_method(D_METHOD("get_y_data"), &VideoFrame::get_y_data);
+		ClassDB::bind_method(D_METHOD("get_u_data"), &VideoFrame::get_u_data);
+		ClassDB::bind_method(D_METHOD("get_v_data"), &VideoFrame::get_v_data);
+		ClassDB::bind_method(D_METHOD("get_a_data"), &VideoFrame::get_a_data);
+	}
+};
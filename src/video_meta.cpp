@@ -0,0 +1,110 @@
+#include "video_meta.hpp"
+
+
+String VideoMeta::get_cache_path(const String &a_cache_dir, const String &a_path) {
+	return a_cache_dir.path_join(a_path.md5_text() + ".gozen");
+}
+
+bool VideoMeta::read_file_stats(const String &a_path) {
+	Ref<FileAccess> l_file = FileAccess::open(a_path, FileAccess::READ);
+	if (l_file.is_null())
+		return false;
+
+	file_size = l_file->get_length();
+	modified_time = FileAccess::get_modified_time(a_path);
+	return true;
+}
+
+bool VideoMeta::load(const String &a_cache_dir, const String &a_path, PacketIndex &a_index) {
+	String l_cache_path = get_cache_path(a_cache_dir, a_path);
+	if (!FileAccess::file_exists(l_cache_path) || !read_file_stats(a_path))
+		return false;
+
+	Ref<FileAccess> l_file = FileAccess::open(l_cache_path, FileAccess::READ);
+	if (l_file.is_null())
+		return false;
+
+	// Older versions and changed source files make the sidecar stale
+	if (l_file->get_32() != MAGIC || l_file->get_32() != VERSION ||
+			l_file->get_64() != file_size || l_file->get_64() != modified_time)
+		return false;
+
+	resolution.x = l_file->get_32();
+	resolution.y = l_file->get_32();
+	rotation = l_file->get_32();
+	interlaced = l_file->get_32();
+	padding = l_file->get_32();
+	bit_depth = l_file->get_32();
+
+	codec_id = l_file->get_32();
+	source_format = l_file->get_32();
+	decoder_format = l_file->get_32();
+	color_profile = l_file->get_32();
+	full_color_range = l_file->get_8();
+	hw_decoding = l_file->get_8();
+	using_sws = l_file->get_8();
+	pixel_format = l_file->get_pascal_string();
+
+	framerate = l_file->get_double();
+	duration = l_file->get_64();
+	frame_count = l_file->get_64();
+
+	for (int i = 0; i < 4; i++) {
+		plane_width[i] = l_file->get_32();
+		plane_height[i] = l_file->get_32();
+		plane_format[i] = l_file->get_32();
+	}
+
+	if (l_file->get_8() && !a_index.load(l_file)) {
+		a_index.clear();
+		return false;
+	}
+
+	return !l_file->eof_reached() && framerate > 0;
+}
+
+bool VideoMeta::save(const String &a_cache_dir, const String &a_path, const PacketIndex &a_index) {
+	if (DirAccess::make_dir_recursive_absolute(a_cache_dir) != OK)
+		return false;
+
+	Ref<FileAccess> l_file = FileAccess::open(get_cache_path(a_cache_dir, a_path), FileAccess::WRITE);
+	if (l_file.is_null())
+		return false;
+
+	l_file->store_32(MAGIC);
+	l_file->store_32(VERSION);
+	l_file->store_64(file_size);
+	l_file->store_64(modified_time);
+
+	l_file->store_32(resolution.x);
+	l_file->store_32(resolution.y);
+	l_file->store_32(rotation);
+	l_file->store_32(interlaced);
+	l_file->store_32(padding);
+	l_file->store_32(bit_depth);
+
+	l_file->store_32(codec_id);
+	l_file->store_32(source_format);
+	l_file->store_32(decoder_format);
+	l_file->store_32(color_profile);
+	l_file->store_8(full_color_range);
+	l_file->store_8(hw_decoding);
+	l_file->store_8(using_sws);
+	l_file->store_pascal_string(pixel_format);
+
+	l_file->store_double(framerate);
+	l_file->store_64(duration);
+	l_file->store_64(frame_count);
+
+	for (int i = 0; i < 4; i++) {
+		l_file->store_32(plane_width[i]);
+		l_file->store_32(plane_height[i]);
+		l_file->store_32(plane_format[i]);
+	}
+
+	l_file->store_8(!a_index.is_empty());
+	if (!a_index.is_empty())
+		a_index.save(l_file);
+
+	return l_file->get_error() == OK;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+
+#include <godot_cpp/classes/dir_access.hpp>
+#include <godot_cpp/classes/file_access.hpp>
+#include <godot_cpp/classes/image.hpp>
+
+#include "packet_index.hpp"
+
+
+using namespace godot;
+
+
+// Everything Video::open() learns from probing a file, stored as a binary
+// sidecar file inside of the cache directory so reopening can skip probing.
+struct VideoMeta {
+	static constexpr uint32_t MAGIC = 0x435a4447; // "GDZC"
+	static constexpr uint32_t VERSION = 3;
+
+	uint64_t file_size = 0;
+	uint64_t modified_time = 0;
+
+	Vector2i resolution = Vector2i(0, 0);
+	int32_t rotation = 0;
+	int32_t interlaced = 0;
+	int32_t padding = 0;
+	int32_t bit_depth = 8;
+
+	int32_t codec_id = AV_CODEC_ID_NONE;
+	int32_t source_format = AV_PIX_FMT_NONE; // Format from the stream parameters
+	int32_t decoder_format = AV_PIX_FMT_NONE; // Format the software decoder gives
+	int32_t color_profile = AVCOL_PRI_UNSPECIFIED;
+	bool full_color_range = true;
+	bool hw_decoding = false;
+	bool using_sws = false;
+	String pixel_format = "";
+
+	double framerate = 0;
+	int64_t duration = 0;
+	int64_t frame_count = 0;
+
+	// Plane layout of y_data, u_data, v_data and a_data, format -1 for no plane
+	int32_t plane_width[4] = { 0, 0, 0, 0 };
+	int32_t plane_height[4] = { 0, 0, 0, 0 };
+	int32_t plane_format[4] = { -1, -1, -1, -1 };
+
+
+	static String get_cache_path(const String &a_cache_dir, const String &a_path);
+
+	bool load(const String &a_cache_dir, const String &a_path, PacketIndex &a_index);
+	bool save(const String &a_cache_dir, const String &a_path, const PacketIndex &a_index);
+
+	bool read_file_stats(const String &a_path);
+};
@@ -0,0 +1,371 @@
+#include "waveform.hpp"
+
+#include <cmath>
+
+
+int Waveform::open(String a_path, String a_cache_path) {
+	close();
+	path = a_path.utf8();
+
+	if (a_cache_path.is_empty())
+		a_cache_path = get_default_cache_path(a_path);
+
+	// Same check as the video cache, a changed source makes the cache stale
+	uint64_t l_file_size = 0;
+	uint64_t l_modified_time = FileAccess::get_modified_time(a_path);
+	{
+		Ref<FileAccess> l_file = FileAccess::open(a_path, FileAccess::READ);
+		if (l_file.is_valid())
+			l_file_size = l_file->get_length();
+	}
+
+	if (FileAccess::file_exists(a_cache_path) && _load_cache(a_cache_path, l_file_size, l_modified_time)) {
+		opened_from_cache = true;
+		return OK;
+	}
+
+	close(); // A rejected cache may have set some of the fields already
+	if (int l_error = _decode(a_path)) {
+		close();
+		return l_error;
+	}
+
+	_build_levels();
+
+	// Folders with media aren't always writable, the peaks are still usable
+	if (!_save_cache(a_cache_path, l_file_size, l_modified_time))
+		UtilityFunctions::printerr("Couldn't write waveform cache file!");
+
+	return OK;
+}
+
+void Waveform::close() {
+	levels.clear();
+	sample_rate = 0;
+	channels = 0;
+	frame_count = 0;
+	opened_from_cache = false;
+}
+
+int Waveform::_decode(const String &a_path) {
+	AVFormatContext *l_format_ctx = nullptr;
+	AVCodecContext *l_codec_ctx = nullptr;
+	struct SwrContext *l_swr_ctx = nullptr;
+	AVFrame *l_frame = av_frame_alloc();
+	AVFrame *l_decoded_frame = av_frame_alloc();
+	AVPacket *l_packet = av_packet_alloc();
+	const AVCodec *l_codec = nullptr;
+	int l_stream_index = -1;
+	int l_error = OK;
+
+	if (!l_frame || !l_decoded_frame || !l_packet)
+		l_error = GoZenError::ERR_FAILED_ALLOC_FRAME;
+	else if (AvioFile::open_input(&l_format_ctx, a_path.utf8(), NULL))
+		l_error = GoZenError::ERR_OPENING_AUDIO;
+	else if (avformat_find_stream_info(l_format_ctx, NULL))
+		l_error = GoZenError::ERR_NO_STREAM_INFO_FOUND;
+	else if ((l_stream_index = av_find_best_stream(l_format_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, &l_codec, 0)) < 0)
+		l_error = GoZenError::ERR_OPENING_AUDIO;
+	else if (!(l_codec_ctx = avcodec_alloc_context3(l_codec)) ||
+			avcodec_parameters_to_context(l_codec_ctx, l_format_ctx->streams[l_stream_index]->codecpar) < 0)
+		l_error = GoZenError::ERR_FAILED_ALLOC_AUDIO_CODEC;
+	else {
+		for (unsigned int i = 0; i < l_format_ctx->nb_streams; i++)
+			if (i != static_cast<unsigned int>(l_stream_index))
+				l_format_ctx->streams[i]->discard = AVDISCARD_ALL;
+
+		FFmpeg::enable_multithreading(l_codec_ctx, l_codec);
+		l_codec_ctx->request_sample_fmt = AV_SAMPLE_FMT_FLT;
+
+		if (avcodec_open2(l_codec_ctx, l_codec, NULL))
+			l_error = GoZenError::ERR_FAILED_OPEN_AUDIO_CODEC;
+		else if (swr_alloc_set_opts2(&l_swr_ctx, &l_codec_ctx->ch_layout, AV_SAMPLE_FMT_FLT, l_codec_ctx->sample_rate,
+				&l_codec_ctx->ch_layout, l_codec_ctx->sample_fmt, l_codec_ctx->sample_rate, 0, nullptr) < 0 ||
+				swr_init(l_swr_ctx) < 0)
+			l_error = GoZenError::ERR_CREATING_SWR;
+	}
+
+	if (l_error == OK) {
+		sample_rate = l_codec_ctx->sample_rate;
+		channels = l_codec_ctx->ch_layout.nb_channels;
+		levels.push_back({ BASE_BLOCK, {}, {}, {} });
+
+		// Peaks go over all channels, blocks get filled across frames
+		const int64_t l_block_size = BASE_BLOCK * channels;
+		int64_t l_block_fill = 0;
+		float l_min = 0, l_max = 0;
+		double l_squares = 0;
+
+		while (!FFmpeg::get_frame(l_format_ctx, l_codec_ctx, l_stream_index, l_frame, l_packet)) {
+			const AVFrame *l_source = l_frame;
+
+			if (l_frame->format != AV_SAMPLE_FMT_FLT) {
+				l_decoded_frame->format = AV_SAMPLE_FMT_FLT;
+				av_channel_layout_copy(&l_decoded_frame->ch_layout, &l_frame->ch_layout);
+				l_decoded_frame->sample_rate = l_frame->sample_rate;
+				l_decoded_frame->nb_samples = swr_get_out_samples(l_swr_ctx, l_frame->nb_samples);
+
+				if (av_frame_get_buffer(l_decoded_frame, 0) < 0 ||
+						swr_config_frame(l_swr_ctx, l_decoded_frame, l_frame) < 0 ||
+						swr_convert_frame(l_swr_ctx, l_decoded_frame, l_frame) < 0) {
+					UtilityFunctions::printerr("Couldn't convert audio frame for waveform!");
+					av_frame_unref(l_frame);
+					av_frame_unref(l_decoded_frame);
+					continue;
+				}
+				l_source = l_decoded_frame;
+			}
+
+			const float *l_samples = reinterpret_cast<const float *>(l_source->extended_data[0]);
+			int64_t l_count = static_cast<int64_t>(l_source->nb_samples) * channels;
+			frame_count += l_source->nb_samples;
+
+			while (l_count > 0) {
+				int64_t l_take = std::min(l_count, l_block_size - l_block_fill);
+				if (l_block_fill == 0) {
+					l_min = l_samples[0];
+					l_max = l_samples[0];
+				}
+
+				SampleConverter::reduce_peaks(l_samples, l_take, l_min, l_max, l_squares);
+				l_samples += l_take;
+				l_count -= l_take;
+
+				if ((l_block_fill += l_take) == l_block_size) {
+					_add_peak(l_min, l_max, l_squares / l_block_size);
+					l_block_fill = 0;
+					l_squares = 0;
+				}
+			}
+
+			av_frame_unref(l_frame);
+			av_frame_unref(l_decoded_frame);
+		}
+
+		if (l_block_fill > 0)
+			_add_peak(l_min, l_max, l_squares / l_block_fill);
+		if (levels[0].min.empty())
+			l_error = GoZenError::ERR_OPENING_AUDIO;
+	}
+
+	if (l_swr_ctx) swr_free(&l_swr_ctx);
+	if (l_codec_ctx) avcodec_free_context(&l_codec_ctx);
+	if (l_format_ctx) AvioFile::close_input(&l_format_ctx);
+	if (l_frame) av_frame_free(&l_frame);
+	if (l_decoded_frame) av_frame_free(&l_decoded_frame);
+	if (l_packet) av_packet_free(&l_packet);
+
+	return l_error;
+}
+
+void Waveform::_add_peak(float a_min, float a_max, double a_mean_square) {
+	Level &l_level = levels[0];
+
+	l_level.min.push_back(static_cast<int16_t>(std::lround(std::clamp(a_min, -1.f, 1.f) * 32767)));
+	l_level.max.push_back(static_cast<int16_t>(std::lround(std::clamp(a_max, -1.f, 1.f) * 32767)));
+	l_level.rms.push_back(static_cast<uint16_t>(std::lround(std::clamp(std::sqrt(a_mean_square), 0., 1.) * 65535)));
+}
+
+void Waveform::_build_levels() {
+	// Every level combines the peaks of the level below until one peak is left
+	while (levels.back().min.size() > 1) {
+		const Level &l_below = levels.back();
+		Level l_level;
+		int64_t l_count = (l_below.min.size() + LEVEL_FACTOR - 1) / LEVEL_FACTOR;
+
+		l_level.frames_per_peak = l_below.frames_per_peak * LEVEL_FACTOR;
+		l_level.min.resize(l_count);
+		l_level.max.resize(l_count);
+		l_level.rms.resize(l_count);
+
+		for (int64_t i = 0; i < l_count; i++) {
+			int64_t l_from = i * LEVEL_FACTOR;
+			int64_t l_to = std::min<int64_t>(l_from + LEVEL_FACTOR, l_below.min.size());
+			int16_t l_min = l_below.min[l_from], l_max = l_below.max[l_from];
+			double l_squares = 0;
+
+			for (int64_t j = l_from; j < l_to; j++) {
+				l_min = std::min(l_min, l_below.min[j]);
+				l_max = std::max(l_max, l_below.max[j]);
+				l_squares += static_cast<double>(l_below.rms[j]) * l_below.rms[j];
+			}
+
+			l_level.min[i] = l_min;
+			l_level.max[i] = l_max;
+			l_level.rms[i] = static_cast<uint16_t>(std::lround(std::sqrt(l_squares / (l_to - l_from))));
+		}
+
+		levels.push_back(std::move(l_level));
+	}
+}
+
+int64_t Waveform::get_frames_per_peak(int a_level) {
+	if (a_level < 0 || a_level >= static_cast<int>(levels.size()))
+		return 0;
+	return levels[a_level].frames_per_peak;
+}
+
+int64_t Waveform::get_peak_count(int a_level) {
+	if (a_level < 0 || a_level >= static_cast<int>(levels.size()))
+		return 0;
+	return levels[a_level].min.size();
+}
+
+int Waveform::get_level_for(double a_frames_per_peak) {
+	// Most detailed level which doesn't give more peaks than needed
+	int l_level = 0;
+	while (l_level + 1 < static_cast<int>(levels.size()) && levels[l_level + 1].frames_per_peak <= a_frames_per_peak)
+		l_level++;
+	return l_level;
+}
+
+PackedFloat32Array Waveform::get_peaks(int a_level, int64_t a_from, int64_t a_count) {
+	PackedFloat32Array l_peaks = PackedFloat32Array();
+	if (a_level < 0 || a_level >= static_cast<int>(levels.size()))
+		return l_peaks;
+
+	const Level &l_level = levels[a_level];
+	a_from = std::clamp<int64_t>(a_from, 0, l_level.min.size());
+	a_count = std::clamp<int64_t>(a_count, 0, l_level.min.size() - a_from);
+	l_peaks.resize(a_count * 3);
+	float *l_data = l_peaks.ptrw();
+
+	for (int64_t i = 0; i < a_count; i++) {
+		l_data[i * 3] = l_level.min[a_from + i] / 32767.f;
+		l_data[i * 3 + 1] = l_level.max[a_from + i] / 32767.f;
+		l_data[i * 3 + 2] = l_level.rms[a_from + i] / 65535.f;
+	}
+
+	return l_peaks;
+}
+
+PackedFloat32Array Waveform::get_peaks_between(double a_start, double a_end, int a_count) {
+	PackedFloat32Array l_peaks = PackedFloat32Array();
+	if (levels.empty() || a_count <= 0 || a_end <= a_start)
+		return l_peaks;
+
+	double l_frames_per_column = (a_end - a_start) * sample_rate / a_count;
+	const Level &l_level = levels[get_level_for(l_frames_per_column)];
+	const int64_t l_size = l_level.min.size();
+	const double l_start = a_start * sample_rate / l_level.frames_per_peak;
+	const double l_step = l_frames_per_column / l_level.frames_per_peak;
+
+	l_peaks.resize(a_count * 3);
+	float *l_data = l_peaks.ptrw();
+
+	for (int i = 0; i < a_count; i++) {
+		int64_t l_from = static_cast<int64_t>(std::floor(l_start + i * l_step));
+		int64_t l_to = std::max(static_cast<int64_t>(std::floor(l_start + (i + 1) * l_step)), l_from + 1);
+		l_from = std::clamp<int64_t>(l_from, 0, l_size);
+		l_to = std::clamp<int64_t>(l_to, 0, l_size);
+
+		// Columns outside of the audio stay silent
+		int16_t l_min = 0, l_max = 0;
+		double l_squares = 0;
+		if (l_from < l_to) {
+			l_min = l_level.min[l_from];
+			l_max = l_level.max[l_from];
+		}
+
+		for (int64_t j = l_from; j < l_to; j++) {
+			l_min = std::min(l_min, l_level.min[j]);
+			l_max = std::max(l_max, l_level.max[j]);
+			l_squares += static_cast<double>(l_level.rms[j]) * l_level.rms[j];
+		}
+
+		l_data[i * 3] = l_min / 32767.f;
+		l_data[i * 3 + 1] = l_max / 32767.f;
+		l_data[i * 3 + 2] = l_from < l_to ? std::sqrt(l_squares / (l_to - l_from)) / 65535.f : 0.f;
+	}
+
+	return l_peaks;
+}
+
+bool Waveform::_load_cache(const String &a_cache_path, uint64_t a_file_size, uint64_t a_modified_time) {
+	Ref<FileAccess> l_file = FileAccess::open(a_cache_path, FileAccess::READ);
+	if (l_file.is_null())
+		return false;
+
+	if (l_file->get_32() != MAGIC || l_file->get_32() != VERSION ||
+			l_file->get_64() != a_file_size || l_file->get_64() != a_modified_time)
+		return false;
+
+	sample_rate = l_file->get_32();
+	channels = l_file->get_32();
+	frame_count = l_file->get_64();
+
+	uint32_t l_level_count = l_file->get_32();
+	if (l_level_count == 0 || l_level_count > 64) {
+		close();
+		return false;
+	}
+	levels.resize(l_level_count);
+
+	for (Level &l_level : levels) {
+		l_level.frames_per_peak = l_file->get_64();
+		if (!_get_vector(l_file, l_level.min) || !_get_vector(l_file, l_level.max) || !_get_vector(l_file, l_level.rms) ||
+				l_level.min.size() != l_level.max.size() || l_level.min.size() != l_level.rms.size()) {
+			close();
+			return false;
+		}
+	}
+
+	if (l_file->eof_reached() || levels.empty() || sample_rate <= 0) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+bool Waveform::_save_cache(const String &a_cache_path, uint64_t a_file_size, uint64_t a_modified_time) const {
+	Ref<FileAccess> l_file = FileAccess::open(a_cache_path, FileAccess::WRITE);
+	if (l_file.is_null())
+		return false;
+
+	l_file->store_32(MAGIC);
+	l_file->store_32(VERSION);
+	l_file->store_64(a_file_size);
+	l_file->store_64(a_modified_time);
+
+	l_file->store_32(sample_rate);
+	l_file->store_32(channels);
+	l_file->store_64(frame_count);
+	l_file->store_32(levels.size());
+
+	for (const Level &l_level : levels) {
+		l_file->store_64(l_level.frames_per_peak);
+		_store_vector(l_file, l_level.min);
+		_store_vector(l_file, l_level.max);
+		_store_vector(l_file, l_level.rms);
+	}
+
+	return l_file->get_error() == OK;
+}
+
+template <typename T>
+void Waveform::_store_vector(Ref<FileAccess> &a_file, const std::vector<T> &a_vector) {
+	PackedByteArray l_data;
+	l_data.resize(a_vector.size() * sizeof(T));
+	if (!a_vector.empty())
+		memcpy(l_data.ptrw(), a_vector.data(), l_data.size());
+
+	a_file->store_64(a_vector.size());
+	a_file->store_buffer(l_data);
+}
+
+template <typename T>
+bool Waveform::_get_vector(Ref<FileAccess> &a_file, std::vector<T> &a_vector) {
+	uint64_t l_size = a_file->get_64();
+	// Dividing, since a corrupt size could overflow the multiplication
+	if (l_size > (a_file->get_length() - a_file->get_position()) / sizeof(T))
+		return false;
+
+	PackedByteArray l_data = a_file->get_buffer(l_size * sizeof(T));
+	if (static_cast<uint64_t>(l_data.size()) != l_size * sizeof(T))
+		return false;
+
+	a_vector.resize(l_size);
+	if (l_size)
+		memcpy(a_vector.data(), l_data.ptr(), l_data.size());
+	return true;
+}
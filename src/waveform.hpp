@@ -0,0 +1,118 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <godot_cpp/classes/file_access.hpp>
+#include <godot_cpp/classes/resource.hpp>
+#include <godot_cpp/variant/utility_functions.hpp>
+
+#include "ffmpeg.hpp"
+#include "avio_file.hpp"
+#include "gozen_error.hpp"
+#include "sample_converter.hpp"
+
+
+using namespace godot;
+
+
+// Min/max/RMS peaks of an audio track for drawing waveforms. The audio gets
+// decoded once, level 0 has a peak for every BASE_BLOCK frames and every level
+// after that combines LEVEL_FACTOR peaks of the level below. Peaks are kept
+// as 16 bit values and stored in a sidecar file next to the media, so opening
+// the same file again doesn't need a decoder. Opening can take a while for
+// long files, so it's best done from a thread.
+class Waveform : public Resource {
+	GDCLASS(Waveform, Resource);
+
+private:
+	static constexpr uint32_t MAGIC = 0x575a4447; // "GDZW"
+	static constexpr uint32_t VERSION = 1;
+	static constexpr int64_t BASE_BLOCK = 256;
+	static constexpr int64_t LEVEL_FACTOR = 4;
+
+	struct Level {
+		int64_t frames_per_peak = 0;
+		std::vector<int16_t> min;
+		std::vector<int16_t> max;
+		std::vector<uint16_t> rms;
+	};
+
+	std::vector<Level> levels;
+
+	std::string path = "";
+	int sample_rate = 0;
+	int channels = 0;
+	int64_t frame_count = 0;
+	bool opened_from_cache = false;
+
+
+	int _decode(const String &a_path);
+	void _add_peak(float a_min, float a_max, double a_mean_square);
+	void _build_levels();
+
+	bool _load_cache(const String &a_cache_path, uint64_t a_file_size, uint64_t a_modified_time);
+	bool _save_cache(const String &a_cache_path, uint64_t a_file_size, uint64_t a_modified_time) const;
+
+	template <typename T>
+	static void _store_vector(Ref<FileAccess> &a_file, const std::vector<T> &a_vector);
+	template <typename T>
+	static bool _get_vector(Ref<FileAccess> &a_file, std::vector<T> &a_vector);
+
+
+public:
+	Waveform() {}
+	~Waveform() { close(); }
+
+	// An empty cache path puts the cache file next to the media
+	int open(String a_path, String a_cache_path = "");
+	void close();
+
+	static inline String get_default_cache_path(String a_path) { return a_path + ".gzpeaks"; }
+
+	inline bool is_open() { return !levels.empty(); }
+	inline bool is_opened_from_cache() { return opened_from_cache; }
+	inline String get_path() { return path.c_str(); }
+
+	inline int get_sample_rate() { return sample_rate; }
+	inline int get_channels() { return channels; }
+	inline int64_t get_frame_count() { return frame_count; }
+	inline double get_duration() { return sample_rate ? static_cast<double>(frame_count) / sample_rate : 0.; }
+
+	inline int get_level_count() { return levels.size(); }
+	int64_t get_frames_per_peak(int a_level);
+	int64_t get_peak_count(int a_level);
+	int get_level_for(double a_frames_per_peak);
+
+	// Min, max and rms for every peak, all between -1 and 1
+	PackedFloat32Array get_peaks(int a_level, int64_t a_from, int64_t a_count);
+	// Min, max and rms for a_count columns between a_start and a_end seconds,
+	// taken from the level which fits best
+	PackedFloat32Array get_peaks_between(double a_start, double a_end, int a_count);
+
+
+protected:
+	static inline void _bind_methods() {
+		ClassDB::bind_method(D_METHOD("open", "a_path", "a_cache_path"), &Waveform::open, DEFVAL(""));
+		ClassDB::bind_method(D_METHOD("close"), &Waveform::close);
+
+		ClassDB::bind_static_method("Waveform", D_METHOD("get_default_cache_path", "a_path"), &Waveform::get_default_cache_path);
+
+		ClassDB::bind_method(D_METHOD("is_open"), &Waveform::is_open);
+		ClassDB::bind_method(D_METHOD("is_opened_from_cache"), &Waveform::is_opened_from_cache);
+		ClassDB::bind_method(D_METHOD("get_path"), &Waveform::get_path);
+
+		ClassDB::bind_method(D_METHOD("get_sample_rate"), &Waveform::get_sample_rate);
+		ClassDB::bind_method(D_METHOD("get_channels"), &Waveform::get_channels);
+		ClassDB::bind_method(D_METHOD("get_frame_count"), &Waveform::get_frame_count);
+		ClassDB::bind_method(D_METHOD("get_duration"), &Waveform::get_duration);
+
+		ClassDB::bind_method(D_METHOD("get_level_count"), &Waveform::get_level_count);
+		ClassDB::bind_method(D_METHOD("get_frames_per_peak", "a_level"), &Waveform::get_frames_per_peak);
+		ClassDB::bind_method(D_METHOD("get_peak_count", "a_level"), &Waveform::get_peak_count);
+		ClassDB::bind_method(D_METHOD("get_level_for", "a_frames_per_peak"), &Waveform::get_level_for);
+
+		ClassDB::bind_method(D_METHOD("get_peaks", "a_level", "a_from", "a_count"), &Waveform::get_peaks);
+		ClassDB::bind_method(D_METHOD("get_peaks_between", "a_start", "a_end", "a_count"), &Waveform::get_peaks_between);
+	}
+};
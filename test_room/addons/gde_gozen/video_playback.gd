@@ -4,15 +4,14 @@ extends Control
 ##
 ## To use this node, just add it anywhere and resize it to the desired size. Use the function [code]set_video_path(a_path)[/code] and the video will load. Take in mind that long video's can take a second or longer to load. If this is an issue you can preload the Video on startup of your project and set the video variable yourself, just remember to use the function [code]update_video()[/code] before the moment that you'd like to use it.
 ## [br][br]
-## There is a small limitation right now as FFmpeg requires a path to the video file so you can't make the video's part of the exported project and the [code]res://[/code] paths also don't work. This is just the nature of the beast and not something I can easily solve, but luckily there are solutions! First of all, the video path should be the full path, for testing this is easy as you can make the path whatever you want it to be, for exported projects ... Well, chances of the path being in the exact same location as on your pc are quite low.
-## [br][br]
-## The solution for exported projects is to create a folder inside of your exported projects in which you keep the video files, inside of your code you can check if the project is run from the editor or not with: [code]OS.has_feature(“editor”)[/code]. To get the path of your running project to find the folder where your video's are stored you can use [code]OS.get_executable_path()[/code]. So it requires a bit of code to get things properly working but everything should work without issues this way.
+## Video files can be opened with [code]res://[/code] and [code]user://[/code] paths, those get read through Godot's FileAccess so videos inside of the exported PCK play without extracting them first. Godot doesn't export video files by default, add their extensions to "Filters to export non-resource files/folders" in the export settings. Full paths to files outside of the project work as well.
 
 
 signal frame_changed(frame_nr: int) ## Emitted when the current frame has changed, for showing and skipped frames.
 signal next_frame_called(frame_nr: int) ## Emitted when a new frame is showing.
 
 signal video_loaded ## Emitted when the video is ready for playback.
+signal video_load_progress(progress: float) ## Emitted while the video is opening, progress goes from 0 to 1. Mostly useful for long audio tracks which need decoding.
 signal video_ended ## Emitted when the last frame has been shown.
 
 signal playback_started ## Emitted when playback started/resumed.
@@ -24,8 +23,13 @@ const PLAYBACK_SPEED_MIN: float = 0.25
 const PLAYBACK_SPEED_MAX: float = 4
 
 
-@export_file var path: String = "": set = set_video_path ## Full path to video file. Do not use [code]res://[/code] paths, only provide [b]full[/b] paths. Solutions for setting the path in both editor and exported projects can be found in the readme info or on top.
+@export_file var path: String = "": set = set_video_path ## Path to the video file, [code]res://[/code], [code]user://[/code] and full paths all work.
 @export var hardware_decoding: bool = false ## Enable GPU decoding when available, this isn't useful for most cases due to some codecs being slower with GPU decoding.
+@export var build_index: bool = false ## Reads through all packets of the video when loading to know where each frame and keyframe is. Loading takes a bit longer, but seeking becomes exact for variable frame rate video's (phone recordings) and only decodes what is needed.
+@export_dir var cache_dir: String = "" ## Folder in which info about opened video files gets stored (resolution, frame rate, frame count, packet index, ...) so opening the same file again is a lot faster. Leave empty to disable, [code]user://[/code] paths work as well.
+@export_range(0, 64) var prefetch_frames: int = 0 ## Amount of frames which get decoded ahead of time on a separate thread. Helps with heavy video files (4K H.264/HEVC) where decoding a single frame can take longer than the frame time. Setting this to 0 disables prefetching.
+@export_file var proxy_path: String = "" ## Full path to a proxy of the video file, made with ProxyGenerator. When the file exists, frames get decoded from the proxy instead which makes editing heavy video files a lot smoother. Audio and the reported resolution still come from the video file itself.
+@export var frame_cache_size: int = 0 ## Size in MB of the cache which keeps recently shown frames around, this makes seeking back to frames which were shown a moment ago a lot faster. Useful for scrubbing, setting this to 0 disables the cache.
 @export var enable_audio: bool = true ## Enable/Disable audio playback. When setting this on false before loading the audio, the audio playback won't be loaded meaning that the video will load faster. If you want audio but only disable it at certain moments, switch this value to false *after* the video is loaded.
 @export var enable_auto_play: bool = false ## Enable/disable auto video playback.
 @export_range(PLAYBACK_SPEED_MIN, PLAYBACK_SPEED_MAX, 0.05)
@@ -55,12 +59,12 @@ var _resolution: Vector2i = Vector2i.ZERO
 var _uv_resolution: Vector2i = Vector2i.ZERO
 var _shader_material: ShaderMaterial = null
 
-var _thread: Thread = Thread.new()
 var _audio_pitch_effect: AudioEffectPitchShift = AudioEffectPitchShift.new()
 
 var y_texture: ImageTexture;
 var u_texture: ImageTexture;
 var v_texture: ImageTexture;
+var a_texture: ImageTexture;
 
 
 #------------------------------------------------ TREE FUNCTIONS
@@ -114,14 +118,21 @@ func set_video_path(a_path: String) -> void:
 
 	# Windows hardware decoding is NOT available so should always be false to prevent crashing.
 	video.set_hw_decoding(hardware_decoding if OS.get_name() != "Windows" else false)
+	video.set_build_index(build_index)
+	video.set_cache_dir(cache_dir)
+	video.set_proxy_path(proxy_path)
+	video.set_prefetch_frames(prefetch_frames)
+	video.set_frame_cache_size(frame_cache_size * 1024 * 1024)
 
 	if debug:
 		video.enable_debug()
 	else:
 		video.disable_debug()
 
-	if _thread.start(_open_video):
-		printerr("Couldn't create thread!")
+	video.opened.connect(_on_video_opened.bind(video))
+	video.open_progress.connect(video_load_progress.emit)
+	if video.open_async(path, enable_audio):
+		printerr("Couldn't start opening video!")
 
 
 func update_video(a_video: Video) -> void:
@@ -146,7 +157,23 @@ func update_video(a_video: Video) -> void:
 
 	video_texture.texture.set_image(l_image)
 
-	if video.get_pixel_format().begins_with("yuv"):
+	if video.get_pixel_format().begins_with("p010"):
+		if video.is_full_color_range():
+			_shader_material.shader = preload("res://addons/gde_gozen/shaders/p010_full.gdshader")
+		else:
+			_shader_material.shader = preload("res://addons/gde_gozen/shaders/p010_standard.gdshader")
+	elif video.get_bit_depth() > 8:
+		if video.is_full_color_range():
+			_shader_material.shader = preload("res://addons/gde_gozen/shaders/yuv420p16_full.gdshader")
+		else:
+			_shader_material.shader = preload("res://addons/gde_gozen/shaders/yuv420p16_standard.gdshader")
+		_shader_material.set_shader_parameter("max_value", float((1 << video.get_bit_depth()) - 1))
+	elif video.get_pixel_format().begins_with("yuva"):
+		if video.is_full_color_range():
+			_shader_material.shader = preload("res://addons/gde_gozen/shaders/yuva420p_full.gdshader")
+		else:
+			_shader_material.shader = preload("res://addons/gde_gozen/shaders/yuva420p_standard.gdshader")
+	elif video.get_pixel_format().begins_with("yuv"): # Also 422, 444 and yuvj
 		if video.is_full_color_range():
 			_shader_material.shader = preload("res://addons/gde_gozen/shaders/yuv420p_full.gdshader")
 		else:
@@ -163,7 +190,8 @@ func update_video(a_video: Video) -> void:
 		_: # bt709 and unknown
 			_shader_material.set_shader_parameter("color_profile", Vector4(1.5748, 0.1873, 0.4681, 1.8556))
 
-	_shader_material.set_shader_parameter("resolution", _resolution)
+	# Proxies have a smaller frame size than the resolution we show
+	_shader_material.set_shader_parameter("resolution", video.get_frame_resolution())
 	
 	if enable_audio:
 		audio_player.stream = video.get_audio()
@@ -196,6 +224,16 @@ func seek_frame(a_frame_nr: int) -> void:
 		audio_player.set_stream_paused(!is_playing)
 
 
+func set_preview_quality(a_value: bool) -> void:
+	## Enable this while the user is dragging the playhead, frames will be decoded faster but less accurate. Disabling it again replaces the current frame with an exact one.
+	if !is_open():
+		return
+
+	video.set_preview_quality(a_value)
+	if !a_value:
+		_set_frame_image()
+
+
 func next_frame(a_skip: bool = false) -> void:
 	## Seeking frames can be slow, so when you just need to go a couple of frames ahead, you can use next_frame and set skip to false for the last frame.
 	if video.next_frame(a_skip) and !a_skip:
@@ -209,19 +247,13 @@ func close() -> void:
 	if video != null:
 		if is_playing:
 			pause()
+		if video.is_opening():
+			video.cancel()
 		video = null
 
 
 #------------------------------------------------ PLAYBACK HANDLING
 func _process(a_delta: float) -> void:
-	if _thread.is_started():
-		if !_thread.is_alive():
-			_thread.wait_to_finish()
-			update_video(video)
-			if enable_auto_play:
-				play()
-		return
-
 	if is_playing:
 		_time_elapsed += a_delta
 
@@ -317,16 +349,24 @@ func _set_frame_image() -> void:
 		u_texture = ImageTexture.create_from_image(video.get_u_data())
 		if video.get_pixel_format().begins_with("yuv"):
 			v_texture = ImageTexture.create_from_image(video.get_v_data())
+		if video.get_a_data() != null:
+			a_texture = ImageTexture.create_from_image(video.get_a_data())
 	else: #just need to update texture, should be faster
 		y_texture.update(video.get_y_data())
 		u_texture.update(video.get_u_data())
 		if video.get_pixel_format().begins_with("yuv"):
 			v_texture.update(video.get_v_data())
+		if a_texture != null:
+			a_texture.update(video.get_a_data())
 
 	_shader_material.set_shader_parameter("y_data", y_texture)
-	_shader_material.set_shader_parameter("u_data", u_texture)
 	if video.get_pixel_format().begins_with("yuv"):
+		_shader_material.set_shader_parameter("u_data", u_texture)
 		_shader_material.set_shader_parameter("v_data", v_texture)
+		if a_texture != null:
+			_shader_material.set_shader_parameter("a_data", a_texture)
+	else: # NV12 and P010 have U and V interleaved in one plane
+		_shader_material.set_shader_parameter("uv_data", u_texture)
 
 
 func set_playback_speed(a_value: float) -> void:
@@ -355,11 +395,18 @@ func _set_pitch_adjust() -> void:
 
 
 #------------------------------------------------ MISC
-func _open_video() -> void:
-	var err: int = video.open(path, enable_audio)
-	if err:
-		printerr("Error opening video!")
-		GoZenError.print_error(err)
+func _on_video_opened(a_error: int, a_video: Video) -> void:
+	if a_video != video:
+		return # Another video got set while this one was opening
+	elif a_error:
+		if a_error != GoZenError.ERR_CANCELLED:
+			printerr("Error opening video!")
+			GoZenError.print_error(a_error)
+		return
+
+	update_video(video)
+	if enable_auto_play:
+		play()
 
 
 func _print_system_debug() -> void:
@@ -383,10 +430,15 @@ func _print_video_debug() -> void:
 	if OS.get_name() != "Windows":
 		print("HW decoding: ", video.get_hw_decoding())
 	print("Pixel format: ", video.get_pixel_format())
+	print("Using sws: ", video.is_using_sws())
+	print("Using proxy: ", video.is_using_proxy())
 	print("Color profile: ", video.get_color_profile())
 	print("Framerate: ", _frame_rate)
 	print("Duration (in frames): ", _frame_count)
 	print("Padding: ", _padding)
 	print("Rotation: ", _rotation)
 	print("Full color range: ", video.is_full_color_range())
+	print("Bit depth: ", video.get_bit_depth())
+	print("Prefetch frames: ", video.get_prefetch_frames())
+	print("Open time (usec): ", video.get_open_time(), " (cached)" if video.is_opened_from_cache() else "")
 	
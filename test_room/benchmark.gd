@@ -0,0 +1,136 @@
+extends SceneTree
+## Benchmark suite for the hot paths of the extension, run it through
+## `scons benchmark godot=<godot binary>` or directly with:
+## godot --headless --path test_room --script res://benchmark.gd -- --output=<file>
+##
+## The test media gets generated with the Renderer class (lavfi isn't part of
+## our FFmpeg builds) and results are printed as JSON.
+
+const MEDIA_DIR: String = "user://benchmark"
+const DURATION: int = 10 # In seconds
+const FRAMERATE: int = 30
+const SAMPLE_RATE: int = 44100
+const SEEKS: int = 100
+const COPIES: int = 100
+
+# Codecs are FFmpeg encoder names which don't need any external libraries
+const MEDIA: Array[Dictionary] = [
+	{ "name": "mpeg4_720p_gop12", "codec": "mpeg4", "resolution": Vector2i(1280, 720), "gop": 12 },
+	{ "name": "mpeg4_1080p_gop12", "codec": "mpeg4", "resolution": Vector2i(1920, 1080), "gop": 12 },
+	{ "name": "mpeg4_1080p_gop250", "codec": "mpeg4", "resolution": Vector2i(1920, 1080), "gop": 250 },
+	{ "name": "mjpeg_1080p_intra", "codec": "mjpeg", "resolution": Vector2i(1920, 1080), "gop": 1 },
+	{ "name": "mpeg4_2160p_gop30", "codec": "mpeg4", "resolution": Vector2i(3840, 2160), "gop": 30 },
+]
+
+
+
+func _init() -> void:
+	var l_output: String = ""
+	for l_arg: String in OS.get_cmdline_user_args():
+		if l_arg.begins_with("--output="):
+			l_output = l_arg.trim_prefix("--output=")
+
+	if DirAccess.make_dir_recursive_absolute(MEDIA_DIR):
+		printerr("Couldn't create benchmark directory!")
+		quit(1)
+		return
+
+	var l_results: Dictionary = {
+		"godot_version": Engine.get_version_info().string,
+		"os": OS.get_name(),
+		"processor": OS.get_processor_name(),
+		"processor_count": OS.get_processor_count(),
+		"rgba": Video.benchmark_rgba(),
+		"mix": AudioStreamFFmpeg.benchmark_mix(),
+		"files": {},
+	}
+
+	for l_media: Dictionary in MEDIA:
+		var l_path: String = "%s/%s.mp4" % [MEDIA_DIR, l_media.name]
+
+		if !FileAccess.file_exists(l_path) and generate_media(l_path, l_media):
+			printerr("Couldn't generate '%s'!" % l_media.name)
+			var _remove_error: int = DirAccess.remove_absolute(l_path)
+			continue
+
+		var l_file: Dictionary = Video.benchmark_file(l_path, SEEKS, COPIES)
+		l_file.codec = l_media.codec
+		l_file.gop = l_media.gop
+		l_file.audio = Audio.benchmark_file(l_path)
+		l_results.files[l_media.name] = l_file
+
+	var l_json: String = JSON.stringify(l_results, "\t")
+	print(l_json)
+
+	if l_output != "":
+		var l_file: FileAccess = FileAccess.open(l_output, FileAccess.WRITE)
+		if l_file == null:
+			printerr("Couldn't write results to '%s'!" % l_output)
+		else:
+			l_file.store_string(l_json)
+
+	quit()
+
+
+## Moving color bars with a 440 Hz sine, like lavfi testsrc and sine.
+func generate_media(a_path: String, a_media: Dictionary) -> int:
+	var l_renderer: Renderer = Renderer.new()
+	var l_resolution: Vector2i = a_media.resolution
+
+	l_renderer.set_video_codec(a_media.codec)
+	l_renderer.set_resolution(l_resolution)
+	l_renderer.set_framerate(FRAMERATE)
+	l_renderer.set_gop_size(a_media.gop)
+	l_renderer.set_sample_rate(SAMPLE_RATE)
+	l_renderer.set_audio_channels(2)
+
+	var l_error: int = l_renderer.open(a_path)
+	if l_error:
+		GoZenError.print_error(l_error)
+		return l_error
+
+	# One second of audio, cut into a chunk for each frame
+	var l_sine: PackedByteArray = []
+	if l_sine.resize(SAMPLE_RATE * 4):
+		return ERR_OUT_OF_MEMORY
+	for i: int in SAMPLE_RATE:
+		var l_sample: int = int(sin(TAU * 440 * i / SAMPLE_RATE) * 16000)
+		l_sine.encode_s16(i * 4, l_sample)
+		l_sine.encode_s16(i * 4 + 2, l_sample)
+
+	@warning_ignore("integer_division")
+	var l_chunk: int = (SAMPLE_RATE / FRAMERATE) * 4
+	@warning_ignore("integer_division")
+	var l_bar_width: int = l_resolution.x / 8
+
+	for l_frame_nr: int in DURATION * FRAMERATE:
+		var l_image: Image = Image.create_empty(l_resolution.x, l_resolution.y, false, Image.FORMAT_RGBA8)
+		for i: int in 8:
+			var l_x: int = (i * l_bar_width + l_frame_nr * 8) % l_resolution.x
+			l_image.fill_rect(Rect2i(l_x, 0, l_bar_width, l_resolution.y), Color.from_hsv(i / 8.0, 0.8, 0.9))
+
+		var l_second_frame: int = l_frame_nr % FRAMERATE
+		var l_audio: PackedByteArray = l_sine.slice(l_second_frame * l_chunk, (l_second_frame + 1) * l_chunk)
+
+		l_error = send_data(l_renderer, l_image, l_audio)
+		if l_error:
+			GoZenError.print_error(l_error)
+			var _close_error: int = l_renderer.close()
+			return l_error
+
+	return l_renderer.close()
+
+
+## Sending doesn't block, so we wait ourselves when the queue is full.
+func send_data(a_renderer: Renderer, a_image: Image, a_audio: PackedByteArray) -> int:
+	while a_renderer.is_queue_full():
+		OS.delay_msec(1)
+
+	var l_error: int = a_renderer.send_frame(a_image)
+	if l_error:
+		return l_error
+
+	while a_renderer.is_queue_full():
+		OS.delay_msec(1)
+
+	return a_renderer.send_audio(a_audio)